@@ -0,0 +1,43 @@
+#!/bin/bash
+# Assembler stress test: generates a BENCH_ASM_LINES line program (default:
+# a million) full of forward and backward jumps and calls, assembles it, runs
+# it to check the labels came out right, and writes the assembly time to
+# stdout as JSON.
+
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+lines=${BENCH_ASM_LINES:-1000000}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Six lines per block; the result is the sum of (i % 7) + 3 over the blocks
+awk -v blocks=$((lines / 6)) 'BEGIN {
+    print "start:"
+    print "    mov r0 0"
+    print "    jmp b0"
+
+    for (i = 0; i < blocks; i++) {
+        printf "b%d:\n    add r0 %d\n    cmp r0 0\n    jl b%d\n", i, i % 7, i
+        printf "    call add3\n    jmp b%d\n", i + 1
+        sum += i % 7 + 3
+    }
+
+    printf "b%d:\n    print r0\n    exit\n", blocks
+    printf "add3:\n    add r0 3\n    ret\n"
+    print sum > "/dev/stderr"
+}' > "$work/stress.basm" 2> "$work/expected"
+
+start=$(date +%s.%N)
+(cd "$work" && "$root/bin/basm" stress.basm > /dev/null)
+end=$(date +%s.%N)
+
+if [ "$("$root/bin/bemu" "$work/b.out")" != "$(cat "$work/expected")" ]; then
+    echo "Assembled stress program gave the wrong result." >&2
+    exit 1
+fi
+
+printf '{"workload": "assemble", "engine": "basm", "lines": %d, ' \
+    $(wc -l < "$work/stress.basm")
+awk -v s=$start -v e=$end 'BEGIN { printf "\"seconds\": %.6f}\n", e - s }'
@@ -0,0 +1,71 @@
+#!/bin/bash
+# Runs every workload in bench/ on each engine and writes the results to
+# stdout as JSON. Each result is the fastest of BENCH_RUNS runs. The
+# assembler stress test in asm.sh goes last.
+#
+#   BENCH_ENGINES  engines to try (default: call goto tail jit)
+#   BENCH_RUNS     runs per workload and engine (default: 3)
+
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+engines=${BENCH_ENGINES:-call goto tail jit}
+runs=${BENCH_RUNS:-3}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+engine_flag()
+{
+    if [ "$1" = jit ]; then
+        echo --jit
+    else
+        echo --dispatch=$1
+    fi
+}
+
+# The stats line bemu --run-stats writes, for the fastest run
+fastest()
+{
+    awk -F'"seconds": ' '{ split($2, v, ","); print v[1], $0 }' |
+        sort -g | head -n 1 | cut -d' ' -f2-
+}
+
+echo "{"
+echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+echo "  \"commit\": \"$(git -C "$root" rev-parse --short HEAD 2>/dev/null)\","
+echo "  \"host\": \"$(uname -sm)\","
+echo "  \"results\": ["
+
+separator=""
+
+for source in "$root"/bench/*.basm; do
+    name=$(basename "$source" .basm)
+
+    (cd "$work" && "$root/bin/basm" "$source" > /dev/null &&
+        mv b.out "$name.out")
+
+    for engine in $engines; do
+        flag=$(engine_flag $engine)
+        : > "$work/stats"
+
+        # Engines this build doesn't have are left out
+        for i in $(seq $runs); do
+            "$root/bin/bemu" $flag --run-stats "$work/$name.out" \
+                > /dev/null 2> "$work/run" || continue 2
+            tail -n 1 "$work/run" >> "$work/stats"
+        done
+
+        stats=$(fastest < "$work/stats")
+
+        printf '%s    {"workload": "%s", "engine": "%s", %s' \
+            "$separator" "$name" "$engine" "${stats#\{}"
+        separator=$',\n'
+    done
+done
+
+printf '%s    %s' "$separator" "$("$root/bench/asm.sh")"
+
+echo
+echo "  ]"
+echo "}"
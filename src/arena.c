@@ -0,0 +1,71 @@
+#include <stdlib.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 8
+
+void arena_init(arena* a, size_t block_size)
+{
+    a->block = NULL;
+    a->block_size = block_size;
+}
+
+static arena_block* arena_grow(arena* a, size_t size)
+{
+    size_t block_size = size > a->block_size ? size : a->block_size;
+    arena_block* block = malloc(sizeof(arena_block) + block_size);
+
+    block->prev = a->block;
+    block->size = block_size;
+    block->used = 0;
+
+    a->block = block;
+
+    return block;
+}
+
+void* arena_alloc(arena* a, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    arena_block* block = a->block;
+
+    if (!block || block->size - block->used < size)
+    {
+        block = arena_grow(a, size);
+    }
+
+    void* p = block->data + block->used;
+    block->used += size;
+
+    return p;
+}
+
+arena_mark arena_save(arena* a)
+{
+    arena_mark mark = { a->block, a->block ? a->block->used : 0 };
+
+    return mark;
+}
+
+void arena_restore(arena* a, arena_mark mark)
+{
+    while (a->block != mark.block)
+    {
+        arena_block* prev = a->block->prev;
+        free(a->block);
+        a->block = prev;
+    }
+
+    if (a->block)
+    {
+        a->block->used = mark.used;
+    }
+}
+
+void arena_free(arena* a)
+{
+    arena_mark empty = { NULL, 0 };
+
+    arena_restore(a, empty);
+}
@@ -0,0 +1,41 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator for things that all die together. Memory comes from a chain
+// of blocks and is only given back by arena_restore or arena_free.
+typedef struct arena_block
+{
+    struct arena_block* prev;
+    size_t size;
+    size_t used;
+    unsigned char data[];
+} arena_block;
+
+typedef struct arena
+{
+    arena_block* block;
+    size_t block_size;
+} arena;
+
+// A point to roll an arena back to, freeing everything allocated since
+typedef struct arena_mark
+{
+    arena_block* block;
+    size_t used;
+} arena_mark;
+
+void arena_init(arena* a, size_t block_size);
+
+// 8-byte aligned. Requests bigger than the block size get a block of their
+// own.
+void* arena_alloc(arena* a, size_t size);
+
+arena_mark arena_save(arena* a);
+
+void arena_restore(arena* a, arena_mark mark);
+
+void arena_free(arena* a);
+
+#endif
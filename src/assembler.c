@@ -2,82 +2,167 @@
 #include <malloc.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <ctype.h>
 
 #include "assembler.h"
+#include "keywords.h"
+#include "peephole.h"
+#include "keyword_tables.h"
+
+// The arena holds everything assemble() keeps until it's done; the scratch
+// arena holds each line's pieces and is rolled back after every line
+#define ASM_ARENA_BLOCK (1024 * 1024)
+#define ASM_SCRATCH_BLOCK (4 * 1024)
 
 typedef struct label
 {
     bstring name;
-    unsigned address;
+    uint64_t address;
+    bool defined;
+    // First jump still waiting for this label, or -1
+    int64_t pending;
 } label;
 
 VECTOR_H(label)
 VECTOR_C(label)
 
+// A jump or call whose label wasn't defined yet when it was parsed. Jumps
+// waiting on the same label form a list through next.
 typedef struct jump
 {
-    unsigned short inst_index;
-    bstring label_name;
+    uint64_t inst_index;
+    int64_t next;
 } jump;
 
 VECTOR_H(jump)
 VECTOR_C(jump)
 
+// Labels, found by name through an open-addressed hash of their indices
+typedef struct symbol_table
+{
+    vec_label labels;
+    // Label indices, or -1 for an empty slot
+    int64_t* slots;
+    uint64_t capacity;
+    arena* arena;
+} symbol_table;
+
+// Set while assemble_checked() runs, so malformed source comes back to it
+// instead of ending the process
+static _Thread_local jmp_buf* recover;
+static _Thread_local char* recover_error;
+static _Thread_local size_t recover_error_len;
+
+// Reports malformed source. Outside assemble_checked() that's the message on
+// stdout and the exit code, as basm has always done.
+static void parse_error(int code, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+
+    if (recover)
+    {
+        vsnprintf(recover_error, recover_error_len, format, args);
+        va_end(args);
+        longjmp(*recover, code);
+    }
+
+    vprintf(format, args);
+    va_end(args);
+
+    putchar('\n');
+    exit(code);
+}
+
+static bool find_keyword(
+        const keyword* table,
+        uint32_t seed,
+        uint32_t mask,
+        bstring src,
+        unsigned char* value)
+{
+    const keyword* k = &table[keyword_hash(src.data, src.len, seed) & mask];
+
+    if (!k->name || k->len != src.len || memcmp(k->name, src.data, src.len))
+    {
+        return false;
+    }
+
+    *value = k->value;
+
+    return true;
+}
+
 unsigned char opcode_from_bstring(bstring src)
 {
-    if      (bstring_cmp(src, bstring_from_char("push")))  { return OP_PUSH;  }
-    else if (bstring_cmp(src, bstring_from_char("pop")))   { return OP_POP;   }
-    else if (bstring_cmp(src, bstring_from_char("jmp")))   { return OP_JMP;   }
-    else if (bstring_cmp(src, bstring_from_char("exit")))  { return OP_EXIT;  }
-    else if (bstring_cmp(src, bstring_from_char("mov")))   { return OP_MOV;   }
-    else if (bstring_cmp(src, bstring_from_char("call")))  { return OP_CALL;  }
-    else if (bstring_cmp(src, bstring_from_char("ret")))   { return OP_RET;   }
-    else if (bstring_cmp(src, bstring_from_char("add")))   { return OP_ADD;   }
-    else if (bstring_cmp(src, bstring_from_char("sub")))   { return OP_SUB;   }
-    else if (bstring_cmp(src, bstring_from_char("mul")))   { return OP_MUL;   }
-    else if (bstring_cmp(src, bstring_from_char("div")))   { return OP_DIV;   }
-    else if (bstring_cmp(src, bstring_from_char("mod")))   { return OP_MOD;   }
-    else if (bstring_cmp(src, bstring_from_char("inc")))   { return OP_INC;   }
-    else if (bstring_cmp(src, bstring_from_char("dec")))   { return OP_DEC;   }
-    else if (bstring_cmp(src, bstring_from_char("cmp")))   { return OP_CMP;   }
-    else if (bstring_cmp(src, bstring_from_char("je")))    { return OP_JE;    }
-    else if (bstring_cmp(src, bstring_from_char("jne")))   { return OP_JNE;   }
-    else if (bstring_cmp(src, bstring_from_char("jl")))    { return OP_JL;    }
-    else if (bstring_cmp(src, bstring_from_char("jle")))   { return OP_JLE;   }
-    else if (bstring_cmp(src, bstring_from_char("jg")))    { return OP_JG;    }
-    else if (bstring_cmp(src, bstring_from_char("jge")))   { return OP_JGE;   }
-    else if (bstring_cmp(src, bstring_from_char("print"))) { return OP_PRINT; }
-
-    printf("Unrecognized opcode\n");
-    exit(6);
+    unsigned char opcode;
+
+    if (!find_keyword(mnemonic_table, MNEMONIC_SEED, MNEMONIC_MASK, src,
+                      &opcode))
+    {
+        parse_error(6, "Unrecognized opcode");
+    }
+
+    return opcode;
+}
+
+bool register_from_name(bstring src, unsigned char* reg)
+{
+    return find_keyword(register_table, REGISTER_SEED, REGISTER_MASK, src,
+                        reg);
 }
 
 unsigned char register_from_bstring(bstring src)
 {
-    if      (bstring_cmp(src, bstring_from_char("r0")))   { return R0;  }
-    else if (bstring_cmp(src, bstring_from_char("r1")))   { return R1;  }
-    else if (bstring_cmp(src, bstring_from_char("r2")))   { return R2;  }
-    else if (bstring_cmp(src, bstring_from_char("r3")))   { return R3;  }
-    else if (bstring_cmp(src, bstring_from_char("r4")))   { return R4;  }
-    else if (bstring_cmp(src, bstring_from_char("r5")))   { return R5;  }
-    else if (bstring_cmp(src, bstring_from_char("rip")))  { return RIP; }
-    else if (bstring_cmp(src, bstring_from_char("rsp")))  { return RSP; }
-    else if (bstring_cmp(src, bstring_from_char("rmem"))) { return RMEM; }
-    else
+    unsigned char reg;
+
+    if (!register_from_name(src, &reg))
+    {
+        parse_error(8, "Unrecognized register.");
+    }
+
+    return reg;
+}
+
+unsigned char vector_from_bstring(bstring src)
+{
+    unsigned char reg;
+
+    if (!find_keyword(vector_table, VECTOR_SEED, VECTOR_MASK, src, &reg))
     {
-        printf("Unrecognized register.\n");
-        exit(8);
+        parse_error(8, "Unrecognized vector register.");
     }
+
+    return reg;
 }
 
-int bstring_to_int(bstring* in)
+// Literals are parsed from a terminated copy; no number needs more than this
+#define LITERAL_MAX 63
+
+static void literal_to_char(bstring* in, char* buf)
 {
-    char buf[21];
+    if (in->len > LITERAL_MAX)
+    {
+        parse_error(13, "Literal too long [%.*s].", in->len, in->data);
+    }
+
     bstring_to_char(in, buf);
+}
+
+int bstring_to_int(bstring* in)
+{
+    char buf[LITERAL_MAX + 1];
+    literal_to_char(in, buf);
     return atoi(buf);
 }
 
-void parse_operand(bstring in, instruction* inst, int ordinal)
+void parse_operand(
+        arena* scratch,
+        bstring in,
+        instruction* inst,
+        int ordinal)
 {
     unsigned char* type = &inst->operand_types[ordinal];
     *type = 0;
@@ -99,7 +184,7 @@ void parse_operand(bstring in, instruction* inst, int ordinal)
     {
         *type |= REGISTER;
 
-        vec_bstring sections = vec_bstring_new();
+        vec_bstring sections = vec_bstring_new_in(scratch, 4);
         bstring_split(&in, "*+-", &sections);
 
         complex_operand* comp = (complex_operand*)data;
@@ -110,7 +195,7 @@ void parse_operand(bstring in, instruction* inst, int ordinal)
         comp->register2 = 0;
         comp->offset = 0;
 
-        for (int i = 1; i < sections.len; i++)
+        for (uint64_t i = 1; i < sections.len; i++)
         {
             char sign = *(sections.items[i].data - 1);
 
@@ -145,62 +230,323 @@ void parse_operand(bstring in, instruction* inst, int ordinal)
     }
     else
     {
-        char buf[21];
+        char buf[LITERAL_MAX + 1];
+        literal_to_char(&in, buf);
 
-        for (int i = 0; i < in.len; i++)
+        // A decimal point makes it a double, stored as its bits
+        if (memchr(buf, '.', in.len))
         {
-            buf[i] = *(in.data + i);
+            double value = strtod(buf, NULL);
+            memcpy(data, &value, sizeof(value));
+        }
+        else
+        {
+            *data = strtoll(buf, NULL, 0);
         }
 
-        buf[in.len] = 0;
-
-        *data = strtoll(buf, NULL, 0);
         *type |= IMMEDIATE;
     }
 }
 
+// Vector registers are encoded like a plain register operand
+static void parse_vector_operand(bstring in, instruction* inst, int ordinal)
+{
+    complex_operand* comp = (complex_operand*)&inst->operands[ordinal];
+
+    comp->base = vector_from_bstring(in);
+    comp->multiplier = 1;
+    comp->register2_sign = 0;
+    comp->register2 = 0;
+    comp->offset = 0;
+
+    inst->operand_types[ordinal] = REGISTER | LITERAL;
+}
+
 bool is_label(vec_bstring* parts)
 {
     return (parts->len == 1 &&
             parts->items[0].data[parts->items[0].len - 1] == ':');
 }
 
-vec_bstring parse_instruction_header(bstring* line, instruction* inst)
+bool size_from_bstring(bstring src, unsigned char* size)
 {
-    vec_bstring parts = vec_bstring_new();
-    bstring_split(line, " ", &parts);
+    return find_keyword(size_table, SIZE_SEED, SIZE_MASK, src, size);
+}
+
+// Splits in at every sep and trims the pieces, like bstring_split with a
+// single separator
+static void split_at(bstring* in, char sep, vec_bstring* out)
+{
+    if (in->len == 0)
+    {
+        return;
+    }
+
+    unsigned char* start = in->data;
+    unsigned char* last = in->data + in->len - 1;
+
+    // A separator in the last byte stays part of the last piece
+    for (;;)
+    {
+        unsigned char* found = memchr(start, sep, last - start);
+        bstring* piece = vec_bstring_add(out);
+
+        piece->data = start;
+        piece->len = (found ? found : last + 1) - start;
+        bstring_trim(piece);
+
+        if (!found)
+        {
+            return;
+        }
+
+        start = found + 1;
+    }
+}
+
+// An optional size keyword may follow the mnemonic: mov byte [rmem] 1
+vec_bstring parse_instruction_header(
+        arena* scratch,
+        bstring* line,
+        instruction* inst)
+{
+    vec_bstring parts = vec_bstring_new_in(scratch, 4);
+    split_at(line, ' ', &parts);
 
     inst->opcode = opcode_from_bstring(parts.items[0]);
     inst->size = B8;
 
+    if (parts.len > 1 && size_from_bstring(parts.items[1], &inst->size))
+    {
+        if (is_jump(inst->opcode) || inst->opcode == OP_CALL ||
+            inst->opcode == OP_RET || inst->opcode == OP_EXIT ||
+            !size_allowed(inst->opcode, inst->size))
+        {
+            parse_error(11, "Operand size not allowed on this instruction.");
+        }
+
+        memmove(&parts.items[1], &parts.items[2],
+                sizeof(bstring) * (parts.len - 2));
+        parts.len--;
+    }
+
     return parts;
 }
 
-void parse_instruction_operands(vec_bstring* parts, instruction* inst)
+void parse_instruction_operands(
+        arena* scratch,
+        vec_bstring* parts,
+        instruction* inst)
 {
-    if (operands[inst->opcode] != parts->len - 1)
+    if ((uint64_t)operands[inst->opcode] != parts->len - 1)
+    {
+        parse_error(7, "Invalid number of operands");
+    }
+
+    for (uint64_t i = 1; i < parts->len; i++)
     {
-        printf("Invalid number of operands\n");
-        exit(7);
+        if (operand_role(inst->opcode, i - 1) == ROLE_VECTOR)
+        {
+            parse_vector_operand(parts->items[i], inst, i - 1);
+        }
+        else
+        {
+            parse_operand(scratch, parts->items[i], inst, i - 1);
+        }
     }
 
-    for (int i = 1; i < parts->len; i++)
+    for (int i = 0; i < operands[inst->opcode]; i++)
+    {
+        if (operand_role(inst->opcode, i) == ROLE_ADDRESS &&
+            !(inst->operand_types[i] & ADDRESS))
+        {
+            parse_error(12, "Operand %d must be a memory address [%.*s].",
+                        i + 1, parts->items[i + 1].len,
+                        parts->items[i + 1].data);
+        }
+    }
+}
+
+// FNV-1a
+static uint64_t hash_name(bstring name)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+
+    for (int i = 0; i < name.len; i++)
+    {
+        hash = (hash ^ name.data[i]) * 0x100000001b3;
+    }
+
+    return hash;
+}
+
+symbol_table symbol_table_new(arena* a)
+{
+    symbol_table table;
+
+    table.labels = vec_label_new_in(a, 1024);
+    table.capacity = 2048;
+    table.slots = arena_alloc(a, sizeof(int64_t) * table.capacity);
+    table.arena = a;
+    memset(table.slots, -1, sizeof(int64_t) * table.capacity);
+
+    return table;
+}
+
+// The slot that holds name, or the empty one it would go in
+static int64_t* symbol_slot(symbol_table* table, bstring name)
+{
+    uint64_t mask = table->capacity - 1;
+
+    for (uint64_t i = hash_name(name) & mask; ; i = (i + 1) & mask)
+    {
+        int64_t* slot = &table->slots[i];
+
+        if (*slot < 0 || bstring_cmp(table->labels.items[*slot].name, name))
+        {
+            return slot;
+        }
+    }
+}
+
+// Kept at most half full
+static void symbol_table_grow(symbol_table* table)
+{
+    table->capacity *= 2;
+    table->slots = arena_alloc(table->arena,
+                               sizeof(int64_t) * table->capacity);
+    memset(table->slots, -1, sizeof(int64_t) * table->capacity);
+
+    for (uint64_t i = 0; i < table->labels.len; i++)
     {
-        parse_operand(parts->items[i], inst, i - 1);
+        *symbol_slot(table, table->labels.items[i].name) = i;
     }
 }
 
+label* symbol_find(symbol_table* table, bstring name)
+{
+    int64_t slot = *symbol_slot(table, name);
+
+    return slot < 0 ? NULL : &table->labels.items[slot];
+}
+
+// Finds name, adding it undefined if it's new
+label* symbol_get(symbol_table* table, bstring name)
+{
+    int64_t* slot = symbol_slot(table, name);
+
+    if (*slot >= 0)
+    {
+        return &table->labels.items[*slot];
+    }
+
+    *slot = table->labels.len;
+
+    label* lbl = vec_label_add(&table->labels);
+    lbl->name = name;
+    lbl->address = 0;
+    lbl->defined = false;
+    lbl->pending = -1;
+
+    if (table->labels.len * 2 > table->capacity)
+    {
+        symbol_table_grow(table);
+    }
+
+    return lbl;
+}
+
+// Jumps always take a label. call takes one too unless it's given a
+// number, a register or a memory operand.
+static bool takes_label(unsigned char opcode, bstring operand)
+{
+    if (is_jump(opcode))
+    {
+        return true;
+    }
+
+    unsigned char reg;
+
+    return opcode == OP_CALL && operand.len > 0 &&
+           (isalpha(operand.data[0]) || operand.data[0] == '_') &&
+           !register_from_name(operand, &reg) &&
+           bstring_chr(&operand, '+') < 0 && bstring_chr(&operand, '-') < 0 &&
+           bstring_chr(&operand, '*') < 0;
+}
+
+void define_label(
+        symbol_table* symbols,
+        vec_instruction* instructions,
+        vec_jump* jumps,
+        bstring name,
+        uint64_t address)
+{
+    label* lbl = symbol_get(symbols, name);
+
+    // The first definition wins
+    if (lbl->defined)
+    {
+        return;
+    }
+
+    lbl->defined = true;
+    lbl->address = address;
+
+    for (int64_t i = lbl->pending; i >= 0; i = jumps->items[i].next)
+    {
+        instructions->items[jumps->items[i].inst_index].operands[0] = address;
+    }
+
+    lbl->pending = -1;
+}
+
+void reference_label(
+        symbol_table* symbols,
+        vec_instruction* instructions,
+        vec_jump* jumps,
+        bstring name)
+{
+    label* lbl = symbol_get(symbols, name);
+    uint64_t inst_index = instructions->len - 1;
+    instruction* inst = &instructions->items[inst_index];
+
+    inst->operand_types[0] = IMMEDIATE | LITERAL;
+    inst->operands[0] = lbl->address;
+
+    // Forward references are patched when the label turns up
+    if (!lbl->defined)
+    {
+        jump* jmp = vec_jump_add(jumps);
+
+        jmp->inst_index = inst_index;
+        jmp->next = lbl->pending;
+        lbl->pending = jumps->len - 1;
+    }
+}
+
+// Goes through the source a line at a time, so only the line being parsed
+// is ever split up
 void parse_instructions(
-        vec_bstring* lines,
+        bstring* raw,
         vec_instruction* instructions,
-        vec_label* labels,
-        vec_jump* jumps)
+        symbol_table* symbols,
+        vec_jump* jumps,
+        arena* scratch)
 {
-    unsigned offset = 0;
+    arena_mark line_start = arena_save(scratch);
 
-    for (int i = 0; i < lines->len; i++)
+    uint64_t offset = 0;
+    unsigned char* p = raw->data;
+    unsigned char* end = raw->data + raw->len;
+
+    while (p < end)
     {
-        bstring* line = &lines->items[i];
+        unsigned char* newline = memchr(p, '\n', end - p);
+        bstring text = { (newline ? newline : end) - p, p };
+        bstring* line = &text;
+
+        p += text.len + 1;
+        bstring_trim(line);
 
         // Comment
         if (line->len == 0 || line->data[0] == '#')
@@ -211,84 +557,53 @@ void parse_instructions(
         // Label
         if (line->data[line->len - 1] == ':')
         {
-            label* lbl = vec_label_add(labels);
+            bstring name = { line->len - 1, line->data };
 
-            lbl->name.data = line->data;
-            lbl->name.len = line->len - 1;
-
-            lbl->address = offset;
+            define_label(symbols, instructions, jumps, name, offset);
 
             continue;
         }
 
+        // Zeroed so the padding that goes into the image is always the same
         instruction* inst = vec_instruction_add(instructions);
-        vec_bstring parts = parse_instruction_header(line, inst);
+        memset(inst, 0, sizeof(instruction));
+        vec_bstring parts = parse_instruction_header(scratch, line, inst);
 
-        // Jumps need their labels resolved in a subsequent pass
-        if (is_jump(inst->opcode))
+        if (parts.len == 2 && takes_label(inst->opcode, parts.items[1]))
         {
-            jump* jmp = vec_jump_add(jumps);
-
-            jmp->inst_index = instructions->len - 1;
-            jmp->label_name = bstring_clone(&parts.items[1]);
-
-            goto next;
+            reference_label(symbols, instructions, jumps, parts.items[1]);
+        }
+        else
+        {
+            parse_instruction_operands(scratch, &parts, inst);
         }
 
-        parse_instruction_operands(&parts, inst);
+        arena_restore(scratch, line_start);
 
-    next:
         offset += instruction_encoded_len(operands[inst->opcode]);
     }
 }
 
-label* vec_label_find(vec_label* labels, bstring name)
-{
-    for (int i = 0; i < labels->len; i++)
-    {
-        if (bstring_cmp(labels->items[i].name, name))
-        {
-            return &labels->items[i];
-        }
-    }
-
-    return NULL;
-}
-
-void resolve_jumps(
-        vec_instruction* instructions,
-        vec_label* labels,
-        vec_jump* jumps)
+// Every label has been seen by now, so anything still waiting is undefined
+void resolve_jumps(symbol_table* symbols)
 {
-    for (int i = 0; i < jumps->len; i++)
+    for (uint64_t i = 0; i < symbols->labels.len; i++)
     {
-        jump* jmp = &jumps->items[i];
+        label* lbl = &symbols->labels.items[i];
 
-        label* label = vec_label_find(labels, jmp->label_name);
-        if (!label)
+        if (lbl->pending >= 0)
         {
-            printf("Label not found");
-            exit(8);
+            parse_error(8, "Label not found [%.*s].", lbl->name.len,
+                        lbl->name.data);
         }
-
-        instruction* inst = &instructions->items[jmp->inst_index];
-
-        inst->operand_types[0] = IMMEDIATE | LITERAL;
-        inst->operands[0] = label->address;
     }
 }
 
-int encode(
-        vec_instruction* instructions,
-        vec_label* labels,
-        unsigned char* bytes)
+uint64_t encode(vec_instruction* instructions, unsigned char* bytes)
 {
     unsigned char* out = bytes;
 
-    int next_label_index = 0;
-    label* next_label = NULL;
-
-    for (int i = 0; i < instructions->len; i++)
+    for (uint64_t i = 0; i < instructions->len; i++)
     {
         int len = instruction_encoded_len(
                 operands[instructions->items[i].opcode]);
@@ -299,20 +614,20 @@ int encode(
     return out - bytes;
 }
 
-int get_entry_point(vec_label* labels)
+uint64_t get_entry_point(symbol_table* symbols)
 {
-    label* start = vec_label_find(labels, bstring_from_char("start"));
+    label* start = symbol_find(symbols, bstring_from_char("start"));
 
-    return start ? start->address : 0;
+    return start && start->defined ? start->address : 0;
 }
 
-void write_to_file(unsigned char* bytes, int count, const char* filename)
+void write_to_file(unsigned char* bytes, uint64_t count, const char* filename)
 {
     FILE* file = fopen(filename, "w");
 
     if (!file)
     {
-        printf("Unable to open file [%s] for writing.\n");
+        printf("Unable to open file [%s] for writing.\n", filename);
         exit(9);
     }
 
@@ -335,36 +650,145 @@ void encode_uint64_t(uint64_t in, unsigned char* out)
     }
 }
 
-unsigned char* assemble(bstring* raw, int* out_bytes_count)
+// Every instruction takes a line, so this is room for all of them
+static uint64_t count_lines(bstring* raw)
+{
+    uint64_t count = 1;
+    unsigned char* p = raw->data;
+    unsigned char* end = raw->data + raw->len;
+
+    while ((p = memchr(p, '\n', end - p)))
+    {
+        count++;
+        p++;
+    }
+
+    return count;
+}
+
+// Everything up to the bytes, with arenas the caller set up
+static unsigned char* assemble_in(
+        arena* a,
+        arena* scratch,
+        bstring* raw,
+        bool optimize,
+        uint64_t* out_bytes_count)
 {
-    vec_bstring lines = vec_bstring_new();
-    bstring_split(raw, "\n", &lines);
+    vec_instruction instructions =
+        vec_instruction_new_in(a, count_lines(raw));
 
-    vec_instruction instructions = vec_instruction_new();
+    symbol_table symbols = symbol_table_new(a);
 
-    vec_label labels = vec_label_new();
+    vec_jump jumps = vec_jump_new_in(a, 1024);
 
-    vec_jump jumps = vec_jump_new();
+    parse_instructions(raw, &instructions, &symbols, &jumps, scratch);
 
-    parse_instructions(&lines, &instructions, &labels, &jumps);
+    resolve_jumps(&symbols);
 
-    resolve_jumps(&instructions, &labels, &jumps);
+    uint64_t entry_point = get_entry_point(&symbols);
+
+    if (optimize)
+    {
+        peephole_optimize(a, &instructions, &entry_point);
+    }
 
     unsigned char* bytes = malloc(sizeof(unsigned char) *
             IMG_HDR_LEN + sizeof(instruction) * instructions.len);
 
-    uint64_t code_bytes = encode(&instructions, &labels, bytes + IMG_HDR_LEN);
-
-    uint64_t entry_point = get_entry_point(&labels);
+    uint64_t code_bytes = encode(&instructions, bytes + IMG_HDR_LEN);
 
     encode_uint64_t(code_bytes, bytes + IMG_HDR_CODE_BYTES);
     encode_uint64_t(entry_point, bytes + IMG_HDR_ENTRY_POINT);
 
-    free(jumps.items);
-    free(labels.items);
-    free(instructions.items);
-    free(lines.items);
-
     *out_bytes_count = IMG_HDR_LEN + code_bytes;
     return bytes;
 }
+
+unsigned char* assemble(
+        bstring* raw,
+        bool optimize,
+        uint64_t* out_bytes_count)
+{
+    arena a;
+    arena scratch;
+
+    arena_init(&a, ASM_ARENA_BLOCK);
+    arena_init(&scratch, ASM_SCRATCH_BLOCK);
+
+    unsigned char* bytes =
+        assemble_in(&a, &scratch, raw, optimize, out_bytes_count);
+
+    arena_free(&scratch);
+    arena_free(&a);
+
+    return bytes;
+}
+
+int assemble_checked(
+        bstring* raw,
+        bool optimize,
+        unsigned char** out_bytes,
+        uint64_t* out_bytes_count,
+        char* error,
+        size_t error_len)
+{
+    arena a;
+    arena scratch;
+    jmp_buf on_error;
+
+    arena_init(&a, ASM_ARENA_BLOCK);
+    arena_init(&scratch, ASM_SCRATCH_BLOCK);
+
+    recover_error = error;
+    recover_error_len = error_len;
+    *out_bytes = NULL;
+
+    // The arenas are only ever reached through pointers, so they're intact
+    // when parse_error() jumps back here
+    int result = setjmp(on_error);
+
+    if (result == 0)
+    {
+        recover = &on_error;
+        *out_bytes =
+            assemble_in(&a, &scratch, raw, optimize, out_bytes_count);
+    }
+
+    recover = NULL;
+
+    arena_free(&scratch);
+    arena_free(&a);
+
+    return result;
+}
+
+bool find_label(bstring* raw, bstring name, uint64_t* address)
+{
+    arena a;
+    arena scratch;
+
+    arena_init(&a, ASM_ARENA_BLOCK);
+    arena_init(&scratch, ASM_SCRATCH_BLOCK);
+
+    vec_instruction instructions =
+        vec_instruction_new_in(&a, count_lines(raw));
+
+    symbol_table symbols = symbol_table_new(&a);
+
+    vec_jump jumps = vec_jump_new_in(&a, 1024);
+
+    parse_instructions(raw, &instructions, &symbols, &jumps, &scratch);
+
+    label* lbl = symbol_find(&symbols, name);
+    bool found = lbl && lbl->defined;
+
+    if (found)
+    {
+        *address = lbl->address;
+    }
+
+    arena_free(&scratch);
+    arena_free(&a);
+
+    return found;
+}
@@ -4,12 +4,37 @@
 #include "bstring.h"
 #include "shared.h"
 
-vec_bstring parse_instruction_header(bstring* line, instruction* inst);
+// Both allocate the pieces of the line from scratch
+vec_bstring parse_instruction_header(
+        arena* scratch,
+        bstring* line,
+        instruction* inst);
 
-void parse_instruction_operands(vec_bstring* parts, instruction* inst);
+void parse_instruction_operands(
+        arena* scratch,
+        vec_bstring* parts,
+        instruction* inst);
 
-unsigned char* assemble(bstring* raw, int* out_bytes_count);
+// optimize runs the peephole pass (basm -O) before the program is encoded
+unsigned char* assemble(
+        bstring* raw,
+        bool optimize,
+        uint64_t* out_bytes_count);
 
-void write_to_file(unsigned char* bytes, int count, const char* filename);
+// Same, but malformed source doesn't end the process: returns 0, or the exit
+// code basm would use with the message in error
+int assemble_checked(
+        bstring* raw,
+        bool optimize,
+        unsigned char** out_bytes,
+        uint64_t* out_bytes_count,
+        char* error,
+        size_t error_len);
+
+// Where name is in the program raw assembles to without -O, counting from
+// the start of the code like jump operands do. False if it isn't defined.
+bool find_label(bstring* raw, bstring name, uint64_t* address);
+
+void write_to_file(unsigned char* bytes, uint64_t count, const char* filename);
 
 #endif
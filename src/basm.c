@@ -1,25 +1,107 @@
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
 
 #include "assembler.h"
+#include "image.h"
+
+void usage()
+{
+    printf("Usage: basm [-O] [--format=v1|v2] <source_file>\n");
+}
 
 int main(int argc, char* argv[])
 {
-    if (argc != 2)
+    bool packed = false;
+    bool optimize = false;
+
+    static struct option options[] = {
+        { "format", required_argument, NULL, 'f' },
+        { NULL,     0,                 NULL, 0   }
+    };
+
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "O", options, NULL)) != -1)
     {
-        printf("Usage: basm <source_file>\n");
-        return 1;
+        switch (opt)
+        {
+            case 'f':
+                if (strcmp(optarg, "v1") && strcmp(optarg, "v2"))
+                {
+                    printf("Unrecognized image format [%s].\n", optarg);
+                    return 1;
+                }
+
+                packed = !strcmp(optarg, "v2");
+                break;
+
+            case 'O':
+                optimize = true;
+                break;
+
+            default:
+                usage();
+                return 1;
+        }
     }
 
-    operands_init();
+    if (optind != argc - 1)
+    {
+        usage();
+        return 1;
+    }
 
+    // Sources are mapped rather than read in; anything that can't be mapped
+    // is read the old way
     bstring raw;
-    raw.data = NULL;
-    raw.data = read_file(argv[1], NULL, &raw.len);
+    uint64_t mapped_len = 0;
+    unsigned char* mapped = map_file(argv[optind], &mapped_len);
+
+    if (mapped_len > INT_MAX)
+    {
+        printf("Source file too big.\n");
+        return 1;
+    }
+
+    if (mapped)
+    {
+        raw.data = mapped;
+        raw.len = mapped_len;
+    }
+    else
+    {
+        raw.data = read_file(argv[optind], NULL, &raw.len);
+
+        if (!raw.data)
+        {
+            return 1;
+        }
+    }
+
+    uint64_t bytes_len = 0;
+    unsigned char* bytes = assemble(&raw, optimize, &bytes_len);
 
-    int bytes_len = 0;
-    unsigned char* bytes = assemble(&raw, &bytes_len);
+    if (mapped)
+    {
+        unmap_file(mapped, mapped_len);
+    }
+    else
+    {
+        free(raw.data);
+    }
 
-    free(raw.data);
+    if (packed)
+    {
+        unsigned char* v2 = malloc(image_packed_max(bytes_len));
+        uint64_t v2_len = image_pack(bytes, bytes_len, v2);
+
+        free(bytes);
+
+        bytes = v2;
+        bytes_len = v2_len;
+    }
 
     write_to_file(bytes, bytes_len, "b.out");
 
@@ -0,0 +1,542 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "batch.h"
+#include "jit.h"
+#include "scheduler.h"
+
+// Presets can only set the general-purpose registers
+#define PRESET_REGISTERS (R5 + 1)
+
+#define MANIFEST_SEPARATORS " \t\r\n"
+
+typedef struct
+{
+    char* image;
+    int preset_count;
+    unsigned char preset_registers[PRESET_REGISTERS];
+    uint64_t preset_values[PRESET_REGISTERS];
+
+    // Filled in by whichever worker runs the job
+    int status;
+    char error[IMAGE_ERROR_LEN];
+    uint64_t retired;
+    unsigned char* output;
+    size_t output_len;
+    bool done;
+} batch_job;
+
+VECTOR_H(batch_job)
+VECTOR_C(batch_job)
+
+#define FAULT_STATUS 30
+
+// Chase-Lev work-stealing deque. Every job is queued before the workers
+// start, so the owner only pops from the bottom and thieves take from the
+// top; it never has to grow.
+typedef struct
+{
+    int* jobs;
+    atomic_long top;
+    atomic_long bottom;
+} job_deque;
+
+enum steal_result
+{
+    STEAL_EMPTY,
+    STEAL_OK,
+    STEAL_RETRY
+};
+
+struct batch_worker;
+
+typedef struct
+{
+    batch_config* config;
+    vec_batch_job jobs;
+    struct batch_worker* workers;
+    int worker_count;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+} batch_state;
+
+typedef struct batch_worker
+{
+    batch_state* batch;
+    int index;
+    pthread_t thread;
+    job_deque deque;
+} batch_worker;
+
+static bool deque_pop(job_deque* deque, int* out_job)
+{
+    long bottom = atomic_load_explicit(&deque->bottom,
+                                       memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom)
+    {
+        atomic_store_explicit(&deque->bottom, bottom + 1,
+                              memory_order_relaxed);
+        return false;
+    }
+
+    *out_job = deque->jobs[bottom];
+
+    if (top < bottom)
+    {
+        return true;
+    }
+
+    // Last job: race any thieves for it
+    bool won = atomic_compare_exchange_strong_explicit(
+            &deque->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed);
+
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+
+    return won;
+}
+
+static enum steal_result deque_steal(job_deque* deque, int* out_job)
+{
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (top >= bottom)
+    {
+        return STEAL_EMPTY;
+    }
+
+    *out_job = deque->jobs[top];
+
+    if (!atomic_compare_exchange_strong_explicit(
+            &deque->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+    {
+        return STEAL_RETRY;
+    }
+
+    return STEAL_OK;
+}
+
+static bool next_job(batch_worker* worker, int* out_job)
+{
+    batch_state* batch = worker->batch;
+
+    if (deque_pop(&worker->deque, out_job))
+    {
+        return true;
+    }
+
+    // Out of our own work: steal, starting with the next worker along.
+    // Nothing is ever queued again, so once every deque is empty we're done.
+    for (;;)
+    {
+        bool contended = false;
+
+        for (int i = 1; i < batch->worker_count; i++)
+        {
+            batch_worker* victim =
+                &batch->workers[(worker->index + i) % batch->worker_count];
+
+            switch (deque_steal(&victim->deque, out_job))
+            {
+                case STEAL_OK:
+                    return true;
+
+                case STEAL_RETRY:
+                    contended = true;
+                    break;
+
+                case STEAL_EMPTY:
+                    break;
+            }
+        }
+
+        if (!contended)
+        {
+            return false;
+        }
+    }
+}
+
+// Records a run's results in its job and hands the job to the output
+// stream
+static void finish_job(
+        batch_state* batch,
+        machine_state* state,
+        batch_job* job,
+        enum run_status status)
+{
+    if (job->status == 0)
+    {
+        job->retired = state->retired;
+
+        if (status == RUN_FAULT)
+        {
+            job->status = FAULT_STATUS;
+            snprintf(job->error, IMAGE_ERROR_LEN,
+                     "Program faulted at rip %llu.", state->registers[RIP]);
+        }
+    }
+
+    job->output = output_take(&state->output, &job->output_len);
+
+    pthread_mutex_lock(&batch->lock);
+    job->done = true;
+    pthread_cond_broadcast(&batch->finished);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static bool start_job(machine_state* state, batch_job* job)
+{
+    // The last job's reset failed and took guest memory with it
+    if (!state->memory && !memory_reset(state))
+    {
+        job->status = 18;
+        memory_map_error(state, job->error);
+        return false;
+    }
+
+    job->status = load_image(job->image, state, job->error);
+
+    if (job->status != 0)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < job->preset_count; i++)
+    {
+        state->registers[job->preset_registers[i]] = job->preset_values[i];
+    }
+
+    return true;
+}
+
+static void run_job(batch_state* batch, machine_state* state, batch_job* job)
+{
+    enum run_status status = RUN_EXITED;
+
+    if (start_job(state, job))
+    {
+        status = batch->config->jit ?
+            jit_run(state) : run(state, batch->config->dispatch);
+    }
+
+    finish_job(batch, state, job, status);
+
+    decoded_program_free(state);
+
+    // Hand the pages back now rather than carrying them into the next job.
+    // If that fails, the next job tries again.
+    memory_reset(state);
+}
+
+// Each worker keeps one machine state for all the jobs it runs
+static void* worker_main(void* arg)
+{
+    batch_worker* worker = arg;
+    batch_config* config = worker->batch->config;
+    machine_state state;
+
+    memory_init(&state, &config->memory);
+    output_init(&state.output, -1, config->output_format, FLUSH_EXIT);
+
+    int index;
+
+    while (next_job(worker, &index))
+    {
+        run_job(worker->batch, &state, &worker->batch->jobs.items[index]);
+    }
+
+    output_free(&state.output);
+    jit_free(&state);
+    memory_free(&state);
+
+    return NULL;
+}
+
+typedef struct
+{
+    batch_state* batch;
+    batch_job* job;
+} sliced_job;
+
+static void free_machine(machine_state* state)
+{
+    output_free(&state->output);
+    jit_free(state);
+    decoded_program_free(state);
+    memory_free(state);
+
+    free(state);
+}
+
+static void sliced_job_finished(
+        machine_state* state,
+        enum run_status status,
+        void* context)
+{
+    sliced_job* sliced = context;
+
+    finish_job(sliced->batch, state, sliced->job, status);
+
+    free_machine(state);
+    free(sliced);
+}
+
+// Every job gets a machine of its own so they can all be in flight at once
+static scheduler* schedule_jobs(batch_state* batch)
+{
+    batch_config* config = batch->config;
+    scheduler* sched = scheduler_create(batch->worker_count, config->slice,
+                                        config->dispatch, config->jit);
+
+    for (uint64_t i = 0; i < batch->jobs.len; i++)
+    {
+        batch_job* job = &batch->jobs.items[i];
+        machine_state* state = malloc(sizeof(machine_state));
+
+        memory_init(state, &config->memory);
+        output_init(&state->output, -1, config->output_format, FLUSH_EXIT);
+
+        if (!start_job(state, job))
+        {
+            finish_job(batch, state, job, RUN_EXITED);
+            free_machine(state);
+            continue;
+        }
+
+        sliced_job* sliced = malloc(sizeof(sliced_job));
+        sliced->batch = batch;
+        sliced->job = job;
+
+        scheduler_add(sched, state, sliced_job_finished, sliced);
+    }
+
+    return sched;
+}
+
+// Parses "r<n>=<value>", with the value in any base strtoull takes
+static bool parse_preset(batch_job* job, const char* text)
+{
+    if (text[0] != 'r' || text[1] < '0' || text[1] > '0' + R5 ||
+        text[2] != '=' || text[3] == '\0' ||
+        job->preset_count == PRESET_REGISTERS)
+    {
+        return false;
+    }
+
+    char* end;
+    uint64_t value = strtoull(text + 3, &end, 0);
+
+    if (*end != '\0')
+    {
+        return false;
+    }
+
+    job->preset_registers[job->preset_count] = text[1] - '0';
+    job->preset_values[job->preset_count] = value;
+    job->preset_count++;
+
+    return true;
+}
+
+static void parse_manifest(const char* fn, vec_batch_job* jobs)
+{
+    FILE* file = strcmp(fn, "-") ? fopen(fn, "r") : stdin;
+
+    if (!file)
+    {
+        printf("Failed to open batch manifest [%s].\n", fn);
+        exit(24);
+    }
+
+    char* line = NULL;
+    size_t allocated = 0;
+    int line_number = 0;
+
+    while (getline(&line, &allocated, file) != -1)
+    {
+        line_number++;
+
+        char* save;
+        char* token = strtok_r(line, MANIFEST_SEPARATORS, &save);
+
+        // Skip blank lines and comments
+        if (!token || token[0] == '#')
+        {
+            continue;
+        }
+
+        batch_job* job = vec_batch_job_add(jobs);
+        memset(job, 0, sizeof(*job));
+        job->image = strdup(token);
+
+        while ((token = strtok_r(NULL, MANIFEST_SEPARATORS, &save)))
+        {
+            if (!parse_preset(job, token))
+            {
+                printf("Invalid register preset [%s] on line %d of the "
+                       "batch manifest.\n", token, line_number);
+                exit(25);
+            }
+        }
+    }
+
+    free(line);
+
+    if (file != stdin)
+    {
+        fclose(file);
+    }
+}
+
+// Deals jobs out round-robin. Each deque holds its jobs in descending order
+// so the owner works forward from its earliest job while thieves take the
+// latest ones, which keeps the in-order output stream moving.
+static void deal_jobs(batch_worker* worker, int worker_count, int job_count)
+{
+    int count = (job_count - worker->index + worker_count - 1) / worker_count;
+
+    worker->deque.jobs = malloc(sizeof(int) * (count ? count : 1));
+
+    for (int i = 0; i < count; i++)
+    {
+        worker->deque.jobs[i] =
+            worker->index + (count - 1 - i) * worker_count;
+    }
+
+    atomic_init(&worker->deque.top, 0);
+    atomic_init(&worker->deque.bottom, count);
+}
+
+static void report_job(int number, batch_job* job, FILE* out)
+{
+    if (job->status == 0)
+    {
+        fprintf(out, "job %d [%s]: status 0, %llu instructions\n",
+                number, job->image, job->retired);
+    }
+    else
+    {
+        fprintf(out, "job %d [%s]: status %d, %s\n",
+                number, job->image, job->status, job->error);
+    }
+}
+
+int batch_run(const char* manifest, batch_config* config)
+{
+    batch_state batch;
+    batch.config = config;
+    batch.jobs = vec_batch_job_new();
+
+    parse_manifest(manifest, &batch.jobs);
+
+    int job_count = batch.jobs.len;
+    int worker_count = config->jobs;
+
+    if (worker_count <= 0)
+    {
+        worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if (worker_count > job_count)
+    {
+        worker_count = job_count;
+    }
+
+    if (worker_count < 1)
+    {
+        worker_count = 1;
+    }
+
+    batch.worker_count = worker_count;
+    batch.workers = malloc(sizeof(batch_worker) * worker_count);
+
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.finished, NULL);
+
+    scheduler* sched = NULL;
+
+    if (config->slice)
+    {
+        sched = schedule_jobs(&batch);
+    }
+    else
+    {
+        for (int i = 0; i < worker_count; i++)
+        {
+            batch_worker* worker = &batch.workers[i];
+            worker->batch = &batch;
+            worker->index = i;
+
+            deal_jobs(worker, worker_count, job_count);
+        }
+
+        for (int i = 0; i < worker_count; i++)
+        {
+            pthread_create(&batch.workers[i].thread, NULL, worker_main,
+                           &batch.workers[i]);
+        }
+    }
+
+    int failed = 0;
+
+    // Stream results out in manifest order as they come in
+    for (int i = 0; i < job_count; i++)
+    {
+        batch_job* job = &batch.jobs.items[i];
+
+        pthread_mutex_lock(&batch.lock);
+
+        while (!job->done)
+        {
+            pthread_cond_wait(&batch.finished, &batch.lock);
+        }
+
+        pthread_mutex_unlock(&batch.lock);
+
+        fwrite(job->output, 1, job->output_len, stdout);
+        report_job(i + 1, job, stderr);
+
+        if (job->status != 0)
+        {
+            failed++;
+        }
+
+        free(job->output);
+        free(job->image);
+    }
+
+    fflush(stdout);
+
+    if (sched)
+    {
+        scheduler_free(sched);
+    }
+    else
+    {
+        for (int i = 0; i < worker_count; i++)
+        {
+            pthread_join(batch.workers[i].thread, NULL);
+            free(batch.workers[i].deque.jobs);
+        }
+    }
+
+    pthread_cond_destroy(&batch.finished);
+    pthread_mutex_destroy(&batch.lock);
+
+    free(batch.workers);
+    free(batch.jobs.items);
+
+    return failed;
+}
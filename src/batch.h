@@ -0,0 +1,27 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include "decoder.h"
+
+typedef struct
+{
+    memory_config memory;
+    enum dispatch_mode dispatch;
+    bool jit;
+    enum output_format output_format;
+    // Worker threads; 0 uses one per online CPU
+    int jobs;
+    // Instructions per time slice. 0 runs each job to the end on whichever
+    // worker picks it up; otherwise every job gets its own machine and they
+    // take turns on the scheduler, so long jobs can't hold up short ones.
+    uint64_t slice;
+} batch_config;
+
+// Runs every job in the manifest across worker threads. Each line names an
+// image followed by optional register presets (r0=5 r1=0x10 ...), so one
+// image can be run against many inputs. Job output goes to stdout in
+// manifest order and a status line per job goes to stderr. Returns the
+// number of jobs that failed to load or faulted.
+int batch_run(const char* manifest, batch_config* config);
+
+#endif
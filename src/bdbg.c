@@ -1,5 +1,8 @@
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "bstring.h"
 #include "emulator.h"
@@ -17,14 +20,58 @@
 #define CLR_WHITE   "\x1B[37m"
 
 #define MAX_PROMPT_LEN 255
+#define MAX_STOPS 64
+
+// A breakpoint stops the program before the instruction at address runs,
+// if its condition holds: condition is a cmp, and relation the conditional
+// jump that has to be taken after it. A watchpoint stops it after anything
+// changes the size bytes at guest address address, which held last.
+typedef struct
+{
+    bool used;
+    bool watch;
+    uint64_t address;
+    unsigned char size;
+    bool conditional;
+    instruction condition;
+    unsigned char relation;
+    uint64_t last;
+} stop_point;
+
+static const struct
+{
+    const char* name;
+    unsigned char jump;
+} relations[] = {
+    { "==", OP_JE  },
+    { "!=", OP_JNE },
+    { "<",  OP_JL  },
+    { "<=", OP_JLE },
+    { ">",  OP_JG  },
+    { ">=", OP_JGE }
+};
 
 uint64_t registers_last[REGISTER_COUNT];
+unsigned char vectors_last[VECTOR_COUNT][VECTOR_BYTES];
+
+stop_point stops[MAX_STOPS];
+
+// One bit per 8-byte code slot, set where there's a breakpoint, so running
+// between stops costs a bit test per instruction
+uint64_t* break_bits;
+uint64_t code_end;
 
-bool will_jump(machine_state* state, instruction* inst)
+// Watched pages are read-only. The fault handler lets the write through and
+// sets this; watch_changed then puts the protection back.
+volatile sig_atomic_t watch_faulted;
+unsigned char* guest_memory;
+long page_size;
+
+bool will_jump(machine_state* state, unsigned char opcode)
 {
     int64_t rflag = state->registers[RFLAG];
 
-    switch (inst->opcode)
+    switch (opcode)
     {
         case OP_JE:  return rflag == 0;
         case OP_JNE: return rflag != 0;
@@ -57,6 +104,34 @@ void print_debug(machine_state* state)
         registers_last[i] = state->registers[i];
     }
 
+    // Vector registers only show up once they've held something, as qword
+    // lanes in hex
+    static const unsigned char zero[VECTOR_BYTES];
+
+    for (int i = 0; i < VECTOR_COUNT; i++)
+    {
+        const bool changed = memcmp(vectors_last[i], state->vectors[i],
+                                    VECTOR_BYTES);
+
+        if (!changed && !memcmp(state->vectors[i], zero, VECTOR_BYTES))
+        {
+            continue;
+        }
+
+        printf("\t%s:", vector_to_string(i));
+        printf(changed ? CLR_RED : CLR_BLUE);
+
+        for (int lane = 0; lane < VECTOR_BYTES; lane += B8)
+        {
+            uint64_t value;
+            memcpy(&value, state->vectors[i] + lane, B8);
+            printf(" %016llx", value);
+        }
+
+        printf(CLR_RESET "\n");
+        memcpy(vectors_last[i], state->vectors[i], VECTOR_BYTES);
+    }
+
     putchar('\n');
 }
 
@@ -78,7 +153,7 @@ void instruction_print(machine_state* state, instruction* inst)
         printf(" %s", buffer);
     }
 
-    if (is_conditional_jump(inst->opcode) && will_jump(state, inst))
+    if (is_conditional_jump(inst->opcode) && will_jump(state, inst->opcode))
     {
         printf(CLR_RED " (will jump)");
     }
@@ -107,33 +182,508 @@ void instruction_bytecode_print(instruction* inst)
     printf(CLR_RESET "\n");
 }
 
-bool run_console_instruction(machine_state* state, bstring* line)
+// Assembles one line the way the console does
+void assemble_line(bstring* line, instruction* inst)
 {
     bstring_trim(line);
+    arena scratch;
+    arena_init(&scratch, 1024);
+
+    vec_bstring parts = parse_instruction_header(&scratch, line, inst);
+    parse_instruction_operands(&scratch, &parts, inst);
+
+    arena_free(&scratch);
+}
+
+bool run_console_instruction(machine_state* state, bstring* line)
+{
     instruction inst;
-    vec_bstring parts = parse_instruction_header(line, &inst);
-    parse_instruction_operands(&parts, &inst);
+    assemble_line(line, &inst);
+
+    // A console instruction that faults is just reported, since it isn't
+    // part of the program
+    uint64_t rip = state->registers[RIP];
+    bool running = execute_instruction(state, &inst);
+
+    if (state->status == RUN_FAULT)
+    {
+        printf("Instruction faulted.\n");
+        state->registers[RIP] = rip;
+        state->status = RUN_EXITED;
+        return true;
+    }
+
+    return running;
+}
+
+// The first and last pages under a watchpoint
+void watched_pages(stop_point* point, uintptr_t* first, uintptr_t* last)
+{
+    uintptr_t start = (uintptr_t)(guest_memory + point->address);
+
+    *first = start & ~(page_size - 1);
+    *last = (start + point->size - 1) & ~(page_size - 1);
+}
 
-    return execute_instruction(state, &inst);
+void protect_watched(int protection)
+{
+    for (int i = 0; i < MAX_STOPS; i++)
+    {
+        if (stops[i].used && stops[i].watch)
+        {
+            uintptr_t first;
+            uintptr_t last;
+            watched_pages(&stops[i], &first, &last);
+
+            mprotect((void*)first, last - first + page_size, protection);
+        }
+    }
+}
+
+// Faults anywhere but a watched page are real, so they go back to killing
+// the debugger when the instruction runs again
+void watch_fault(int signal, siginfo_t* info, void* context)
+{
+    uintptr_t page = (uintptr_t)info->si_addr & ~(page_size - 1);
+
+    for (int i = 0; i < MAX_STOPS; i++)
+    {
+        uintptr_t first;
+        uintptr_t last;
+
+        if (stops[i].used && stops[i].watch)
+        {
+            watched_pages(&stops[i], &first, &last);
+
+            if (page >= first && page <= last)
+            {
+                mprotect((void*)page, page_size, PROT_READ | PROT_WRITE);
+                watch_faulted = true;
+                return;
+            }
+        }
+    }
+
+    struct sigaction action = { .sa_handler = SIG_DFL };
+    sigaction(SIGSEGV, &action, NULL);
+}
+
+// Reports the watchpoints whose value changed since a watched page was last
+// written, and write-protects the pages again. True if any changed.
+bool watch_changed(machine_state* state)
+{
+    if (!watch_faulted)
+    {
+        return false;
+    }
+
+    watch_faulted = false;
+    bool changed = false;
+
+    for (int i = 0; i < MAX_STOPS; i++)
+    {
+        stop_point* point = &stops[i];
+
+        if (!point->used || !point->watch)
+        {
+            continue;
+        }
+
+        uint64_t value = load_sized(state->memory + point->address,
+                                    point->size);
+
+        if (value != point->last)
+        {
+            printf(CLR_MAGENTA "Watchpoint %d: [%llu] %llu -> %llu\n"
+                   CLR_RESET, i + 1, point->address, point->last, value);
+            point->last = value;
+            changed = true;
+        }
+    }
+
+    protect_watched(PROT_READ);
+
+    return changed;
+}
+
+bool condition_holds(machine_state* state, stop_point* point)
+{
+    uint64_t rflag = state->registers[RFLAG];
+
+    execute_instruction(state, &point->condition);
+    bool holds = will_jump(state, point->relation);
+
+    state->registers[RFLAG] = rflag;
+
+    return holds;
+}
+
+bool breaks_at(machine_state* state)
+{
+    uint64_t rip = state->registers[RIP];
+    uint64_t slot = (rip - IMG_HDR_LEN) / 8;
+
+    if (rip < IMG_HDR_LEN || rip >= code_end ||
+        !(break_bits[slot / 64] >> slot % 64 & 1))
+    {
+        return false;
+    }
+
+    for (int i = 0; i < MAX_STOPS; i++)
+    {
+        stop_point* point = &stops[i];
+
+        if (point->used && !point->watch && point->address == rip &&
+            (!point->conditional || condition_holds(state, point)))
+        {
+            printf(CLR_MAGENTA "Breakpoint %d at rip %llu.\n" CLR_RESET,
+                   i + 1, rip);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Runs the program at full speed until a breakpoint or watchpoint stops it.
+// False once it's finished.
+bool run_to_stop(machine_state* state)
+{
+    do
+    {
+        bool running = execute(state);
+
+        if (watch_changed(state) && running)
+        {
+            return true;
+        }
+
+        if (!running)
+        {
+            return false;
+        }
+    }
+    while (!breaks_at(state));
+
+    return true;
+}
+
+void rebuild_break_bits()
+{
+    memset(break_bits, 0, ((code_end - IMG_HDR_LEN) / 8 / 64 + 1) * 8);
+
+    for (int i = 0; i < MAX_STOPS; i++)
+    {
+        if (stops[i].used && !stops[i].watch)
+        {
+            uint64_t slot = (stops[i].address - IMG_HDR_LEN) / 8;
+            break_bits[slot / 64] |= (uint64_t)1 << slot % 64;
+        }
+    }
+}
+
+bool starts_instruction(machine_state* state, uint64_t rip)
+{
+    uint64_t at = IMG_HDR_LEN;
+
+    while (at < rip && state->memory[at] < OPCODE_COUNT)
+    {
+        at += instruction_encoded_len(operands[state->memory[at]]);
+    }
+
+    return at == rip && rip < code_end;
+}
+
+stop_point* new_stop()
+{
+    for (int i = 0; i < MAX_STOPS; i++)
+    {
+        if (!stops[i].used)
+        {
+            memset(&stops[i], 0, sizeof(stop_point));
+            stops[i].used = true;
+            return &stops[i];
+        }
+    }
+
+    printf("Too many breakpoints and watchpoints.\n");
+
+    return NULL;
+}
+
+// break <rip or label> [if [size] <operand> <relation> <operand>]
+void add_breakpoint(machine_state* state, bstring* source, char* args)
+{
+    char* where = strtok(args, " ");
+    char* keyword = strtok(NULL, " ");
+    uint64_t rip = 0;
+
+    if (!where || (keyword && strcmp(keyword, "if")))
+    {
+        printf("Usage: break <rip or label> "
+               "[if [size] <operand> <relation> <operand>]\n");
+        return;
+    }
+
+    if (where[0] >= '0' && where[0] <= '9')
+    {
+        rip = strtoull(where, NULL, 0);
+    }
+    else if (!source)
+    {
+        printf("Breaking on a label needs the source file.\n");
+        return;
+    }
+    else if (find_label(source, bstring_from_char(where), &rip))
+    {
+        rip += IMG_HDR_LEN;
+    }
+    else
+    {
+        printf("Label not found [%s].\n", where);
+        return;
+    }
+
+    if (!starts_instruction(state, rip))
+    {
+        printf("No instruction starts at rip %llu.\n", rip);
+        return;
+    }
+
+    // The condition becomes a cmp of the two operands, which with a size
+    // keyword is three words around the relation
+    char line[MAX_PROMPT_LEN + 8] = "cmp";
+    int relation = -1;
+    int words = 0;
+
+    for (char* word; keyword && (word = strtok(NULL, " ")); )
+    {
+        for (int i = 0; i < sizeof(relations) / sizeof(relations[0]); i++)
+        {
+            if (!strcmp(word, relations[i].name))
+            {
+                relation = i;
+            }
+        }
+
+        if (relation < 0 || strcmp(word, relations[relation].name))
+        {
+            strcat(strcat(line, " "), word);
+            words++;
+        }
+    }
+
+    bool sized = words == 3 && (strstr(line, "cmp byte ") == line ||
+                                strstr(line, "cmp word ") == line ||
+                                strstr(line, "cmp dword ") == line ||
+                                strstr(line, "cmp qword ") == line);
+
+    if (keyword && (relation < 0 || (words != 2 && !sized)))
+    {
+        printf("The condition has to be [size] <operand> <relation> "
+               "<operand>, with one of == != < <= > >=.\n");
+        return;
+    }
+
+    stop_point* point = new_stop();
+
+    if (!point)
+    {
+        return;
+    }
+
+    point->address = rip;
+
+    if (keyword)
+    {
+        bstring condition = bstring_from_char(line);
+
+        assemble_line(&condition, &point->condition);
+        point->conditional = true;
+        point->relation = relations[relation].jump;
+    }
+
+    rebuild_break_bits();
+    printf("Breakpoint %d at rip %llu.\n", (int)(point - stops) + 1, rip);
+}
+
+// watch [size] <memory operand>, with the address worked out now
+void add_watchpoint(machine_state* state, char* args)
+{
+    char line[MAX_PROMPT_LEN + 8] = "print ";
+    strcat(line, args);
+
+    bstring operand = bstring_from_char(line);
+    instruction inst;
+    assemble_line(&operand, &inst);
+
+    if (!(inst.operand_types[0] & ADDRESS))
+    {
+        printf("Watchpoints need a memory operand.\n");
+        return;
+    }
+
+    uint64_t address = resolve_operand(state, &inst, 0) - state->memory;
+
+    if (state->memory_size < inst.size ||
+        address > state->memory_size - inst.size)
+    {
+        printf("Address %llu is outside guest memory.\n", address);
+        return;
+    }
+
+    stop_point* point = new_stop();
+
+    if (!point)
+    {
+        return;
+    }
+
+    point->watch = true;
+    point->address = address;
+    point->size = inst.size;
+    point->last = load_sized(state->memory + address, inst.size);
+
+    protect_watched(PROT_READ);
+    printf("Watchpoint %d on %s [%llu].\n", (int)(point - stops) + 1,
+           size_to_string(inst.size), address);
+}
+
+void delete_stop(char* args)
+{
+    int n = args ? atoi(args) : 0;
+
+    if (n < 1 || n > MAX_STOPS || !stops[n - 1].used)
+    {
+        printf("No breakpoint or watchpoint %s.\n", args ? args : "given");
+        return;
+    }
+
+    // Unprotect everything, then protect what's still watched
+    protect_watched(PROT_READ | PROT_WRITE);
+    stops[n - 1].used = false;
+    protect_watched(PROT_READ);
+
+    rebuild_break_bits();
+}
+
+void list_stops()
+{
+    char buffer[DEBUG_STR_LEN];
+
+    for (int i = 0; i < MAX_STOPS; i++)
+    {
+        stop_point* point = &stops[i];
+
+        if (!point->used)
+        {
+            continue;
+        }
+
+        if (point->watch)
+        {
+            printf("%d: watch %s [%llu]\n", i + 1,
+                   size_to_string(point->size), point->address);
+            continue;
+        }
+
+        printf("%d: break at rip %llu", i + 1, point->address);
+
+        if (point->conditional)
+        {
+            printf(" if");
+
+            if (point->condition.size != B8)
+            {
+                printf(" %s", size_to_string(point->condition.size));
+            }
+
+            operand_to_string(&point->condition, 0, buffer);
+            printf(" %s", buffer);
+
+            for (int r = 0; r < sizeof(relations) / sizeof(relations[0]); r++)
+            {
+                if (relations[r].jump == point->relation)
+                {
+                    printf(" %s", relations[r].name);
+                }
+            }
+
+            operand_to_string(&point->condition, 1, buffer);
+            printf(" %s", buffer);
+        }
+
+        putchar('\n');
+    }
+}
+
+// Labels come from assembling the source again, so warn when that doesn't
+// give back the code being debugged
+bool load_source(const char* fn, machine_state* state, bstring* source)
+{
+    uint64_t len = 0;
+    source->data = map_file(fn, &len);
+    source->len = len;
+
+    if (!source->data)
+    {
+        source->data = read_file(fn, NULL, &source->len);
+
+        if (!source->data)
+        {
+            return false;
+        }
+    }
+
+    uint64_t count = 0;
+    unsigned char* bytes = assemble(source, false, &count);
+
+    if (count != code_end ||
+        memcmp(bytes + IMG_HDR_LEN, state->memory + IMG_HDR_LEN,
+               code_end - IMG_HDR_LEN))
+    {
+        printf("The source doesn't assemble to this binary (was it built "
+               "with -O?), so labels may be in the wrong place.\n");
+    }
+
+    free(bytes);
+
+    return true;
 }
 
 int main(int argc, char* argv[])
 {
-    if (argc < 2)
+    if (argc < 2 || argc > 3)
     {
-        printf("Usage: bdbg <binary_file>\n");
+        printf("Usage: bdbg <binary_file> [source_file]\n");
         return 1;
     }
 
-    print_prefix = CLR_YELLOW;
-    print_suffix = CLR_RESET;
+    machine_state state;
+    load_binary(argv[1], &state, NULL);
+    state.status = RUN_EXITED;
+
+    code_end = IMG_HDR_LEN + *(uint64_t*)(state.memory + IMG_HDR_CODE_BYTES);
+    break_bits = calloc((code_end - IMG_HDR_LEN) / 8 / 64 + 1, 8);
 
-    operands_init();
+    bstring source;
 
-    machine_state state;
-    load_binary(argv[1], &state);
+    if (argc == 3 && !load_source(argv[2], &state, &source))
+    {
+        return 1;
+    }
 
-    emulator_init();
+    guest_memory = state.memory;
+    page_size = sysconf(_SC_PAGESIZE);
+
+    struct sigaction action = { .sa_sigaction = watch_fault };
+    action.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &action, NULL);
+
+    // Guest output interleaves with the debugger's own
+    state.output.flush = FLUSH_LINE;
+    state.output.prefix = CLR_YELLOW;
+    state.output.suffix = CLR_RESET;
 
     while (true)
     {
@@ -169,21 +719,83 @@ int main(int argc, char* argv[])
             if (input[0] == '$')
             {
                 bstring binput = bstring_from_char(input + 1);
+                bool running = run_console_instruction(&state, &binput);
 
-                if (!run_console_instruction(&state, &binput))
+                watch_changed(&state);
+
+                if (!running)
                 {
                     break;
                 }
 
                 continue;
             }
+
+            char* command = strtok(input, " ");
+            char* args = strtok(NULL, "");
+
+            // Conditions and watched operands are assembled from a copy
+            if (args && strlen(args) > MAX_PROMPT_LEN)
+            {
+                printf("Command too long.\n");
+                free(input);
+                continue;
+            }
+
+            if (!command || !strcmp(command, "s") || !strcmp(command, "step"))
+            {
+                // Falls through to running the next instruction
+            }
+            else if (!strcmp(command, "c") || !strcmp(command, "continue"))
+            {
+                free(input);
+
+                if (!run_to_stop(&state))
+                {
+                    break;
+                }
+
+                continue;
+            }
+            else
+            {
+                if (!strcmp(command, "b") || !strcmp(command, "break"))
+                {
+                    add_breakpoint(&state, argc == 3 ? &source : NULL,
+                                   args ? args : "");
+                }
+                else if ((!strcmp(command, "w") ||
+                          !strcmp(command, "watch")) && args)
+                {
+                    add_watchpoint(&state, args);
+                }
+                else if (!strcmp(command, "d") || !strcmp(command, "delete"))
+                {
+                    delete_stop(args);
+                }
+                else if (!strcmp(command, "l") || !strcmp(command, "list"))
+                {
+                    list_stops();
+                }
+                else
+                {
+                    printf("Unrecognized command [%s].\n", command);
+                }
+
+                free(input);
+                continue;
+            }
         }
 
         free(input);
 
         if (run_next_instruction)
         {
-            if (!execute(&state))
+            bool running = execute(&state);
+
+            watch_changed(&state);
+
+            if (!running)
             {
                 break;
             }
@@ -192,7 +804,16 @@ int main(int argc, char* argv[])
 
     print_debug(&state);
 
-    free(state.memory);
+    if (state.status == RUN_FAULT)
+    {
+        printf("Program faulted at rip %llu.\n", state.registers[RIP]);
+    }
+
+    protect_watched(PROT_READ | PROT_WRITE);
+    free(break_bits);
+
+    output_free(&state.output);
+    memory_free(&state);
 
     return 0;
 }
@@ -1,25 +1,406 @@
+#include <stdlib.h>
 #include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
 
-#include "emulator.h"
+#include "jit.h"
+#include "batch.h"
+#include "snapshot.h"
+#include "profile.h"
+#include "opcost.h"
+
+void usage()
+{
+    printf("Usage: bemu [--dispatch=call|goto|tail] [--jit] [--fusion-stats]\n"
+           "            [--mem=<bytes>[K|M|G]] "
+           "[--huge-pages=off|advise|hugetlb]\n"
+           "            [--mem-stats] [--output=text|binary] "
+           "[--flush=exit|size|line]\n"
+           "            [--profile[=<file>]] [--op-costs] [--run-stats]\n"
+           "            [--safe]\n"
+           "            [--snapshot-at=<instructions> [--snapshot=<file>]]\n"
+           "            <binary_file>\n"
+           "       bemu [options] --restore=<snapshot_file>\n"
+           "       bemu [options] --batch=<manifest> [--jobs=<threads>]\n"
+           "            [--slice=<instructions>]\n");
+}
+
+static bool count_from_string(const char* text, uint64_t* out)
+{
+    char* end;
+    *out = strtoull(text, &end, 10);
+
+    return *text != '\0' && *end == '\0';
+}
+
+// One JSON object, so benchmark scripts can pick it up
+static void run_stats_report(
+        machine_state* state,
+        struct timespec* started,
+        FILE* out)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double seconds = (now.tv_sec - started->tv_sec) +
+                     (now.tv_nsec - started->tv_nsec) / 1e9;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    fprintf(out, "{\"instructions\": %llu, \"seconds\": %.6f, "
+            "\"mips\": %.1f, \"max_rss_kib\": %ld}\n",
+            state->retired, seconds,
+            seconds > 0 ? state->retired / seconds / 1e6 : 0.0,
+            usage.ru_maxrss);
+}
 
 int main(int argc, char* argv[])
 {
-    if (argc < 2)
+    enum dispatch_mode dispatch = DEFAULT_DISPATCH;
+    bool fusion_stats = false;
+    bool jit = false;
+    bool mem_stats = false;
+    memory_config memory = { MEMORY_SIZE, HUGE_PAGES_OFF, false };
+    enum output_format output_format = OUTPUT_TEXT;
+    enum output_flush output_flush_policy = FLUSH_SIZE;
+    bool flush_set = false;
+    const char* batch_manifest = NULL;
+    int batch_jobs = 0;
+    uint64_t batch_slice = 0;
+    bool snapshot = false;
+    uint64_t snapshot_at = 0;
+    const char* snapshot_file = "b.snap";
+    const char* restore_file = NULL;
+    bool profiling = false;
+    const char* profile_file = NULL;
+    bool op_costs = false;
+    bool run_stats = false;
+
+    static struct option options[] = {
+        { "dispatch",     required_argument, NULL, 'd' },
+        { "jit",          no_argument,       NULL, 'j' },
+        { "fusion-stats", no_argument,       NULL, 'f' },
+        { "mem",          required_argument, NULL, 'm' },
+        { "huge-pages",   required_argument, NULL, 'h' },
+        { "mem-stats",    no_argument,       NULL, 's' },
+        { "output",       required_argument, NULL, 'o' },
+        { "flush",        required_argument, NULL, 'F' },
+        { "batch",        required_argument, NULL, 'b' },
+        { "jobs",         required_argument, NULL, 'J' },
+        { "slice",        required_argument, NULL, 'l' },
+        { "snapshot-at",  required_argument, NULL, 'a' },
+        { "snapshot",     required_argument, NULL, 'S' },
+        { "restore",      required_argument, NULL, 'r' },
+        { "profile",      optional_argument, NULL, 'p' },
+        { "op-costs",     no_argument,       NULL, 'c' },
+        { "run-stats",    no_argument,       NULL, 't' },
+        { "safe",         no_argument,       NULL, 'V' },
+        { NULL,           0,                 NULL, 0   }
+    };
+
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'd':
+                if (!dispatch_from_string(optarg, &dispatch))
+                {
+                    printf("Unrecognized dispatch engine [%s].\n", optarg);
+                    return 1;
+                }
+
+                // Unoptimised builds can't guarantee the tail calls, so
+                // they run the goto engine instead
+                if (dispatch == DISPATCH_TAIL &&
+                    !dispatch_available(DISPATCH_TAIL) &&
+                    dispatch_available(DISPATCH_GOTO))
+                {
+                    fprintf(stderr, "Dispatch engine [tail] needs an "
+                            "optimised build (-O2); using [goto] instead.\n");
+                    dispatch = DISPATCH_GOTO;
+                }
+
+                if (!dispatch_available(dispatch))
+                {
+                    printf("Dispatch engine [%s] is not available in this "
+                           "build.\n", optarg);
+                    return 1;
+                }
+
+                break;
+
+            case 'j':
+                if (!jit_available())
+                {
+                    printf("The JIT is not available on this platform.\n");
+                    return 1;
+                }
+
+                jit = true;
+                break;
+
+            case 'f':
+                fusion_stats = true;
+                break;
+
+            case 'm':
+                if (!size_from_string(optarg, &memory.size))
+                {
+                    printf("Invalid memory size [%s].\n", optarg);
+                    return 1;
+                }
+
+                break;
+
+            case 'h':
+                if (!huge_pages_from_string(optarg, &memory.huge_pages))
+                {
+                    printf("Unrecognized huge page mode [%s].\n", optarg);
+                    return 1;
+                }
+
+                break;
+
+            case 's':
+                mem_stats = true;
+                break;
+
+            case 'o':
+                if (!output_format_from_string(optarg, &output_format))
+                {
+                    printf("Unrecognized output format [%s].\n", optarg);
+                    return 1;
+                }
+
+                break;
+
+            case 'F':
+                if (!output_flush_from_string(optarg, &output_flush_policy))
+                {
+                    printf("Unrecognized flush policy [%s].\n", optarg);
+                    return 1;
+                }
+
+                flush_set = true;
+                break;
+
+            case 'b':
+                batch_manifest = optarg;
+                break;
+
+            case 'J':
+                batch_jobs = atoi(optarg);
+
+                if (batch_jobs < 1)
+                {
+                    printf("Invalid job count [%s].\n", optarg);
+                    return 1;
+                }
+
+                break;
+
+            case 'l':
+                if (!count_from_string(optarg, &batch_slice) ||
+                    batch_slice == 0)
+                {
+                    printf("Invalid instruction count [%s].\n", optarg);
+                    return 1;
+                }
+
+                break;
+
+            case 'a':
+                if (!count_from_string(optarg, &snapshot_at))
+                {
+                    printf("Invalid instruction count [%s].\n", optarg);
+                    return 1;
+                }
+
+                snapshot = true;
+                break;
+
+            case 'S':
+                snapshot_file = optarg;
+                break;
+
+            case 'r':
+                restore_file = optarg;
+                break;
+
+            case 'p':
+                profiling = true;
+                profile_file = optarg;
+                break;
+
+            case 'c':
+                op_costs = true;
+                break;
+
+            case 't':
+                run_stats = true;
+                break;
+
+            case 'V':
+                memory.safe = true;
+                break;
+
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    // The cost counters time the reference interpreter, which doesn't check
+    // anything
+    if (op_costs && memory.safe)
     {
-        printf("Usage: bemu <binary_file>\n");
+        printf("--op-costs can't be used with --safe.\n");
         return 1;
     }
 
-    operands_init();
+    if (batch_manifest)
+    {
+        batch_config config = {
+            memory, dispatch, jit, output_format, batch_jobs, batch_slice
+        };
+
+        return batch_run(batch_manifest, &config) ? 1 : 0;
+    }
+
+    if (optind >= argc && !restore_file)
+    {
+        usage();
+        return 1;
+    }
 
     machine_state state;
-    load_binary(argv[1], &state);
 
-    emulator_init();
+    if (restore_file)
+    {
+        load_snapshot(restore_file, &state, &memory);
+    }
+    else
+    {
+        load_binary(argv[optind], &state, &memory);
+    }
+
+    state.output.format = output_format;
+
+    if (flush_set)
+    {
+        state.output.flush = output_flush_policy;
+    }
+
+    profile prof;
+
+    if (profiling)
+    {
+        profile_init(&prof, &state);
+    }
+
+    opcost_table costs;
+
+    if (op_costs)
+    {
+        opcost_init(&costs);
+    }
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    if (snapshot)
+    {
+        // The snapshot is taken instead of finishing the run
+        if (run_until(&state, snapshot_at))
+        {
+            write_snapshot(snapshot_file, &state);
+        }
+        else if (state.status == RUN_EXITED)
+        {
+            output_free(&state.output);
+            printf("Program exited after %llu instructions, before the "
+                   "snapshot point.\n", state.retired);
+            return 29;
+        }
+    }
+    else if (op_costs)
+    {
+        opcost_run(&state, &costs);
+    }
+    else if (profiling)
+    {
+        profile_run(&state, &prof);
+    }
+    else if (jit)
+    {
+        jit_run(&state);
+    }
+    else if (fusion_stats)
+    {
+        fusion_run(&state);
+    }
+    else
+    {
+        run(&state, dispatch);
+    }
+
+    output_free(&state.output);
+
+    if (run_stats)
+    {
+        run_stats_report(&state, &started, stderr);
+    }
+
+    // Written even when the guest faults, since that's often when it's wanted
+    if (profiling)
+    {
+        FILE* out = profile_file ? fopen(profile_file, "w") : stderr;
+
+        if (!out)
+        {
+            printf("Failed to open profile file [%s].\n", profile_file);
+            return 31;
+        }
+
+        profile_report(&prof, &state, out);
+
+        if (profile_file)
+        {
+            fclose(out);
+        }
 
-    while (execute(&state)) { }
+        profile_free(&prof);
+    }
+
+    if (op_costs)
+    {
+        opcost_report(&costs, stderr);
+        opcost_free(&costs);
+    }
+
+    if (state.status == RUN_FAULT)
+    {
+        printf("Program faulted at rip %llu.\n", state.registers[RIP]);
+        return 30;
+    }
+
+    if (fusion_stats)
+    {
+        fusion_report(&state, stderr);
+    }
+
+    if (mem_stats)
+    {
+        memory_report(&state, stderr);
+    }
 
-    free(state.memory);
+    jit_free(&state);
+    decoded_program_free(&state);
+    memory_free(&state);
 
     return 0;
 }
@@ -76,7 +76,7 @@ void bstring_print(bstring* target)
 
 void vec_bstring_print(vec_bstring* target)
 {
-    for (int i = 0; i < target->len; i++)
+    for (uint64_t i = 0; i < target->len; i++)
     {
         bstring_print(&target->items[i]);
         putchar('\n');
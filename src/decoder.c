@@ -0,0 +1,1347 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "decoder.h"
+#include "verifier.h"
+
+// The decoded stream keeps rip lazily: handlers that don't look at rip leave
+// the register alone, and anything that can observe it (the generic
+// fallback, call, exit) stores the real value first.
+
+// Generations are unique across programs, so a program allocated where a
+// freed one used to be is never mistaken for it
+static atomic_uint next_generation;
+
+// Guest address of an indirect or complex operand
+static inline uint64_t operand_address(
+        machine_state* state,
+        decoded_operand* op)
+{
+    uint64_t* r = state->registers;
+
+    if (op->kind == DOP_INDIRECT)
+    {
+        return r[op->base];
+    }
+
+    uint64_t addr = r[op->base] * op->multiplier;
+
+    if (op->register2 != NO_REGISTER)
+    {
+        addr += r[op->register2];
+    }
+
+    return addr + op->offset;
+}
+
+static inline unsigned char* operand_ptr(
+        machine_state* state,
+        decoded_operand* op)
+{
+    uint64_t* r = state->registers;
+
+    switch (op->kind)
+    {
+        case DOP_IMMEDIATE:
+            return (unsigned char*)&op->value;
+
+        case DOP_REGISTER:
+            return (unsigned char*)&r[op->base];
+
+        case DOP_ABSOLUTE:
+            return state->memory + op->value;
+
+        default:
+            return state->memory + operand_address(state, op);
+    }
+}
+
+static inline bool hits_code(machine_state* state, unsigned char* p)
+{
+    return (uintptr_t)p - (uintptr_t)state->memory < state->program->code_end;
+}
+
+static decoded_instruction* find(decoded_program* program, uint64_t rip)
+{
+    uint64_t offset = rip - IMG_HDR_LEN;
+
+    if (rip < IMG_HDR_LEN || rip >= program->code_end || offset % 8 != 0)
+    {
+        return NULL;
+    }
+
+    int slot = program->slots[offset / 8];
+
+    return slot < 0 ? NULL : &program->instructions[slot];
+}
+
+// Safe mode: whether every memory access d is about to make lands inside
+// guest memory, and it won't divide by zero. Operands the verifier already
+// proved in range (absolute addresses) aren't looked at.
+static bool can_execute(machine_state* state, decoded_instruction* d)
+{
+    uint64_t* r = state->registers;
+    uint64_t limit = state->memory_size;
+    uint64_t size = d->size;
+
+    // rip-relative operands see the next rip, as in the reference handlers
+    r[RIP] = d->next_rip;
+
+    for (int i = 0; i < operands[d->opcode]; i++)
+    {
+        decoded_operand* op = &d->operands[i];
+        uint64_t bytes = operand_bytes(d->opcode, d->size, i);
+
+        if ((op->kind == DOP_INDIRECT || op->kind == DOP_COMPLEX) &&
+            operand_address(state, op) > limit - bytes)
+        {
+            return false;
+        }
+    }
+
+    switch (d->opcode)
+    {
+        case OP_PUSH:
+            return r[RSP] >= size && r[RSP] - size <= limit - size;
+
+        // The reference call reads its target after pushing, so it can't be
+        // allowed to push over itself
+        case OP_CALL:
+            return r[RSP] >= B8 && r[RSP] - B8 <= limit - B8 &&
+                   (r[RSP] <= d->rip || r[RSP] - B8 >= d->next_rip);
+
+        case OP_POP:
+            return r[RSP] <= limit - size;
+
+        case OP_RET:
+            return r[RSP] <= limit - B8;
+
+        case OP_DIV:
+        case OP_MOD:
+            return load_sized(operand_ptr(state, &d->operands[1]), size) != 0;
+
+        default:
+            return true;
+    }
+}
+
+// Raw steps are the only way the guest can run anything but its decoded
+// code, so this is where running off into the weeds is caught. Safe mode
+// only runs decoded, verified code.
+static bool can_step(machine_state* state)
+{
+    uint64_t rip = state->registers[RIP];
+
+    if (state->safe)
+    {
+        decoded_instruction* d = find(state->program, rip);
+
+        if (!d || !can_execute(state, d))
+        {
+            state->registers[RIP] = rip;
+            state->status = RUN_FAULT;
+            return false;
+        }
+
+        return true;
+    }
+
+    if (rip > state->memory_size - sizeof(instruction) ||
+        state->memory[rip] >= OPCODE_COUNT)
+    {
+        state->status = RUN_FAULT;
+        return false;
+    }
+
+    return true;
+}
+
+decoded_instruction* decoded_resume(machine_state* state, uint64_t rip)
+{
+    decoded_instruction* d = find(state->program, rip);
+
+    if (d)
+    {
+        return d;
+    }
+
+    // Not a boundary the decoder knows about: step the reference interpreter
+    // until control lands on one again.
+    state->registers[RIP] = rip;
+
+    if (state->safe)
+    {
+        state->status = RUN_FAULT;
+        return NULL;
+    }
+
+    do
+    {
+        do
+        {
+            if (!can_step(state) || !execute(state))
+            {
+                return NULL;
+            }
+        }
+        while (!find(state->program, state->registers[RIP]));
+
+        // The raw steps may have rewritten code behind our back
+        decode_program(state);
+    }
+    while (!(d = find(state->program, state->registers[RIP])));
+
+    return d;
+}
+
+static decoded_instruction* invalidate(machine_state* state, uint64_t rip)
+{
+    decode_program(state);
+
+    return decoded_resume(state, rip);
+}
+
+static bool writes_operand(unsigned char opcode)
+{
+    switch (opcode)
+    {
+        case OP_MOV:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_INC:
+        case OP_DEC:
+        case OP_POP:
+        case OP_BCOPY:
+        case OP_BFILL:
+        case OP_VSTORE:
+        case OP_VSUM:
+        case OP_FADD:
+        case OP_FSUB:
+        case OP_FMUL:
+        case OP_FDIV:
+        case OP_ITOF:
+        case OP_FTOI:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static decoded_instruction* op_generic(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    instruction* inst = (instruction*)(state->memory + d->rip);
+    unsigned char* written = NULL;
+
+    state->registers[RIP] = d->next_rip;
+
+    if (writes_operand(inst->opcode))
+    {
+        written = resolve_operand(state, inst, 0);
+    }
+    else if (inst->opcode == OP_PUSH || inst->opcode == OP_CALL)
+    {
+        written = state->memory + state->registers[RSP] -
+                  (inst->opcode == OP_CALL ? B8 : inst->size);
+    }
+
+    if (!execute_instruction(state, inst))
+    {
+        return NULL;
+    }
+
+    if (written && hits_code(state, written))
+    {
+        return invalidate(state, state->registers[RIP]);
+    }
+
+    if (state->registers[RIP] != d->next_rip)
+    {
+        return decoded_resume(state, state->registers[RIP]);
+    }
+
+    return d + 1;
+}
+
+static decoded_instruction* op_resume(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    return decoded_resume(state, d->rip);
+}
+
+// Narrow operand sizes only come in the general operand form
+#define decoded_sized(bytes, type, stype, name, expr)                         \
+    static decoded_instruction* op_##name##_b##bytes(                         \
+            machine_state* state,                                             \
+            decoded_instruction* d)                                           \
+    {                                                                         \
+        unsigned char* target = operand_ptr(state, &d->operands[0]);          \
+        uint64_t left = load_b##bytes(target);                                \
+        uint64_t right =                                                      \
+            load_b##bytes(operand_ptr(state, &d->operands[1]));               \
+        store_b##bytes(target, d->operands[0].kind == DOP_REGISTER, expr);    \
+        if (hits_code(state, target))                                         \
+        {                                                                     \
+            return invalidate(state, d->next_rip);                            \
+        }                                                                     \
+        return d + 1;                                                         \
+    }
+
+#define decoded_binary(name, expr)                                            \
+    static decoded_instruction* op_##name##_rr(                               \
+            machine_state* state,                                             \
+            decoded_instruction* d)                                           \
+    {                                                                         \
+        uint64_t* r = state->registers;                                       \
+        uint64_t* target = &r[d->operands[0].base];                           \
+        uint64_t left = *target;                                              \
+        uint64_t right = r[d->operands[1].base];                              \
+        *target = expr;                                                       \
+        return d + 1;                                                         \
+    }                                                                         \
+    static decoded_instruction* op_##name##_ri(                               \
+            machine_state* state,                                             \
+            decoded_instruction* d)                                           \
+    {                                                                         \
+        uint64_t* target = &state->registers[d->operands[0].base];            \
+        uint64_t left = *target;                                              \
+        uint64_t right = d->operands[1].value;                                \
+        *target = expr;                                                       \
+        return d + 1;                                                         \
+    }                                                                         \
+    static decoded_instruction* op_##name##_xx(                               \
+            machine_state* state,                                             \
+            decoded_instruction* d)                                           \
+    {                                                                         \
+        unsigned char* target = operand_ptr(state, &d->operands[0]);          \
+        uint64_t left = *(uint64_t*)target;                                   \
+        uint64_t right = *(uint64_t*)operand_ptr(state, &d->operands[1]);     \
+        *(uint64_t*)target = expr;                                            \
+        if (hits_code(state, target))                                         \
+        {                                                                     \
+            return invalidate(state, d->next_rip);                            \
+        }                                                                     \
+        return d + 1;                                                         \
+    }                                                                         \
+    NARROW_SIZES(decoded_sized, name, expr)
+
+// mov never reads its target
+static decoded_instruction* op_mov_rr(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    uint64_t* r = state->registers;
+
+    r[d->operands[0].base] = r[d->operands[1].base];
+
+    return d + 1;
+}
+
+static decoded_instruction* op_mov_ri(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    state->registers[d->operands[0].base] = d->operands[1].value;
+
+    return d + 1;
+}
+
+static decoded_instruction* op_mov_xx(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    unsigned char* target = operand_ptr(state, &d->operands[0]);
+
+    *(uint64_t*)target = *(uint64_t*)operand_ptr(state, &d->operands[1]);
+
+    if (hits_code(state, target))
+    {
+        return invalidate(state, d->next_rip);
+    }
+
+    return d + 1;
+}
+
+#define decoded_mov_sized(bytes, type, stype, ...)                            \
+    static decoded_instruction* op_mov_b##bytes(                              \
+            machine_state* state,                                             \
+            decoded_instruction* d)                                           \
+    {                                                                         \
+        unsigned char* target = operand_ptr(state, &d->operands[0]);          \
+        uint64_t right =                                                      \
+            load_b##bytes(operand_ptr(state, &d->operands[1]));               \
+        store_b##bytes(target, d->operands[0].kind == DOP_REGISTER, right);   \
+        if (hits_code(state, target))                                         \
+        {                                                                     \
+            return invalidate(state, d->next_rip);                            \
+        }                                                                     \
+        return d + 1;                                                         \
+    }
+
+NARROW_SIZES(decoded_mov_sized)
+
+decoded_binary(add, left + right)
+decoded_binary(sub, left - right)
+decoded_binary(mul, left * right)
+decoded_binary(div, left / right)
+decoded_binary(mod, left % right)
+
+static decoded_instruction* op_cmp_rr(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    uint64_t* r = state->registers;
+    r[RFLAG] = r[d->operands[0].base] - r[d->operands[1].base];
+
+    return d + 1;
+}
+
+static decoded_instruction* op_cmp_ri(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    uint64_t* r = state->registers;
+    r[RFLAG] = r[d->operands[0].base] - d->operands[1].value;
+
+    return d + 1;
+}
+
+static decoded_instruction* op_cmp_xx(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    uint64_t left = *(uint64_t*)operand_ptr(state, &d->operands[0]);
+    uint64_t right = *(uint64_t*)operand_ptr(state, &d->operands[1]);
+    state->registers[RFLAG] = left - right;
+
+    return d + 1;
+}
+
+#define decoded_cmp_sized(bytes, type, stype, ...)                            \
+    static decoded_instruction* op_cmp_b##bytes(                              \
+            machine_state* state,                                             \
+            decoded_instruction* d)                                           \
+    {                                                                         \
+        uint64_t left = load_b##bytes(operand_ptr(state, &d->operands[0]));   \
+        uint64_t right = load_b##bytes(operand_ptr(state, &d->operands[1]));  \
+        state->registers[RFLAG] = sign_extend_b##bytes(left - right);         \
+        return d + 1;                                                         \
+    }
+
+NARROW_SIZES(decoded_cmp_sized)
+
+#define decoded_unary_sized(bytes, type, stype, name, op)                     \
+    static decoded_instruction* op_##name##_b##bytes(                         \
+            machine_state* state,                                             \
+            decoded_instruction* d)                                           \
+    {                                                                         \
+        unsigned char* target = operand_ptr(state, &d->operands[0]);          \
+        store_b##bytes(target, d->operands[0].kind == DOP_REGISTER,           \
+                       load_b##bytes(target) op 1);                           \
+        if (hits_code(state, target))                                         \
+        {                                                                     \
+            return invalidate(state, d->next_rip);                            \
+        }                                                                     \
+        return d + 1;                                                         \
+    }
+
+NARROW_SIZES(decoded_unary_sized, inc, +)
+NARROW_SIZES(decoded_unary_sized, dec, -)
+
+#define decoded_unary(name, op)                                               \
+    static decoded_instruction* op_##name##_r(                                \
+            machine_state* state,                                             \
+            decoded_instruction* d)                                           \
+    {                                                                         \
+        op state->registers[d->operands[0].base];                             \
+        return d + 1;                                                         \
+    }                                                                         \
+    static decoded_instruction* op_##name##_x(                                \
+            machine_state* state,                                             \
+            decoded_instruction* d)                                           \
+    {                                                                         \
+        unsigned char* target = operand_ptr(state, &d->operands[0]);          \
+        op *(uint64_t*)target;                                                \
+        if (hits_code(state, target))                                         \
+        {                                                                     \
+            return invalidate(state, d->next_rip);                            \
+        }                                                                     \
+        return d + 1;                                                         \
+    }
+
+decoded_unary(inc, ++)
+decoded_unary(dec, --)
+
+static decoded_instruction* op_push_x(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    unsigned char* data = operand_ptr(state, &d->operands[0]);
+
+    state->registers[RSP] -= B8;
+
+    unsigned char* target = state->memory + state->registers[RSP];
+    memcpy(target, data, B8);
+
+    if (hits_code(state, target))
+    {
+        return invalidate(state, d->next_rip);
+    }
+
+    return d + 1;
+}
+
+static decoded_instruction* op_pop_x(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    unsigned char* target = operand_ptr(state, &d->operands[0]);
+
+    memcpy(target, state->memory + state->registers[RSP], B8);
+    state->registers[RSP] += B8;
+
+    if (hits_code(state, target))
+    {
+        return invalidate(state, d->next_rip);
+    }
+
+    return d + 1;
+}
+
+// Every loop goes through a taken branch, so checking the budget there
+// bounds a run to within one basic block of its limit
+static inline bool out_of_budget(machine_state* state, uint64_t rip)
+{
+    if (state->retired < state->retired_limit)
+    {
+        return false;
+    }
+
+    state->registers[RIP] = rip;
+    state->status = RUN_BUDGET;
+
+    return true;
+}
+
+static inline decoded_instruction* branch(
+        machine_state* state,
+        decoded_instruction* target)
+{
+    return out_of_budget(state, target->rip) ? NULL : target;
+}
+
+static decoded_instruction* op_jmp(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    return branch(state, d->target);
+}
+
+#define decoded_conditional(name, cmp)                                        \
+    static decoded_instruction* op_##name(                                    \
+            machine_state* state,                                             \
+            decoded_instruction* d)                                           \
+    {                                                                         \
+        if ((int64_t)state->registers[RFLAG] cmp 0)                           \
+        {                                                                     \
+            return branch(state, d->target);                                  \
+        }                                                                     \
+        return d + 1;                                                         \
+    }
+
+decoded_conditional(je,  ==)
+decoded_conditional(jne, !=)
+decoded_conditional(jl,  < )
+decoded_conditional(jle, <=)
+decoded_conditional(jg,  > )
+decoded_conditional(jge, >=)
+
+static decoded_instruction* op_call(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    state->registers[RSP] -= B8;
+
+    unsigned char* target = state->memory + state->registers[RSP];
+    *(uint64_t*)target = d->next_rip;
+
+    if (hits_code(state, target))
+    {
+        return invalidate(state, d->target->rip);
+    }
+
+    return branch(state, d->target);
+}
+
+static decoded_instruction* op_ret(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    uint64_t rip = *(uint64_t*)(state->memory + state->registers[RSP]);
+    state->registers[RSP] += B8;
+
+    if (out_of_budget(state, rip))
+    {
+        return NULL;
+    }
+
+    return decoded_resume(state, rip);
+}
+
+static decoded_instruction* op_print_x(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    output_value(&state->output,
+                 *(uint64_t*)operand_ptr(state, &d->operands[0]));
+
+    return d + 1;
+}
+
+static decoded_instruction* op_exit(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    state->registers[RIP] = d->next_rip;
+
+    return NULL;
+}
+
+static inline uint64_t block_address(
+        machine_state* state,
+        decoded_operand* op)
+{
+    return op->kind == DOP_ABSOLUTE ? op->value : operand_address(state, op);
+}
+
+// Only chosen when the block operands are all addresses
+static decoded_instruction* op_bulk(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    uint64_t count = state->registers[R0];
+    uint64_t first = block_address(state, &d->operands[0]);
+    uint64_t second = bulk_blocks(d->opcode) == 2 ?
+        block_address(state, &d->operands[1]) :
+        load_sized(operand_ptr(state, &d->operands[1]), d->size);
+
+    if (!bulk_memory(state, d->opcode, d->size, first, second))
+    {
+        state->registers[RIP] = d->rip;
+        state->status = RUN_FAULT;
+        return NULL;
+    }
+
+    if (writes_operand(d->opcode) && count && first < state->program->code_end)
+    {
+        return invalidate(state, d->next_rip);
+    }
+
+    return d + 1;
+}
+
+// The engine has already counted the whole entry, so a part that faults or
+// rewrites the code hands back the parts it never ran
+#define FUSED_PART(name, entry, unrun)                                        \
+    {                                                                         \
+        decoded_instruction* next = op_##name(state, entry);                  \
+        if (next != entry + 1)                                                \
+        {                                                                     \
+            state->retired -= unrun;                                          \
+            return next;                                                      \
+        }                                                                     \
+    }
+
+#define FUSED2(a, b)                                                          \
+    static decoded_instruction* op_##a##__##b(                                \
+            machine_state* state,                                             \
+            decoded_instruction* d)                                           \
+    {                                                                         \
+        FUSED_PART(a, d, 1)                                                   \
+        return op_##b(state, d + 1);                                          \
+    }
+
+#define FUSED3(a, b, c)                                                       \
+    static decoded_instruction* op_##a##__##b##__##c(                         \
+            machine_state* state,                                             \
+            decoded_instruction* d)                                           \
+    {                                                                         \
+        FUSED_PART(a, d, 2)                                                   \
+        FUSED_PART(b, d + 1, 1)                                               \
+        return op_##c(state, d + 2);                                          \
+    }
+
+DECODED_FUSIONS(FUSED2, FUSED3)
+
+#undef FUSED_PART
+#undef FUSED2
+#undef FUSED3
+
+typedef struct
+{
+    const char* name;
+    int len;
+    unsigned short parts[3];
+    unsigned short fused;
+} fusion;
+
+#define FUSED2(a, b) { #a " " #b, 2, { H_##a, H_##b }, H_##a##__##b },
+#define FUSED3(a, b, c)                                                       \
+    { #a " " #b " " #c, 3, { H_##a, H_##b, H_##c }, H_##a##__##b##__##c },
+
+static const fusion fusions[FUSION_COUNT] = {
+    DECODED_FUSIONS(FUSED2, FUSED3)
+};
+
+#undef FUSED2
+#undef FUSED3
+
+static decoded_instruction* op_checked(
+        machine_state* state,
+        decoded_instruction* d);
+
+#define X(name) op_##name,
+static const decoded_handler handlers[HANDLER_COUNT] = {
+    DECODED_HANDLERS(X)
+};
+#undef X
+
+static decoded_instruction* op_checked(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    if (!can_execute(state, d))
+    {
+        state->registers[RIP] = d->rip;
+        state->status = RUN_FAULT;
+        return NULL;
+    }
+
+    return handlers[d->checked](state, d);
+}
+
+// Safe mode checks anything that touches memory through a register, the
+// stack, or divides
+static bool needs_check(decoded_instruction* d)
+{
+    switch (d->opcode)
+    {
+        case OP_PUSH:
+        case OP_POP:
+        case OP_CALL:
+        case OP_RET:
+        case OP_DIV:
+        case OP_MOD:
+            return true;
+
+        default:
+            break;
+    }
+
+    for (int i = 0; i < operands[d->opcode]; i++)
+    {
+        if (d->operands[i].kind == DOP_INDIRECT ||
+            d->operands[i].kind == DOP_COMPLEX)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool references_rip(decoded_operand* op)
+{
+    return op->kind != DOP_IMMEDIATE && op->kind != DOP_ABSOLUTE &&
+           (op->base == RIP || op->register2 == RIP);
+}
+
+static bool decode_operand(instruction* inst, int ordinal, decoded_operand* op)
+{
+    unsigned char type = inst->operand_types[ordinal];
+    complex_operand* comp = (complex_operand*)&inst->operands[ordinal];
+
+    op->value = inst->operands[ordinal];
+    op->base = comp->base;
+    op->multiplier = comp->multiplier;
+    op->register2 = comp->register2_sign ? comp->register2 : NO_REGISTER;
+    op->offset = comp->offset;
+
+    if (type & COMPLEX)
+    {
+        op->kind = DOP_COMPLEX;
+    }
+    else if (type & IMMEDIATE)
+    {
+        op->kind = type & ADDRESS ? DOP_ABSOLUTE : DOP_IMMEDIATE;
+        return true;
+    }
+    else if (type & REGISTER)
+    {
+        op->kind = type & ADDRESS ? DOP_INDIRECT : DOP_REGISTER;
+    }
+    else
+    {
+        return false;
+    }
+
+    return op->base < REGISTER_COUNT &&
+           (op->register2 == NO_REGISTER || op->register2 < REGISTER_COUNT) &&
+           !references_rip(op);
+}
+
+static bool names_blocks(decoded_instruction* d)
+{
+    for (int i = 0; i < bulk_blocks(d->opcode); i++)
+    {
+        if (d->operands[i].kind == DOP_IMMEDIATE ||
+            d->operands[i].kind == DOP_REGISTER)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Pick the handler for one instruction based on its opcode and the shapes
+// of its operands. Anything unusual runs through the reference handlers.
+static unsigned short select_handler(decoded_instruction* d, bool plain)
+{
+    decoded_operand* op = d->operands;
+
+    if (!plain)
+    {
+        return H_generic;
+    }
+
+    if (is_jump(d->opcode) || d->opcode == OP_CALL)
+    {
+        if (op[0].kind != DOP_IMMEDIATE || !d->target)
+        {
+            return H_generic;
+        }
+    }
+    else if (writes_operand(d->opcode) && op[0].kind == DOP_IMMEDIATE)
+    {
+        // Writes into the instruction's own immediate modify the code
+        return H_generic;
+    }
+
+    bool reg0 = op[0].kind == DOP_REGISTER;
+    bool reg1 = op[1].kind == DOP_REGISTER;
+    bool imm1 = op[1].kind == DOP_IMMEDIATE;
+    bool wide = d->size == B8;
+
+#define select_narrow(name)                                                   \
+    d->size == B1 ? H_##name##_b1 :                                           \
+    d->size == B2 ? H_##name##_b2 :                                           \
+    d->size == B4 ? H_##name##_b4 : H_generic
+
+#define select_binary(name)                                                   \
+    return !wide        ? select_narrow(name) :                               \
+           reg0 && reg1 ? H_##name##_rr :                                     \
+           reg0 && imm1 ? H_##name##_ri : H_##name##_xx;
+
+#define select_unary(name)                                                    \
+    return !wide ? select_narrow(name) :                                      \
+           reg0  ? H_##name##_r : H_##name##_x;
+
+    switch (d->opcode)
+    {
+        case OP_MOV:   select_binary(mov)
+        case OP_ADD:   select_binary(add)
+        case OP_SUB:   select_binary(sub)
+        case OP_MUL:   select_binary(mul)
+        case OP_DIV:   select_binary(div)
+        case OP_MOD:   select_binary(mod)
+        case OP_CMP:   select_binary(cmp)
+        case OP_INC:   select_unary(inc)
+        case OP_DEC:   select_unary(dec)
+        case OP_PUSH:  return wide ? H_push_x : H_generic;
+        case OP_POP:   return wide ? H_pop_x : H_generic;
+        case OP_JMP:   return H_jmp;
+        case OP_JE:    return H_je;
+        case OP_JNE:   return H_jne;
+        case OP_JL:    return H_jl;
+        case OP_JLE:   return H_jle;
+        case OP_JG:    return H_jg;
+        case OP_JGE:   return H_jge;
+        case OP_CALL:  return H_call;
+        case OP_RET:   return H_ret;
+        case OP_PRINT: return wide ? H_print_x : H_generic;
+        case OP_EXIT:  return H_exit;
+        case OP_BCOPY:
+        case OP_BFILL:
+        case OP_BCMP:
+        case OP_BSCAN: return names_blocks(d) ? H_bulk : H_generic;
+        default:       return H_generic;
+    }
+
+#undef select_narrow
+#undef select_binary
+#undef select_unary
+}
+
+static void fuse(decoded_program* program)
+{
+    for (int i = 0; i < program->count; i++)
+    {
+        decoded_instruction* d = &program->instructions[i];
+
+        for (int f = 0; f < FUSION_COUNT; f++)
+        {
+            const fusion* candidate = &fusions[f];
+
+            if (i + candidate->len > program->count)
+            {
+                continue;
+            }
+
+            bool match = true;
+
+            for (int j = 0; j < candidate->len && match; j++)
+            {
+                match = d[j].op == candidate->parts[j];
+            }
+
+            // The later instructions keep their own handlers, so jumping
+            // into the middle of a fused run still works.
+            if (match)
+            {
+                d->op = candidate->fused;
+                d->handler = handlers[d->op];
+                d->weight = candidate->len;
+                break;
+            }
+        }
+    }
+}
+
+static int compare_fusion_hits(const void* left, const void* right)
+{
+    uint64_t l = *(uint64_t*)left;
+    uint64_t r = *(uint64_t*)right;
+
+    return l < r ? 1 : l > r ? -1 : 0;
+}
+
+void fusion_report(machine_state* state, FILE* out)
+{
+    if (!state->program)
+    {
+        return;
+    }
+
+    struct
+    {
+        uint64_t hits;
+        int index;
+    } sorted[FUSION_COUNT];
+
+    uint64_t total = 0;
+
+    for (int i = 0; i < FUSION_COUNT; i++)
+    {
+        sorted[i].hits = state->program->fusion_hits[i];
+        sorted[i].index = i;
+        total += sorted[i].hits;
+    }
+
+    qsort(sorted, FUSION_COUNT, sizeof(sorted[0]), compare_fusion_hits);
+
+    fprintf(out, "%12s  %s\n", "hits", "superinstruction");
+
+    for (int i = 0; i < FUSION_COUNT && sorted[i].hits; i++)
+    {
+        fprintf(out, "%12llu  %s\n", sorted[i].hits,
+                fusions[sorted[i].index].name);
+    }
+
+    fprintf(out, "%12llu  total\n", total);
+}
+
+void decoded_program_free(machine_state* state)
+{
+    if (!state->program)
+    {
+        return;
+    }
+
+    free(state->program->instructions);
+    free(state->program->slots);
+    free(state->program);
+
+    state->program = NULL;
+}
+
+void decode_program(machine_state* state)
+{
+    decoded_program* program = malloc(sizeof(decoded_program));
+
+    program->generation = atomic_fetch_add(&next_generation, 1);
+
+    // Keep fusion counts across re-decodes
+    if (state->program)
+    {
+        memcpy(program->fusion_hits, state->program->fusion_hits,
+               sizeof(program->fusion_hits));
+    }
+    else
+    {
+        memset(program->fusion_hits, 0, sizeof(program->fusion_hits));
+    }
+
+    decoded_program_free(state);
+
+    uint64_t code_bytes = *(uint64_t*)(state->memory + IMG_HDR_CODE_BYTES);
+
+    // The header is guest memory too, and the guest can write anything there
+    if (code_bytes > state->memory_size - IMG_HDR_LEN)
+    {
+        code_bytes = state->memory_size - IMG_HDR_LEN;
+    }
+
+    int slot_count = code_bytes / 8;
+
+    program->code_end = IMG_HDR_LEN + code_bytes;
+    program->slots = malloc(sizeof(int) * (slot_count + 1));
+    program->instructions =
+        malloc(sizeof(decoded_instruction) * (slot_count + 1));
+    program->count = 0;
+
+    for (int i = 0; i < slot_count; i++)
+    {
+        program->slots[i] = -1;
+    }
+
+    state->program = program;
+
+    // First pass: find instruction boundaries and operand shapes
+    uint64_t rip = IMG_HDR_LEN;
+    bool* plain = malloc(sizeof(bool) * (slot_count + 1));
+
+    while (rip < program->code_end)
+    {
+        instruction* inst = (instruction*)(state->memory + rip);
+
+        if (inst->opcode >= OPCODE_COUNT)
+        {
+            break;
+        }
+
+        int len = instruction_encoded_len(operands[inst->opcode]);
+
+        if (rip + len > program->code_end)
+        {
+            break;
+        }
+
+        // Safe mode only decodes what passes the verifier, which includes
+        // code the program writes for itself
+        if (state->safe &&
+            verify_instruction(state, rip, program->code_end, &len))
+        {
+            break;
+        }
+
+        int index = program->count++;
+        decoded_instruction* d = &program->instructions[index];
+        memset(d, 0, sizeof(decoded_instruction));
+
+        program->slots[(rip - IMG_HDR_LEN) / 8] = index;
+
+        d->rip = rip;
+        d->next_rip = rip + len;
+        d->opcode = inst->opcode;
+        d->size = inst->size;
+        d->weight = 1;
+
+        plain[index] = true;
+
+        for (int j = 0; j < operands[inst->opcode]; j++)
+        {
+            plain[index] &= decode_operand(inst, j, &d->operands[j]);
+        }
+
+        rip += len;
+    }
+
+    // Sentinel for running off the end of what could be decoded
+    decoded_instruction* end = &program->instructions[program->count];
+    memset(end, 0, sizeof(decoded_instruction));
+    end->rip = rip;
+    end->next_rip = rip;
+    end->op = H_resume;
+    end->handler = op_resume;
+
+    // Second pass: link static jump targets and choose handlers
+    for (int i = 0; i < program->count; i++)
+    {
+        decoded_instruction* d = &program->instructions[i];
+
+        if ((is_jump(d->opcode) || d->opcode == OP_CALL) &&
+            d->operands[0].kind == DOP_IMMEDIATE)
+        {
+            d->target = find(program, IMG_HDR_LEN + d->operands[0].value);
+        }
+
+        d->op = select_handler(d, plain[i]);
+
+        if (state->safe && needs_check(d))
+        {
+            d->checked = d->op;
+            d->op = H_checked;
+        }
+
+        d->handler = handlers[d->op];
+    }
+
+    fuse(program);
+
+    free(plain);
+}
+
+// The engines count retired instructions by each entry's weight as they
+// dispatch it, straight into the state so branches can check the budget.
+// Raw steps taken by decoded_resume count themselves.
+static void run_call(machine_state* state, decoded_instruction* d)
+{
+    while (d)
+    {
+        state->retired += d->weight;
+        d = d->handler(state, d);
+    }
+}
+
+#ifdef __GNUC__
+
+static void run_goto(machine_state* state, decoded_instruction* d)
+{
+#define X(name) &&label_##name,
+    static void* const labels[HANDLER_COUNT] = { DECODED_HANDLERS(X) };
+#undef X
+
+    if (!d)
+    {
+        return;
+    }
+
+    goto *labels[d->op];
+
+#define X(name)                                                               \
+    label_##name:                                                             \
+        state->retired += d->weight;                                          \
+        d = op_##name(state, d);                                              \
+        if (!d)                                                               \
+        {                                                                     \
+            return;                                                           \
+        }                                                                     \
+        goto *labels[d->op];
+
+    DECODED_HANDLERS(X)
+#undef X
+}
+
+#endif
+
+#ifdef DISPATCH_TAIL_AVAILABLE
+
+typedef void (*tail_handler)(machine_state* state, decoded_instruction* d);
+
+#define X(name)                                                               \
+    static void tail_##name(machine_state* state, decoded_instruction* d);
+DECODED_HANDLERS(X)
+#undef X
+
+#define X(name) tail_##name,
+static const tail_handler tail_handlers[HANDLER_COUNT] = {
+    DECODED_HANDLERS(X)
+};
+#undef X
+
+#define X(name)                                                               \
+    static void tail_##name(machine_state* state, decoded_instruction* d)     \
+    {                                                                         \
+        state->retired += d->weight;                                          \
+        d = op_##name(state, d);                                              \
+        if (!d)                                                               \
+        {                                                                     \
+            return;                                                           \
+        }                                                                     \
+        MUSTTAIL return tail_handlers[d->op](state, d);                       \
+    }
+DECODED_HANDLERS(X)
+#undef X
+
+static void run_tail(machine_state* state, decoded_instruction* d)
+{
+    if (d)
+    {
+        tail_handlers[d->op](state, d);
+    }
+}
+
+#endif
+
+bool dispatch_available(enum dispatch_mode mode)
+{
+    switch (mode)
+    {
+        case DISPATCH_CALL:
+            return true;
+
+#ifdef __GNUC__
+        case DISPATCH_GOTO:
+            return true;
+#endif
+
+#ifdef DISPATCH_TAIL_AVAILABLE
+        case DISPATCH_TAIL:
+            return true;
+#endif
+
+        default:
+            return false;
+    }
+}
+
+bool dispatch_from_string(const char* name, enum dispatch_mode* out)
+{
+    if      (strcmp(name, "call") == 0) { *out = DISPATCH_CALL; }
+    else if (strcmp(name, "goto") == 0) { *out = DISPATCH_GOTO; }
+    else if (strcmp(name, "tail") == 0) { *out = DISPATCH_TAIL; }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+enum run_status run_for(
+        machine_state* state,
+        enum dispatch_mode mode,
+        uint64_t max_instructions)
+{
+    state->status = RUN_EXITED;
+    state->retired_limit = max_instructions > UINT64_MAX - state->retired ?
+        UINT64_MAX : state->retired + max_instructions;
+
+    if (!state->program)
+    {
+        decode_program(state);
+    }
+
+    decoded_instruction* d = decoded_resume(state, state->registers[RIP]);
+
+    switch (mode)
+    {
+#ifdef __GNUC__
+        // Builds without the tail engine get the nearest thing to it
+#ifndef DISPATCH_TAIL_AVAILABLE
+        case DISPATCH_TAIL:
+#endif
+        case DISPATCH_GOTO:
+            run_goto(state, d);
+            break;
+#endif
+
+#ifdef DISPATCH_TAIL_AVAILABLE
+        case DISPATCH_TAIL:
+            run_tail(state, d);
+            break;
+#endif
+
+        default:
+            run_call(state, d);
+            break;
+    }
+
+    return state->status;
+}
+
+enum run_status run(machine_state* state, enum dispatch_mode mode)
+{
+    return run_for(state, mode, UINT64_MAX);
+}
+
+// Fused handlers come last in DECODED_HANDLERS, in DECODED_FUSIONS order
+#define FIRST_FUSION (HANDLER_COUNT - FUSION_COUNT)
+
+enum run_status fusion_run(machine_state* state)
+{
+    state->status = RUN_EXITED;
+    state->retired_limit = UINT64_MAX;
+
+    if (!state->program)
+    {
+        decode_program(state);
+    }
+
+    decoded_instruction* d = decoded_resume(state, state->registers[RIP]);
+
+    while (d)
+    {
+        if (d->op >= FIRST_FUSION)
+        {
+            state->program->fusion_hits[d->op - FIRST_FUSION]++;
+        }
+
+        state->retired += d->weight;
+        d = d->handler(state, d);
+    }
+
+    return state->status;
+}
+
+#undef FIRST_FUSION
+
+// Stops once limit instructions have retired, checking before each dispatch.
+// A fused entry that would cross the limit is finished one raw step at a
+// time, so the guest stops exactly on it unless decoded_resume had to step
+// past it.
+bool run_until(machine_state* state, uint64_t limit)
+{
+    state->status = RUN_EXITED;
+    state->retired_limit = UINT64_MAX;
+
+    if (!state->program)
+    {
+        decode_program(state);
+    }
+
+    decoded_instruction* d = decoded_resume(state, state->registers[RIP]);
+
+    while (d && state->retired + d->weight <= limit)
+    {
+        state->retired += d->weight;
+        d = d->handler(state, d);
+    }
+
+    if (!d)
+    {
+        return false;
+    }
+
+    // rip is only kept up to date when something looks at it
+    state->registers[RIP] = d->rip;
+
+    while (state->retired < limit)
+    {
+        if (!can_step(state) || !execute(state))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
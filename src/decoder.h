@@ -0,0 +1,181 @@
+#ifndef _DECODER_H
+#define _DECODER_H
+
+#include <stdio.h>
+
+#include "emulator.h"
+
+#define NO_REGISTER 0xff
+
+enum decoded_operand_kind
+{
+    DOP_IMMEDIATE,
+    DOP_REGISTER,
+    DOP_ABSOLUTE,
+    DOP_INDIRECT,
+    DOP_COMPLEX
+};
+
+typedef struct
+{
+    unsigned char kind;
+    unsigned char base;
+    unsigned char multiplier;
+    unsigned char register2;
+    int offset;
+    uint64_t value;
+} decoded_operand;
+
+// Superinstructions: runs of adjacent handlers executed with a single
+// dispatch. Each entry names the handlers it strings together; longer runs
+// come first so they win over their own prefixes. Only handlers that always
+// fall through to the next instruction may appear before the last slot.
+#define FUSED_JCC(F, ...)                                                     \
+    F(__VA_ARGS__, je) F(__VA_ARGS__, jne)                                    \
+    F(__VA_ARGS__, jl) F(__VA_ARGS__, jle)                                    \
+    F(__VA_ARGS__, jg) F(__VA_ARGS__, jge)
+
+#define FUSED_MATH(F, first)                                                  \
+    F(first, add_rr) F(first, add_ri) F(first, add_xx)                        \
+    F(first, sub_rr) F(first, sub_ri) F(first, sub_xx)                        \
+    F(first, mul_rr) F(first, mul_ri) F(first, mul_xx)                        \
+    F(first, div_rr) F(first, div_ri) F(first, div_xx)                        \
+    F(first, mod_rr) F(first, mod_ri) F(first, mod_xx)
+
+#define DECODED_FUSIONS(F2, F3)                                               \
+    FUSED_JCC(F3, inc_r, cmp_rr)                                              \
+    FUSED_JCC(F3, inc_r, cmp_ri)                                              \
+    FUSED_JCC(F2, cmp_rr)                                                     \
+    FUSED_JCC(F2, cmp_ri)                                                     \
+    FUSED_JCC(F2, cmp_xx)                                                     \
+    FUSED_MATH(F2, mov_rr)
+
+// These expand through whichever X is defined where DECODED_HANDLERS is used
+#define X_FUSED2(a, b) X(a##__##b)
+#define X_FUSED3(a, b, c) X(a##__##b##__##c)
+
+// Byte, word and dword forms of a handler
+#define X_NARROW(X, name) X(name##_b1) X(name##_b2) X(name##_b4)
+
+// Every handler in decoder.c, in one list so the dispatch engines can build
+// their tables from it
+#define DECODED_HANDLERS(X)                                                   \
+    X(generic) X(resume) X(checked)                                           \
+    X(mov_rr) X(mov_ri) X(mov_xx) X_NARROW(X, mov)                            \
+    X(add_rr) X(add_ri) X(add_xx) X_NARROW(X, add)                            \
+    X(sub_rr) X(sub_ri) X(sub_xx) X_NARROW(X, sub)                            \
+    X(mul_rr) X(mul_ri) X(mul_xx) X_NARROW(X, mul)                            \
+    X(div_rr) X(div_ri) X(div_xx) X_NARROW(X, div)                            \
+    X(mod_rr) X(mod_ri) X(mod_xx) X_NARROW(X, mod)                            \
+    X(cmp_rr) X(cmp_ri) X(cmp_xx) X_NARROW(X, cmp)                            \
+    X(inc_r) X(inc_x) X_NARROW(X, inc)                                        \
+    X(dec_r) X(dec_x) X_NARROW(X, dec)                                        \
+    X(push_x) X(pop_x)                                                        \
+    X(jmp) X(je) X(jne) X(jl) X(jle) X(jg) X(jge)                             \
+    X(call) X(ret) X(print_x) X(exit) X(bulk)                                 \
+    DECODED_FUSIONS(X_FUSED2, X_FUSED3)
+
+#define X(name) H_##name,
+enum decoded_handler_ids
+{
+    DECODED_HANDLERS(X)
+    HANDLER_COUNT
+};
+#undef X
+
+#define X(name) F_##name,
+enum decoded_fusion_ids
+{
+    DECODED_FUSIONS(X_FUSED2, X_FUSED3)
+    FUSION_COUNT
+};
+#undef X
+
+enum dispatch_mode
+{
+    DISPATCH_CALL,
+    DISPATCH_GOTO,
+    DISPATCH_TAIL
+};
+
+#ifndef DEFAULT_DISPATCH
+#define DEFAULT_DISPATCH DISPATCH_CALL
+#endif
+
+// The tail-call engine needs every handler-to-handler call to be a real
+// jump. That is guaranteed with musttail, and in practice with gcc's
+// sibling call optimisation once optimising.
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#define DISPATCH_TAIL_AVAILABLE
+#endif
+#endif
+
+#if !defined(DISPATCH_TAIL_AVAILABLE) && defined(__GNUC__) && \
+    defined(__OPTIMIZE__)
+#define MUSTTAIL
+#define DISPATCH_TAIL_AVAILABLE
+#endif
+
+typedef struct decoded_instruction decoded_instruction;
+
+typedef decoded_instruction* (*decoded_handler)(
+        machine_state* state,
+        decoded_instruction* d);
+
+struct decoded_instruction
+{
+    decoded_handler handler;
+    decoded_instruction* target;
+    uint64_t rip;
+    uint64_t next_rip;
+    unsigned char opcode;
+    unsigned char size;
+    unsigned short op;
+    // Guest instructions this entry's handler retires
+    unsigned char weight;
+    // Safe mode: the handler a checked entry runs once its accesses pass
+    unsigned short checked;
+    decoded_operand operands[MAX_OPERANDS];
+};
+
+typedef struct decoded_program
+{
+    decoded_instruction* instructions;
+    int count;
+    int* slots;
+    uint64_t code_end;
+    // Bumped on every re-decode, for caches keyed on the program
+    unsigned generation;
+    uint64_t fusion_hits[FUSION_COUNT];
+} decoded_program;
+
+void decode_program(machine_state* state);
+void decoded_program_free(machine_state* state);
+
+decoded_instruction* decoded_resume(machine_state* state, uint64_t rip);
+
+// Runs the guest to the end on the call engine like run(), counting each
+// superinstruction as it's dispatched for fusion_report
+enum run_status fusion_run(machine_state* state);
+void fusion_report(machine_state* state, FILE* out);
+
+bool dispatch_available(enum dispatch_mode mode);
+bool dispatch_from_string(const char* name, enum dispatch_mode* out);
+
+// Runs until the guest exits or faults, or has retired about
+// max_instructions more: the budget is checked on taken branches, so a run
+// can go over by up to a basic block. Sets and returns state->status.
+enum run_status run_for(
+        machine_state* state,
+        enum dispatch_mode mode,
+        uint64_t max_instructions);
+
+enum run_status run(machine_state* state, enum dispatch_mode mode);
+
+// Runs on the call engine until the guest exits or has retired limit
+// instructions in total. Returns true if it's still running.
+bool run_until(machine_state* state, uint64_t limit);
+
+#endif
@@ -6,6 +6,14 @@ void operand_to_string(instruction* inst, int ordinal, char* out)
 {
     unsigned char type = inst->operand_types[ordinal];
 
+    if (operand_role(inst->opcode, ordinal) == ROLE_VECTOR)
+    {
+        complex_operand* comp = (complex_operand*)&inst->operands[ordinal];
+
+        snprintf(out, 32, "%s", vector_to_string(comp->base));
+        return;
+    }
+
     if (type & ADDRESS)
     {
         *(out++) = '[';
@@ -73,6 +81,26 @@ const char* opcode_to_string(unsigned char opcode)
         case OP_JLE:    return "jle";
         case OP_JGE:    return "jge";
         case OP_PRINT:  return "print";
+        case OP_BCOPY:  return "bcopy";
+        case OP_BFILL:  return "bfill";
+        case OP_BCMP:   return "bcmp";
+        case OP_BSCAN:  return "bscan";
+        case OP_VLOAD:  return "vload";
+        case OP_VSTORE: return "vstore";
+        case OP_VSPLAT: return "vsplat";
+        case OP_VADD:   return "vadd";
+        case OP_VSUB:   return "vsub";
+        case OP_VMUL:   return "vmul";
+        case OP_VMIN:   return "vmin";
+        case OP_VMAX:   return "vmax";
+        case OP_VSUM:   return "vsum";
+        case OP_FADD:   return "fadd";
+        case OP_FSUB:   return "fsub";
+        case OP_FMUL:   return "fmul";
+        case OP_FDIV:   return "fdiv";
+        case OP_FCMP:   return "fcmp";
+        case OP_ITOF:   return "itof";
+        case OP_FTOI:   return "ftoi";
 
         default:
             printf("Unrecognized opcode\n");
@@ -85,16 +113,16 @@ const char* size_to_string(unsigned char size)
     switch (size)
     {
         case B1:
-            return "B1";
+            return "byte";
 
         case B2:
-            return "B2";
+            return "word";
 
         case B4:
-            return "B4";
+            return "dword";
 
         case B8:
-            return "B8";
+            return "qword";
 
         default:
             printf("Unrecognized size\n");
@@ -122,3 +150,22 @@ const char* register_to_string(unsigned char r)
             exit(13);
     }
 }
+
+const char* vector_to_string(unsigned char v)
+{
+    switch (v)
+    {
+        case V0: return "v0";
+        case V1: return "v1";
+        case V2: return "v2";
+        case V3: return "v3";
+        case V4: return "v4";
+        case V5: return "v5";
+        case V6: return "v6";
+        case V7: return "v7";
+
+        default:
+            printf("Unrecognized vector register\n");
+            exit(13);
+    }
+}
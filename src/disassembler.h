@@ -7,3 +7,5 @@ const char* opcode_to_string(unsigned char opcode);
 const char* size_to_string(unsigned char size);
 
 const char* register_to_string(unsigned char r);
+
+const char* vector_to_string(unsigned char v);
@@ -1,13 +1,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "emulator.h"
-
-bool (*opcode_handlers[OPCODE_COUNT])(machine_state* state, instruction* inst);
-
-char* print_prefix = "";
-char* print_suffix = "";
+#include "image.h"
+#include "simd.h"
+#include "verifier.h"
 
 unsigned char* resolve_operand(
         machine_state* state,
@@ -63,6 +65,11 @@ unsigned char* resolve_operand(
     }
 }
 
+bool writes_register(instruction* inst, int ordinal)
+{
+    return (inst->operand_types[ordinal] & (REGISTER | ADDRESS)) == REGISTER;
+}
+
 bool push(machine_state* state, unsigned char* data, unsigned char size)
 {
     state->registers[RSP] -= size;
@@ -105,16 +112,18 @@ bool execute_push(machine_state* state, instruction* inst)
 
 bool execute_pop(machine_state* state, instruction* inst)
 {
-    pop(state, resolve_operand(state, inst, 0), inst->size);
+    unsigned char* target = resolve_operand(state, inst, 0);
 
-    return true;
-}
+    if (writes_register(inst, 0))
+    {
+        *(uint64_t*)target = load_sized(
+                state->memory + state->registers[RSP], inst->size);
+        state->registers[RSP] += inst->size;
 
-bool execute_mov(machine_state* state, instruction* inst)
-{
-    memcpy(resolve_operand(state, inst, 0),
-           resolve_operand(state, inst, 1),
-           inst->size);
+        return true;
+    }
+
+    pop(state, target, inst->size);
 
     return true;
 }
@@ -134,62 +143,62 @@ bool execute_ret(machine_state* state, instruction* inst)
     return true;
 }
 
-void basic_math(
-        machine_state* state,
-        instruction* inst,
-        uint64_t (*handler)(uint64_t, uint64_t))
-{
-    unsigned char* target = resolve_operand(state, inst, 0);
-    uint64_t left = *(uint64_t*)target;
-    uint64_t right = *(uint64_t*)resolve_operand(state, inst, 1);
-    uint64_t result = handler(left, right);
-    memcpy(target, &result, inst->size);
-}
-
-#define math_handler(name, op)                                                \
-    uint64_t math_handler_##name(uint64_t left, uint64_t right)               \
+// One handler per operand size. Both sides are loaded zero-extended and the
+// result is truncated back to the operand size on the store.
+#define math_handler_sized(bytes, type, stype, name, expr)                    \
+    bool execute_##name##_b##bytes(machine_state* state, instruction* inst)   \
     {                                                                         \
-        return left op right;                                                 \
-    }                                                                         \
-    bool execute_##name(machine_state* state, instruction* inst)              \
-    {                                                                         \
-        basic_math(state, inst, math_handler_##name);                         \
+        unsigned char* target = resolve_operand(state, inst, 0);              \
+        uint64_t left = load_b##bytes(target);                                \
+        uint64_t right = load_b##bytes(resolve_operand(state, inst, 1));      \
+        store_b##bytes(target, writes_register(inst, 0), expr);               \
         return true;                                                          \
-    }                                                                         \
+    }
 
-math_handler(add, +)
-math_handler(sub, -)
-math_handler(mul, *)
-math_handler(div, /)
-math_handler(mod, %)
+#define math_handler(name, expr)                                              \
+    OPERAND_SIZES(math_handler_sized, name, expr)
 
-bool execute_inc(machine_state* state, instruction* inst)
-{
-    unsigned char* target = resolve_operand(state, inst, 0);
-    uint64_t result = ++*(uint64_t*)target;
-    memcpy(target, &result, inst->size);
+// mov never reads its target
+#define mov_handler_sized(bytes, type, stype, ...)                            \
+    bool execute_mov_b##bytes(machine_state* state, instruction* inst)        \
+    {                                                                         \
+        unsigned char* target = resolve_operand(state, inst, 0);              \
+        uint64_t right = load_b##bytes(resolve_operand(state, inst, 1));      \
+        store_b##bytes(target, writes_register(inst, 0), right);              \
+        return true;                                                          \
+    }
 
-    return true;
-}
+OPERAND_SIZES(mov_handler_sized)
+math_handler(add, left + right)
+math_handler(sub, left - right)
+math_handler(mul, left * right)
+math_handler(div, left / right)
+math_handler(mod, left % right)
 
-bool execute_dec(machine_state* state, instruction* inst)
-{
-    unsigned char* target = resolve_operand(state, inst, 0);
-    uint64_t result = --*(uint64_t*)target;
-    memcpy(target, &result, inst->size);
+#define unary_handler_sized(bytes, type, stype, name, op)                     \
+    bool execute_##name##_b##bytes(machine_state* state, instruction* inst)   \
+    {                                                                         \
+        unsigned char* target = resolve_operand(state, inst, 0);              \
+        store_b##bytes(target, writes_register(inst, 0),                      \
+                       load_b##bytes(target) op 1);                           \
+        return true;                                                          \
+    }
 
-    return true;
-}
+OPERAND_SIZES(unary_handler_sized, inc, +)
+OPERAND_SIZES(unary_handler_sized, dec, -)
 
-bool execute_cmp(machine_state* state, instruction* inst)
-{
-    uint64_t left = *(uint64_t*)resolve_operand(state, inst, 0);
-    uint64_t right = *(uint64_t*)resolve_operand(state, inst, 1);
-    uint64_t result = left - right;
-    memcpy(&state->registers[RFLAG], &result, inst->size);
+// The difference is sign-extended so the conditional jumps compare at the
+// operand's own width
+#define cmp_handler_sized(bytes, type, stype, ...)                            \
+    bool execute_cmp_b##bytes(machine_state* state, instruction* inst)        \
+    {                                                                         \
+        uint64_t left = load_b##bytes(resolve_operand(state, inst, 0));       \
+        uint64_t right = load_b##bytes(resolve_operand(state, inst, 1));      \
+        state->registers[RFLAG] = sign_extend_b##bytes(left - right);         \
+        return true;                                                          \
+    }
 
-    return true;
-}
+OPERAND_SIZES(cmp_handler_sized)
 
 #define conditional_handler(name, cmp)                                        \
     bool execute_##name(machine_state* state, instruction* inst)              \
@@ -210,10 +219,8 @@ conditional_handler(jge, >=)
 
 bool execute_print(machine_state* state, instruction* inst)
 {
-    printf("%s%llu%s\n",
-           print_prefix,
-           *(uint64_t*)resolve_operand(state, inst, 0),
-           print_suffix);
+    output_value(&state->output,
+                 load_sized(resolve_operand(state, inst, 0), inst->size));
 
     return true;
 }
@@ -223,6 +230,357 @@ bool execute_exit(machine_state* state, instruction* inst)
     return false;
 }
 
+// Faults leave rip on the instruction, as in the decoded engines
+static bool fault(machine_state* state, instruction* inst)
+{
+    state->registers[RIP] -= instruction_encoded_len(operands[inst->opcode]);
+    state->status = RUN_FAULT;
+
+    return false;
+}
+
+static uint64_t sign_extend_sized(uint64_t value, unsigned char size)
+{
+    switch (size)
+    {
+        case B1: return sign_extend_b1(value);
+        case B2: return sign_extend_b2(value);
+        case B4: return sign_extend_b4(value);
+        default: return value;
+    }
+}
+
+// Checked so that nothing can wrap: count * size only gets computed once
+// count is known to fit
+static bool block_fits(
+        machine_state* state,
+        uint64_t address,
+        uint64_t count,
+        unsigned char size)
+{
+    return count <= state->memory_size / size &&
+           address <= state->memory_size - count * size;
+}
+
+// Copies the part already filled onto the rest, doubling it each time, so
+// wide fills are a handful of memcpys too
+static void block_fill(
+        unsigned char* p,
+        uint64_t value,
+        uint64_t count,
+        unsigned char size)
+{
+    uint64_t bytes = count * size;
+
+    if (size == B1 || value == 0)
+    {
+        memset(p, (unsigned char)value, bytes);
+        return;
+    }
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    memcpy(p, &value, size);
+
+    for (uint64_t done = size; done < bytes; done *= 2)
+    {
+        memcpy(p + done, p, done < bytes - done ? done : bytes - done);
+    }
+}
+
+// Index of the first element that differs between a and b, or count. memcmp
+// narrows it down to a chunk before it's looked at byte by byte.
+static uint64_t block_mismatch(
+        unsigned char* a,
+        unsigned char* b,
+        uint64_t count,
+        unsigned char size)
+{
+    uint64_t bytes = count * size;
+    uint64_t i = 0;
+
+    if (memcmp(a, b, bytes) == 0)
+    {
+        return count;
+    }
+
+    while (i + BULK_CHUNK <= bytes && memcmp(a + i, b + i, BULK_CHUNK) == 0)
+    {
+        i += BULK_CHUNK;
+    }
+
+    while (a[i] == b[i])
+    {
+        i++;
+    }
+
+    return i / size;
+}
+
+// Index of the first element equal to value, or count
+static uint64_t block_scan(
+        unsigned char* p,
+        uint64_t value,
+        uint64_t count,
+        unsigned char size)
+{
+    if (size == B1)
+    {
+        unsigned char* found = memchr(p, (unsigned char)value, count);
+
+        return found ? (uint64_t)(found - p) : count;
+    }
+
+    uint64_t i = 0;
+
+    while (i < count && load_sized(p + i * size, size) != value)
+    {
+        i++;
+    }
+
+    return i;
+}
+
+bool bulk_memory(
+        machine_state* state,
+        unsigned char opcode,
+        unsigned char size,
+        uint64_t first,
+        uint64_t second)
+{
+    uint64_t* r = state->registers;
+    unsigned char* memory = state->memory;
+    uint64_t count = r[R0];
+
+    if (size != B1 && size != B2 && size != B4)
+    {
+        size = B8;
+    }
+
+    if (!block_fits(state, first, count, size) ||
+        (bulk_blocks(opcode) == 2 && !block_fits(state, second, count, size)))
+    {
+        return false;
+    }
+
+    switch (opcode)
+    {
+        case OP_BCOPY:
+            memmove(memory + first, memory + second, count * size);
+            break;
+
+        case OP_BFILL:
+            block_fill(memory + first, second, count, size);
+            break;
+
+        case OP_BCMP:
+        {
+            uint64_t i = block_mismatch(memory + first, memory + second,
+                                        count, size);
+
+            r[R0] = i;
+            r[RFLAG] = 0;
+
+            // Equal blocks have no element at i; it may be past the end of
+            // guest memory
+            if (i < count)
+            {
+                uint64_t left = load_sized(memory + first + i * size, size);
+                uint64_t right = load_sized(memory + second + i * size, size);
+
+                r[RFLAG] = sign_extend_sized(left - right, size);
+            }
+            break;
+        }
+
+        case OP_BSCAN:
+            r[R0] = block_scan(memory + first, second, count, size);
+            r[RFLAG] = r[R0] == count;
+            break;
+    }
+
+    return true;
+}
+
+static bool block_address(
+        machine_state* state,
+        instruction* inst,
+        int ordinal,
+        uint64_t* out)
+{
+    if (!(inst->operand_types[ordinal] & ADDRESS))
+    {
+        return false;
+    }
+
+    *out = resolve_operand(state, inst, ordinal) - state->memory;
+
+    return true;
+}
+
+// A block operand that isn't an address faults like a block that doesn't
+// fit
+bool execute_bulk(machine_state* state, instruction* inst)
+{
+    uint64_t first = 0;
+    uint64_t second = 0;
+    bool named = block_address(state, inst, 0, &first);
+
+    if (bulk_blocks(inst->opcode) == 2)
+    {
+        named &= block_address(state, inst, 1, &second);
+    }
+    else
+    {
+        second = load_sized(resolve_operand(state, inst, 1), inst->size);
+    }
+
+    if (!named || !bulk_memory(state, inst->opcode, inst->size, first, second))
+    {
+        return fault(state, inst);
+    }
+
+    return true;
+}
+
+// Vector operands are checked against VECTOR_COUNT by the verifier; this
+// keeps unverified ones inside the register file too
+static unsigned char* vector_operand(
+        machine_state* state,
+        instruction* inst,
+        int ordinal)
+{
+    complex_operand* comp = (complex_operand*)&inst->operands[ordinal];
+
+    return state->vectors[comp->base % VECTOR_COUNT];
+}
+
+// Like block operands, the memory side of a vector load or store that isn't
+// an address faults
+bool execute_vload(machine_state* state, instruction* inst)
+{
+    if (!(inst->operand_types[1] & ADDRESS))
+    {
+        return fault(state, inst);
+    }
+
+    memcpy(vector_operand(state, inst, 0), resolve_operand(state, inst, 1),
+           VECTOR_BYTES);
+
+    return true;
+}
+
+bool execute_vstore(machine_state* state, instruction* inst)
+{
+    if (!(inst->operand_types[0] & ADDRESS))
+    {
+        return fault(state, inst);
+    }
+
+    memcpy(resolve_operand(state, inst, 0), vector_operand(state, inst, 1),
+           VECTOR_BYTES);
+
+    return true;
+}
+
+bool execute_vsplat(machine_state* state, instruction* inst)
+{
+    simd_splat(inst->size, vector_operand(state, inst, 0),
+               load_sized(resolve_operand(state, inst, 1), inst->size));
+
+    return true;
+}
+
+bool execute_lanes(machine_state* state, instruction* inst)
+{
+    simd_lanes(inst->opcode, inst->size, vector_operand(state, inst, 0),
+               vector_operand(state, inst, 1));
+
+    return true;
+}
+
+bool execute_vsum(machine_state* state, instruction* inst)
+{
+    store_sized(resolve_operand(state, inst, 0), writes_register(inst, 0),
+                simd_sum(inst->size, vector_operand(state, inst, 1)),
+                inst->size);
+
+    return true;
+}
+
+// Doubles live in the general registers and memory as their IEEE bits
+static inline double as_double(uint64_t bits)
+{
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static inline uint64_t double_bits(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+#define float_handler(name, expr)                                             \
+    bool execute_##name(machine_state* state, instruction* inst)              \
+    {                                                                         \
+        unsigned char* target = resolve_operand(state, inst, 0);              \
+        double left = as_double(load_b8(target));                             \
+        double right = as_double(load_b8(resolve_operand(state, inst, 1)));   \
+        store_b8(target, writes_register(inst, 0), double_bits(expr));        \
+        return true;                                                          \
+    }
+
+float_handler(fadd, left + right)
+float_handler(fsub, left - right)
+float_handler(fmul, left * right)
+float_handler(fdiv, left / right)
+
+// Unordered (a NaN on either side) compares as greater, so only jne, jg and
+// jge are taken
+bool execute_fcmp(machine_state* state, instruction* inst)
+{
+    double left = as_double(load_b8(resolve_operand(state, inst, 0)));
+    double right = as_double(load_b8(resolve_operand(state, inst, 1)));
+
+    state->registers[RFLAG] = left < right ? -1 : left == right ? 0 : 1;
+
+    return true;
+}
+
+bool execute_itof(machine_state* state, instruction* inst)
+{
+    int64_t value = load_b8(resolve_operand(state, inst, 1));
+
+    store_b8(resolve_operand(state, inst, 0), writes_register(inst, 0),
+             double_bits((double)value));
+
+    return true;
+}
+
+// Truncates toward zero. NaNs and anything out of range become INT64_MIN,
+// as x86's cvttsd2si makes them.
+bool execute_ftoi(machine_state* state, instruction* inst)
+{
+    double value = as_double(load_b8(resolve_operand(state, inst, 1)));
+    int64_t result = INT64_MIN;
+
+    if (value >= -9223372036854775808.0 && value < 9223372036854775808.0)
+    {
+        result = value;
+    }
+
+    store_b8(resolve_operand(state, inst, 0), writes_register(inst, 0),
+             result);
+
+    return true;
+}
+
 int read_next_instruction(machine_state* state, instruction** inst)
 {
     *inst = (instruction*)(state->memory + state->registers[RIP]);
@@ -230,50 +588,486 @@ int read_next_instruction(machine_state* state, instruction** inst)
     return operands[(*inst)->opcode] * sizeof(uint64_t) + 8;
 }
 
-void emulator_init()
-{
-    opcode_handlers[OP_JMP]   = execute_jmp;
-    opcode_handlers[OP_PUSH]  = execute_push;
-    opcode_handlers[OP_POP]   = execute_pop;
-    opcode_handlers[OP_MOV]   = execute_mov;
-    opcode_handlers[OP_CALL]  = execute_call;
-    opcode_handlers[OP_RET]   = execute_ret;
-    opcode_handlers[OP_ADD]   = execute_add;
-    opcode_handlers[OP_SUB]   = execute_sub;
-    opcode_handlers[OP_MUL]   = execute_mul;
-    opcode_handlers[OP_DIV]   = execute_div;
-    opcode_handlers[OP_MOD]   = execute_mod;
-    opcode_handlers[OP_INC]   = execute_inc;
-    opcode_handlers[OP_DEC]   = execute_dec;
-    opcode_handlers[OP_CMP]   = execute_cmp;
-    opcode_handlers[OP_JE]    = execute_je;
-    opcode_handlers[OP_JNE]   = execute_jne;
-    opcode_handlers[OP_JG]    = execute_jg;
-    opcode_handlers[OP_JGE]   = execute_jge;
-    opcode_handlers[OP_JL]    = execute_jl;
-    opcode_handlers[OP_JLE]   = execute_jle;
-    opcode_handlers[OP_PRINT] = execute_print;
-    opcode_handlers[OP_EXIT]  = execute_exit;
-}
+#define HANDLER(name) { [0 ... B8] = execute_##name }
+
+// Sizes outside enum sizes behave like B8
+#define SIZED_HANDLER(name)                                                   \
+    {                                                                         \
+        [0 ... B8] = execute_##name##_b8,                                     \
+        [B1] = execute_##name##_b1,                                           \
+        [B2] = execute_##name##_b2,                                           \
+        [B4] = execute_##name##_b4                                            \
+    }
+
+// Indexed by opcode and operand size
+static bool (* const opcode_handlers[OPCODE_COUNT][B8 + 1])(
+        machine_state* state,
+        instruction* inst) = {
+    [OP_JMP]    = HANDLER(jmp),
+    [OP_PUSH]   = HANDLER(push),
+    [OP_POP]    = HANDLER(pop),
+    [OP_MOV]    = SIZED_HANDLER(mov),
+    [OP_CALL]   = HANDLER(call),
+    [OP_RET]    = HANDLER(ret),
+    [OP_ADD]    = SIZED_HANDLER(add),
+    [OP_SUB]    = SIZED_HANDLER(sub),
+    [OP_MUL]    = SIZED_HANDLER(mul),
+    [OP_DIV]    = SIZED_HANDLER(div),
+    [OP_MOD]    = SIZED_HANDLER(mod),
+    [OP_INC]    = SIZED_HANDLER(inc),
+    [OP_DEC]    = SIZED_HANDLER(dec),
+    [OP_CMP]    = SIZED_HANDLER(cmp),
+    [OP_JE]     = HANDLER(je),
+    [OP_JNE]    = HANDLER(jne),
+    [OP_JG]     = HANDLER(jg),
+    [OP_JGE]    = HANDLER(jge),
+    [OP_JL]     = HANDLER(jl),
+    [OP_JLE]    = HANDLER(jle),
+    [OP_PRINT]  = HANDLER(print),
+    [OP_EXIT]   = HANDLER(exit),
+    [OP_BCOPY]  = HANDLER(bulk),
+    [OP_BFILL]  = HANDLER(bulk),
+    [OP_BCMP]   = HANDLER(bulk),
+    [OP_BSCAN]  = HANDLER(bulk),
+    [OP_VLOAD]  = HANDLER(vload),
+    [OP_VSTORE] = HANDLER(vstore),
+    [OP_VSPLAT] = HANDLER(vsplat),
+    [OP_VADD]   = HANDLER(lanes),
+    [OP_VSUB]   = HANDLER(lanes),
+    [OP_VMUL]   = HANDLER(lanes),
+    [OP_VMIN]   = HANDLER(lanes),
+    [OP_VMAX]   = HANDLER(lanes),
+    [OP_VSUM]   = HANDLER(vsum),
+    [OP_FADD]   = HANDLER(fadd),
+    [OP_FSUB]   = HANDLER(fsub),
+    [OP_FMUL]   = HANDLER(fmul),
+    [OP_FDIV]   = HANDLER(fdiv),
+    [OP_FCMP]   = HANDLER(fcmp),
+    [OP_ITOF]   = HANDLER(itof),
+    [OP_FTOI]   = HANDLER(ftoi)
+};
+
+#undef HANDLER
+#undef SIZED_HANDLER
 
 bool execute_instruction(machine_state* state, instruction* inst)
 {
-    return opcode_handlers[inst->opcode](state, inst);
+    return opcode_handlers[inst->opcode][inst->size](state, inst);
 }
 
 bool execute(machine_state* state)
 {
     instruction* inst;
     state->registers[RIP] += read_next_instruction(state, &inst);
+    state->retired++;
     return execute_instruction(state, inst);
 }
 
-void load_binary(const char* fn, machine_state* state)
+static int memory_flags(enum huge_pages huge_pages)
+{
+    // Without a reservation hugetlb faults turn into SIGBUS, so let mmap fail
+    // up front instead
+    if (huge_pages == HUGE_PAGES_HUGETLB)
+    {
+        return MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+    }
+
+    return MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+}
+
+static bool memory_map(machine_state* state, int flags)
+{
+    unsigned char* memory = mmap(state->memory, state->memory_mapped,
+                                 PROT_READ | PROT_WRITE,
+                                 memory_flags(state->huge_pages) | flags,
+                                 -1, 0);
+
+    if (memory == MAP_FAILED)
+    {
+        return false;
+    }
+
+    if (state->huge_pages == HUGE_PAGES_ADVISE)
+    {
+        madvise(memory, state->memory_mapped, MADV_HUGEPAGE);
+    }
+
+    state->memory = memory;
+
+    return true;
+}
+
+void memory_map_error(machine_state* state, char* error)
+{
+    if (state->huge_pages == HUGE_PAGES_HUGETLB)
+    {
+        snprintf(error, IMAGE_ERROR_LEN, "Unable to map %llu bytes of huge "
+                 "pages. Are enough reserved in vm.nr_hugepages?",
+                 state->memory_mapped);
+    }
+    else
+    {
+        snprintf(error, IMAGE_ERROR_LEN,
+                 "Unable to map %llu bytes of guest memory.",
+                 state->memory_mapped);
+    }
+}
+
+static void memory_map_failed(machine_state* state)
+{
+    char error[IMAGE_ERROR_LEN];
+
+    memory_map_error(state, error);
+    printf("%s\n", error);
+
+    exit(18);
+}
+
+// Guest memory is an anonymous mapping, so pages the guest never touches are
+// never faulted in
+bool memory_try_init(machine_state* state, memory_config* config)
+{
+    uint64_t size = config->size;
+    uint64_t mapped = size;
+
+    if (config->huge_pages != HUGE_PAGES_OFF)
+    {
+        mapped = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    }
+
+    // A fresh machine: nothing decoded or compiled yet
+    state->program = NULL;
+    state->jit = NULL;
+
+    state->memory = NULL;
+    state->memory_size = size;
+    state->memory_mapped = mapped;
+    state->huge_pages = config->huge_pages;
+    state->safe = config->safe;
+    state->file_ranges = NULL;
+    state->file_range_count = 0;
+
+    return memory_map(state, 0);
+}
+
+void memory_init(machine_state* state, memory_config* config)
+{
+    if (!memory_try_init(state, config))
+    {
+        memory_map_failed(state);
+    }
+}
+
+// Maps fresh zero pages over the whole of guest memory, dropping a mapped
+// image and everything the last run touched in one go. A failed MAP_FIXED
+// may already have unmapped the old pages, so on failure the range is let go
+// and memory is left NULL; the next reset maps it afresh anywhere.
+bool memory_reset(machine_state* state)
+{
+    free(state->file_ranges);
+    state->file_ranges = NULL;
+    state->file_range_count = 0;
+
+    if (memory_map(state, state->memory ? MAP_FIXED : 0))
+    {
+        return true;
+    }
+
+    if (state->memory)
+    {
+        munmap(state->memory, state->memory_mapped);
+        state->memory = NULL;
+    }
+
+    return false;
+}
+
+void memory_free(machine_state* state)
+{
+    free(state->file_ranges);
+    state->file_ranges = NULL;
+    state->file_range_count = 0;
+
+    if (state->memory)
+    {
+        munmap(state->memory, state->memory_mapped);
+    }
+
+    state->memory = NULL;
+}
+
+void memory_add_file_range(machine_state* state, uint64_t start, uint64_t len)
+{
+    int count = state->file_range_count;
+
+    // Doubles whenever the count reaches a power of two
+    if ((count & (count - 1)) == 0)
+    {
+        int allocated = count ? count * 2 : 1;
+
+        state->file_ranges = realloc(state->file_ranges,
+                                     sizeof(memory_range) * allocated);
+    }
+
+    state->file_ranges[count].start = start;
+    state->file_ranges[count].len = len;
+    state->file_range_count++;
+}
+
+uint64_t memory_resident(machine_state* state)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint64_t pages = (state->memory_mapped + page_size - 1) / page_size;
+    unsigned char* present = malloc(pages);
+    uint64_t resident = 0;
+
+    if (mincore(state->memory, state->memory_mapped, present) == 0)
+    {
+        for (uint64_t i = 0; i < pages; i++)
+        {
+            resident += present[i] & 1;
+        }
+    }
+
+    free(present);
+
+    return resident * page_size;
+}
+
+void memory_report(machine_state* state, FILE* out)
+{
+    fprintf(out, "memory: %llu KiB resident of %llu KiB reserved\n",
+            memory_resident(state) / 1024,
+            state->memory_mapped / 1024);
+}
+
+bool huge_pages_from_string(const char* name, enum huge_pages* out)
+{
+    if      (!strcmp(name, "off"))     { *out = HUGE_PAGES_OFF;     }
+    else if (!strcmp(name, "advise"))  { *out = HUGE_PAGES_ADVISE;  }
+    else if (!strcmp(name, "hugetlb")) { *out = HUGE_PAGES_HUGETLB; }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+// Regular files are mapped copy-on-write over the start of guest memory, so
+// processes running the same image share its pages and nothing is copied.
+// hugetlb memory can't have a file mapped into the middle of it, so it gets
+// the read path like pipes do.
+static bool map_image(machine_state* state, int fd, struct stat* file_stat)
+{
+    if (!S_ISREG(file_stat->st_mode) || file_stat->st_size == 0 ||
+        state->huge_pages == HUGE_PAGES_HUGETLB)
+    {
+        return false;
+    }
+
+    if (mmap(state->memory, file_stat->st_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        return false;
+    }
+
+    memory_add_file_range(state, 0, file_stat->st_size);
+
+    return true;
+}
+
+static int read_image(
+        machine_state* state,
+        int fd,
+        uint64_t* out_total,
+        char* error)
+{
+    uint64_t total = 0;
+
+    while (total < state->memory_size)
+    {
+        ssize_t got = read(fd, state->memory + total,
+                           state->memory_size - total);
+
+        if (got < 0)
+        {
+            snprintf(error, IMAGE_ERROR_LEN, "Failed to read image.");
+            return 20;
+        }
+
+        if (got == 0)
+        {
+            *out_total = total;
+            return 0;
+        }
+
+        total += got;
+    }
+
+    // Full up: anything more means the image is too big
+    char extra;
+
+    if (read(fd, &extra, 1) > 0)
+    {
+        snprintf(error, IMAGE_ERROR_LEN,
+                 "Image does not fit in %llu bytes of guest memory.",
+                 state->memory_size);
+        return 19;
+    }
+
+    *out_total = total;
+    return 0;
+}
+
+static int validate_image(
+        machine_state* state,
+        uint64_t bytes_count,
+        char* error)
 {
-    state->memory = malloc(sizeof(unsigned char) * MEMORY_SIZE);
+    if (bytes_count < IMG_HDR_LEN)
+    {
+        snprintf(error, IMAGE_ERROR_LEN,
+                 "Image is too short to hold a header.");
+        return 21;
+    }
+
+    uint64_t code_bytes = *(uint64_t*)(state->memory + IMG_HDR_CODE_BYTES);
+    uint64_t entry_point = *(uint64_t*)(state->memory + IMG_HDR_ENTRY_POINT);
+
+    if (code_bytes > bytes_count - IMG_HDR_LEN || code_bytes % 8 != 0)
+    {
+        snprintf(error, IMAGE_ERROR_LEN,
+                 "Image header claims %llu bytes of code but the image has "
+                 "%llu.", code_bytes, bytes_count - IMG_HDR_LEN);
+        return 22;
+    }
 
-    int bytes_count;
-    read_file(fn, state->memory, &bytes_count);
+    if (entry_point % 8 != 0 || entry_point >= code_bytes)
+    {
+        snprintf(error, IMAGE_ERROR_LEN,
+                 "Image entry point %llu is outside its code.", entry_point);
+        return 23;
+    }
+
+    return 0;
+}
+
+static int open_image(
+        const char* fn,
+        machine_state* state,
+        uint64_t* out_bytes_count,
+        char* error)
+{
+    int fd = strcmp(fn, "-") ? open(fn, O_RDONLY) : STDIN_FILENO;
+    struct stat file_stat;
+
+    if (fd < 0 || fstat(fd, &file_stat) < 0)
+    {
+        snprintf(error, IMAGE_ERROR_LEN, "Failed to open file.");
+        return 20;
+    }
+
+    int result = 0;
+
+    if (S_ISREG(file_stat.st_mode) && file_stat.st_size > state->memory_size)
+    {
+        snprintf(error, IMAGE_ERROR_LEN,
+                 "Image does not fit in %llu bytes of guest memory.",
+                 state->memory_size);
+        result = 19;
+    }
+    else if (map_image(state, fd, &file_stat))
+    {
+        *out_bytes_count = file_stat.st_size;
+    }
+    else
+    {
+        result = read_image(state, fd, out_bytes_count, error);
+    }
+
+    if (fd != STDIN_FILENO)
+    {
+        close(fd);
+    }
+
+    return result;
+}
+
+// v2 images are unpacked over themselves, from a copy of the packed bytes
+static int unpack_image(
+        machine_state* state,
+        uint64_t* bytes_count,
+        char* error)
+{
+    if (!image_is_v2(state->memory, *bytes_count))
+    {
+        return 0;
+    }
+
+    unsigned char* packed = malloc(*bytes_count);
+    memcpy(packed, state->memory, *bytes_count);
+
+    uint64_t unpacked_count;
+    bool unpacked = image_unpack(packed, *bytes_count, state->memory,
+                                 state->memory_size, &unpacked_count);
+
+    free(packed);
+
+    if (!unpacked && unpacked_count)
+    {
+        snprintf(error, IMAGE_ERROR_LEN,
+                 "Image does not fit in %llu bytes of guest memory.",
+                 state->memory_size);
+        return 19;
+    }
+
+    if (!unpacked)
+    {
+        snprintf(error, IMAGE_ERROR_LEN, "Image is not a valid v2 image.");
+        return 32;
+    }
+
+    // Programs expect the memory after the image to start out zeroed
+    if (unpacked_count < *bytes_count)
+    {
+        memset(state->memory + unpacked_count, 0,
+               *bytes_count - unpacked_count);
+    }
+
+    *bytes_count = unpacked_count;
+
+    return 0;
+}
+
+// Checks an image that's already in guest memory and readies the registers
+// to run it
+static int start_image(
+        machine_state* state,
+        uint64_t bytes_count,
+        char* error)
+{
+    int result = unpack_image(state, &bytes_count, error);
+
+    if (result != 0)
+    {
+        return result;
+    }
+
+    result = validate_image(state, bytes_count, error);
+
+    if (result == 0 && state->safe)
+    {
+        result = verify_image(state, error);
+    }
+
+    if (result != 0)
+    {
+        return result;
+    }
+
+    state->program = NULL;
+    state->retired = 0;
 
     // Clear registers
     for (int i = 0; i < REGISTER_COUNT; i++)
@@ -281,11 +1075,72 @@ void load_binary(const char* fn, machine_state* state)
         state->registers[i] = 0;
     }
 
+    memset(state->vectors, 0, sizeof(state->vectors));
+
     // Align rmem on 8-byte boundary after image
     state->registers[RMEM] = bytes_count + 8 - bytes_count % 8;
 
     state->registers[RIP] =
         IMG_HDR_LEN + *(uint64_t *)(state->memory + IMG_HDR_ENTRY_POINT);
 
-    state->registers[RSP] = MEMORY_SIZE;
+    state->registers[RSP] = state->memory_size;
+
+    return 0;
+}
+
+// fn may be "-" to read the image from stdin
+int load_image(const char* fn, machine_state* state, char* error)
+{
+    uint64_t bytes_count;
+    int result = open_image(fn, state, &bytes_count, error);
+
+    if (result != 0)
+    {
+        return result;
+    }
+
+    return start_image(state, bytes_count, error);
+}
+
+int load_image_bytes(
+        const unsigned char* bytes,
+        uint64_t bytes_count,
+        machine_state* state,
+        char* error)
+{
+    if (bytes_count > state->memory_size)
+    {
+        snprintf(error, IMAGE_ERROR_LEN,
+                 "Image does not fit in %llu bytes of guest memory.",
+                 state->memory_size);
+        return 19;
+    }
+
+    memcpy(state->memory, bytes, bytes_count);
+
+    return start_image(state, bytes_count, error);
+}
+
+void load_binary(const char* fn, machine_state* state, memory_config* memory)
+{
+    memory_config defaults = { MEMORY_SIZE, HUGE_PAGES_OFF, false };
+
+    if (!memory)
+    {
+        memory = &defaults;
+    }
+
+    memory_init(state, memory);
+
+    output_init(&state->output, STDOUT_FILENO, OUTPUT_TEXT,
+                isatty(STDOUT_FILENO) ? FLUSH_LINE : FLUSH_SIZE);
+
+    char error[IMAGE_ERROR_LEN];
+    int result = load_image(fn, state, error);
+
+    if (result != 0)
+    {
+        printf("%s\n", error);
+        exit(result);
+    }
 }
@@ -1,21 +1,193 @@
+#ifndef _EMULATOR_H
+#define _EMULATOR_H
+
+#include <stdio.h>
+#include <string.h>
+
 #include "shared.h"
+#include "output.h"
+
+#define MEMORY_SIZE (32 * 1024 * 1024)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define IMAGE_ERROR_LEN 128
+
+// Bytes bcmp hands to memcmp at a time while it looks for a difference
+#define BULK_CHUNK 256
 
-#define MEMORY_SIZE 32 * 1024 * 1024
+enum huge_pages
+{
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_ADVISE,
+    HUGE_PAGES_HUGETLB
+};
+
+typedef struct
+{
+    uint64_t size;
+    enum huge_pages huge_pages;
+    // Verify images as they load and check the memory accesses the verifier
+    // couldn't prove safe, for running untrusted programs
+    bool safe;
+} memory_config;
+
+// A stretch of guest memory
+typedef struct
+{
+    uint64_t start;
+    uint64_t len;
+} memory_range;
+
+// Why a run stopped
+enum run_status
+{
+    RUN_EXITED,
+    RUN_BUDGET,
+    RUN_FAULT
+};
 
 typedef struct
 {
     uint64_t registers[REGISTER_COUNT];
+    unsigned char vectors[VECTOR_COUNT][VECTOR_BYTES];
     unsigned char* memory;
+    uint64_t memory_size;
+    uint64_t memory_mapped;
+    enum huge_pages huge_pages;
+    bool safe;
+    // Ranges mapped from an image or snapshot file, whose pages hold data
+    // even when they aren't resident
+    memory_range* file_ranges;
+    int file_range_count;
+    uint64_t retired;
+    // Taken branches stop the run once retired reaches this
+    uint64_t retired_limit;
+    enum run_status status;
+    output_sink output;
+    struct decoded_program* program;
+    struct jit_context* jit;
 } machine_state;
 
-extern char* print_prefix;
-extern char* print_suffix;
+// Operand sizes with their unsigned and signed C types, for generating
+// size-specialised handlers. Extra arguments are passed through to X.
+#define NARROW_SIZES(X, ...)                                                  \
+    X(1, uint8_t,  int8_t,  __VA_ARGS__)                                      \
+    X(2, uint16_t, int16_t, __VA_ARGS__)                                      \
+    X(4, uint32_t, int32_t, __VA_ARGS__)
 
-int read_next_instruction(machine_state* state, instruction** inst);
+#define OPERAND_SIZES(X, ...)                                                 \
+    NARROW_SIZES(X, __VA_ARGS__)                                              \
+    X(8, uint64_t, int64_t, __VA_ARGS__)
+
+// Loads zero-extend to 64 bits. Stores into a register clear the bytes above
+// the operand size; stores into memory only touch the operand's own bytes.
+#define SIZED_ACCESS(bytes, type, stype, ...)                                 \
+    static inline uint64_t load_b##bytes(unsigned char* p)                    \
+    {                                                                         \
+        type v;                                                               \
+        memcpy(&v, p, sizeof(v));                                             \
+        return v;                                                             \
+    }                                                                         \
+    static inline void store_b##bytes(                                        \
+            unsigned char* p,                                                 \
+            bool to_register,                                                 \
+            uint64_t value)                                                   \
+    {                                                                         \
+        if (to_register)                                                      \
+        {                                                                     \
+            *(uint64_t*)p = (type)value;                                      \
+        }                                                                     \
+        else                                                                  \
+        {                                                                     \
+            type v = value;                                                   \
+            memcpy(p, &v, sizeof(v));                                         \
+        }                                                                     \
+    }                                                                         \
+    static inline uint64_t sign_extend_b##bytes(uint64_t value)               \
+    {                                                                         \
+        return (int64_t)(stype)value;                                         \
+    }
 
-void emulator_init();
+OPERAND_SIZES(SIZED_ACCESS)
+
+static inline uint64_t load_sized(unsigned char* p, unsigned char size)
+{
+    switch (size)
+    {
+        case B1: return load_b1(p);
+        case B2: return load_b2(p);
+        case B4: return load_b4(p);
+        default: return load_b8(p);
+    }
+}
+
+static inline void store_sized(
+        unsigned char* p,
+        bool to_register,
+        uint64_t value,
+        unsigned char size)
+{
+    switch (size)
+    {
+        case B1: store_b1(p, to_register, value); break;
+        case B2: store_b2(p, to_register, value); break;
+        case B4: store_b4(p, to_register, value); break;
+        default: store_b8(p, to_register, value); break;
+    }
+}
+
+unsigned char* resolve_operand(
+        machine_state* state,
+        instruction* inst,
+        int ordinal);
+
+bool writes_register(instruction* inst, int ordinal);
+
+int read_next_instruction(machine_state* state, instruction** inst);
 
 bool execute(machine_state* state);
 bool execute_instruction(machine_state* state, instruction* inst);
 
-void load_binary(const char* fn, machine_state* state);
+// The bulk memory instructions, on blocks of r0 elements of size bytes.
+// first is the address of the first block; second is the address of the
+// second block for bcopy and bcmp, and the element value for bfill and
+// bscan. Returns false, having changed nothing, if a block doesn't fit in
+// guest memory.
+bool bulk_memory(
+        machine_state* state,
+        unsigned char opcode,
+        unsigned char size,
+        uint64_t first,
+        uint64_t second);
+
+// memory_init exits if guest memory can't be mapped; memory_try_init
+// returns false instead. After a failed memory_reset, memory is NULL until a
+// later reset succeeds. memory_map_error describes the failure in error
+// (IMAGE_ERROR_LEN bytes).
+void memory_init(machine_state* state, memory_config* config);
+bool memory_try_init(machine_state* state, memory_config* config);
+bool memory_reset(machine_state* state);
+void memory_map_error(machine_state* state, char* error);
+void memory_add_file_range(machine_state* state, uint64_t start, uint64_t len);
+void memory_free(machine_state* state);
+uint64_t memory_resident(machine_state* state);
+void memory_report(machine_state* state, FILE* out);
+
+bool huge_pages_from_string(const char* name, enum huge_pages* out);
+
+// Loads an image into memory that's already set up and readies the registers
+// for a run. Returns 0, or the exit code bemu uses for the failure with a
+// message in error (IMAGE_ERROR_LEN bytes).
+int load_image(const char* fn, machine_state* state, char* error);
+
+// Same, copying the image from a buffer
+int load_image_bytes(
+        const unsigned char* bytes,
+        uint64_t bytes_count,
+        machine_state* state,
+        char* error);
+
+// Sets up memory and stdout output and loads the image, exiting on failure.
+// A NULL config gets MEMORY_SIZE bytes of normal pages.
+void load_binary(const char* fn, machine_state* state, memory_config* memory);
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "keywords.h"
+
+// Writes the perfect hash tables for the word lists in keywords.h to stdout
+
+typedef struct
+{
+    const char* name;
+    const char* value_name;
+} entry;
+
+#define X(name, value) { #name, #value },
+static const entry mnemonics[] = { MNEMONICS(X) };
+static const entry registers[] = { REGISTER_NAMES(X) };
+static const entry vectors[] = { VECTOR_NAMES(X) };
+static const entry sizes[] = { SIZE_NAMES(X) };
+#undef X
+
+static void generate(
+        const char* prefix,
+        const char* table,
+        const entry* entries,
+        int count)
+{
+    int size = 1;
+
+    while (size < count * 2)
+    {
+        size *= 2;
+    }
+
+    int* slots = malloc(sizeof(int) * size);
+
+    for (uint32_t seed = 0; ; seed++)
+    {
+        memset(slots, -1, sizeof(int) * size);
+
+        int i;
+
+        for (i = 0; i < count; i++)
+        {
+            const char* name = entries[i].name;
+            uint32_t slot = keyword_hash((const unsigned char*)name,
+                                         strlen(name), seed) & (size - 1);
+
+            if (slots[slot] >= 0)
+            {
+                break;
+            }
+
+            slots[slot] = i;
+        }
+
+        if (i == count)
+        {
+            printf("#define %s_SEED %uu\n", prefix, seed);
+            printf("#define %s_MASK %d\n\n", prefix, size - 1);
+            break;
+        }
+    }
+
+    printf("static const keyword %s[%d] = {\n", table, size);
+
+    for (int slot = 0; slot < size; slot++)
+    {
+        if (slots[slot] >= 0)
+        {
+            const entry* e = &entries[slots[slot]];
+
+            printf("    [%d] = { \"%s\", %d, %s },\n", slot, e->name,
+                   (int)strlen(e->name), e->value_name);
+        }
+    }
+
+    printf("};\n\n");
+
+    free(slots);
+}
+
+int main()
+{
+    printf("// Generated by gen_keywords from keywords.h. Don't edit.\n\n");
+
+    generate("MNEMONIC", "mnemonic_table", mnemonics,
+             sizeof(mnemonics) / sizeof(mnemonics[0]));
+    generate("REGISTER", "register_table", registers,
+             sizeof(registers) / sizeof(registers[0]));
+    generate("VECTOR", "vector_table", vectors,
+             sizeof(vectors) / sizeof(vectors[0]));
+    generate("SIZE", "size_table", sizes, sizeof(sizes) / sizeof(sizes[0]));
+
+    return 0;
+}
@@ -0,0 +1,451 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+static const int immediate_widths[] = { 1, 2, 4, 8 };
+static const int offset_widths[] = { 0, 1, 2, 4 };
+
+static int size_code(unsigned char size)
+{
+    switch (size)
+    {
+        case B1: return 0;
+        case B2: return 1;
+        case B4: return 2;
+        case B8: return 3;
+        default: return -1;
+    }
+}
+
+static const unsigned char sizes[] = { B1, B2, B4, B8 };
+
+// Little-endian, so the low bytes of value are the ones that go out
+static void store(unsigned char* out, int64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        out[i] = value >> (i * 8);
+    }
+}
+
+static int64_t load_signed(const unsigned char* in, int bytes)
+{
+    uint64_t value = 0;
+
+    for (int i = 0; i < bytes; i++)
+    {
+        value |= (uint64_t)in[i] << (i * 8);
+    }
+
+    int shift = 64 - bytes * 8;
+
+    return shift == 64 ? 0 : (int64_t)(value << shift) >> shift;
+}
+
+// Index of the narrowest of widths[first..3] that holds value sign-extended
+static int width_index(int64_t value, const int* widths, int first)
+{
+    for (int i = first; i < 3; i++)
+    {
+        int bits = widths[i] * 8;
+
+        if (value >= -((int64_t)1 << (bits - 1)) &&
+            value < ((int64_t)1 << (bits - 1)))
+        {
+            return i;
+        }
+    }
+
+    return 3;
+}
+
+static int pack_operand(instruction* inst, int ordinal, unsigned char* out)
+{
+    unsigned char type = inst->operand_types[ordinal];
+    unsigned char address = type & ADDRESS ? 4 : 0;
+    complex_operand* comp = (complex_operand*)&inst->operands[ordinal];
+
+    if (type & IMMEDIATE)
+    {
+        int64_t value = inst->operands[ordinal];
+        int width = width_index(value, immediate_widths, 0);
+
+        out[0] = V2_IMMEDIATE | address | width << 3;
+        store(out + 1, value, immediate_widths[width]);
+
+        return 1 + immediate_widths[width];
+    }
+
+    if ((type & REGISTER) && !(type & COMPLEX) && comp->base < 16)
+    {
+        out[0] = V2_REGISTER | address | comp->base << 4;
+
+        return 1;
+    }
+
+    if ((type & REGISTER) && comp->base < 16 && comp->register2 < 16)
+    {
+        int width = comp->offset ?
+            width_index(comp->offset, offset_widths, 1) : 0;
+
+        unsigned char* p = out;
+
+        *(p++) = V2_COMPLEX | address | comp->base << 4;
+        *(p++) = comp->register2 | (comp->register2_sign != 0) << 4 |
+                 (comp->multiplier != 1) << 5 | width << 6;
+
+        if (comp->multiplier != 1)
+        {
+            *(p++) = comp->multiplier;
+        }
+
+        store(p, comp->offset, offset_widths[width]);
+        p += offset_widths[width];
+
+        return p - out;
+    }
+
+    out[0] = V2_RAW | address;
+    out[1] = type;
+    memcpy(out + 2, &inst->operands[ordinal], 8);
+
+    return 10;
+}
+
+// The first byte's opcode field, followed by the escaped opcode if it
+// doesn't fit there
+static int pack_opcode(
+        unsigned char opcode,
+        unsigned char flags,
+        unsigned char* out)
+{
+    if (opcode < IMG_V2_EXTENDED)
+    {
+        out[0] = opcode | flags;
+
+        return 1;
+    }
+
+    out[0] = IMG_V2_EXTENDED | flags;
+    out[1] = opcode;
+
+    return 2;
+}
+
+// Anything the dense form can't reproduce byte for byte goes out raw
+static int pack_instruction(instruction* inst, int len, unsigned char* out)
+{
+    int size = size_code(inst->size);
+
+    if (size >= 0)
+    {
+        unsigned char* p = out;
+        p += pack_opcode(inst->opcode, size << 6, p);
+
+        for (int i = 0; i < operands[inst->opcode]; i++)
+        {
+            p += pack_operand(inst, i, p);
+        }
+
+        instruction check;
+
+        if (image_unpack_instruction(out, p - out, &check) == p - out &&
+            !memcmp(&check, inst, len))
+        {
+            return p - out;
+        }
+    }
+
+    int head = pack_opcode(inst->opcode, IMG_V2_RAW, out);
+    memcpy(out + head, inst, len);
+
+    return head + len;
+}
+
+bool image_is_v2(const unsigned char* bytes, uint64_t count)
+{
+    return count >= IMG_V2_HDR_LEN &&
+           *(uint32_t*)(bytes + IMG_V2_HDR_MAGIC) == IMG_V2_MAGIC &&
+           *(uint32_t*)(bytes + IMG_V2_HDR_VERSION) == IMG_V2_VERSION;
+}
+
+// Instructions are at least 8 bytes in v1 and at most one more in v2, bar
+// escaped opcodes, which only come with 24-byte instructions and take at most
+// two more
+uint64_t image_packed_max(uint64_t count)
+{
+    return IMG_V2_HDR_LEN + count + count / 8;
+}
+
+uint64_t image_pack(
+        const unsigned char* image,
+        uint64_t count,
+        unsigned char* out)
+{
+    if (count < IMG_HDR_LEN)
+    {
+        return 0;
+    }
+
+    uint64_t code_bytes = *(uint64_t*)(image + IMG_HDR_CODE_BYTES);
+
+    if (code_bytes > count - IMG_HDR_LEN)
+    {
+        return 0;
+    }
+
+    uint64_t offset = IMG_HDR_LEN;
+    uint64_t code_end = IMG_HDR_LEN + code_bytes;
+    unsigned char* p = out + IMG_V2_HDR_LEN;
+
+    while (offset < code_end)
+    {
+        unsigned char opcode = image[offset];
+
+        if (opcode >= OPCODE_COUNT)
+        {
+            return 0;
+        }
+
+        int len = instruction_encoded_len(operands[opcode]);
+
+        if (offset + len > code_end)
+        {
+            return 0;
+        }
+
+        instruction inst;
+        memset(&inst, 0, sizeof(instruction));
+        memcpy(&inst, image + offset, len);
+
+        p += pack_instruction(&inst, len, p);
+        offset += len;
+    }
+
+    *(uint32_t*)(out + IMG_V2_HDR_MAGIC) = IMG_V2_MAGIC;
+    *(uint32_t*)(out + IMG_V2_HDR_VERSION) = IMG_V2_VERSION;
+    *(uint64_t*)(out + IMG_V2_HDR_CODE_BYTES) = code_bytes;
+    *(uint64_t*)(out + IMG_V2_HDR_ENTRY_POINT) =
+        *(uint64_t*)(image + IMG_HDR_ENTRY_POINT);
+    *(uint64_t*)(out + IMG_V2_HDR_PACKED_BYTES) =
+        p - (out + IMG_V2_HDR_LEN);
+
+    // Whatever follows the code is kept as it is
+    memcpy(p, image + code_end, count - code_end);
+    p += count - code_end;
+
+    return p - out;
+}
+
+int image_unpack_instruction(
+        const unsigned char* in,
+        uint64_t count,
+        instruction* out)
+{
+    if (count < 1)
+    {
+        return 0;
+    }
+
+    unsigned char opcode = in[0] & IMG_V2_EXTENDED;
+    int head = 1;
+
+    if (opcode == IMG_V2_EXTENDED)
+    {
+        if (count < 2 || in[1] < IMG_V2_EXTENDED)
+        {
+            return 0;
+        }
+
+        opcode = in[head++];
+    }
+
+    if (opcode >= OPCODE_COUNT)
+    {
+        return 0;
+    }
+
+    int len = instruction_encoded_len(operands[opcode]);
+
+    memset(out, 0, sizeof(instruction));
+
+    if (in[0] & IMG_V2_RAW)
+    {
+        if (count < head + len || in[head] != opcode)
+        {
+            return 0;
+        }
+
+        memcpy(out, in + head, len);
+
+        return head + len;
+    }
+
+    out->opcode = opcode;
+    out->size = sizes[in[0] >> 6];
+
+    const unsigned char* p = in + head;
+    const unsigned char* end = in + count;
+
+    for (int i = 0; i < operands[opcode]; i++)
+    {
+        if (p >= end)
+        {
+            return 0;
+        }
+
+        unsigned char descriptor = *(p++);
+        unsigned char kind = descriptor & 4 ? ADDRESS : LITERAL;
+        complex_operand* comp = (complex_operand*)&out->operands[i];
+
+        switch (descriptor & 3)
+        {
+            case V2_IMMEDIATE:
+            {
+                int width = immediate_widths[(descriptor >> 3) & 3];
+
+                if (end - p < width)
+                {
+                    return 0;
+                }
+
+                out->operands[i] = load_signed(p, width);
+                out->operand_types[i] = IMMEDIATE | kind;
+                p += width;
+                break;
+            }
+
+            case V2_REGISTER:
+                comp->base = descriptor >> 4;
+                comp->multiplier = 1;
+                out->operand_types[i] = REGISTER | kind;
+                break;
+
+            case V2_COMPLEX:
+            {
+                if (p >= end)
+                {
+                    return 0;
+                }
+
+                unsigned char extra = *(p++);
+                int width = offset_widths[extra >> 6];
+
+                comp->base = descriptor >> 4;
+                comp->register2 = extra & 15;
+                comp->register2_sign = (extra >> 4) & 1;
+                comp->multiplier = 1;
+
+                if (extra & 0x20)
+                {
+                    if (p >= end)
+                    {
+                        return 0;
+                    }
+
+                    comp->multiplier = *(p++);
+                }
+
+                if (end - p < width)
+                {
+                    return 0;
+                }
+
+                comp->offset = load_signed(p, width);
+                out->operand_types[i] = REGISTER | COMPLEX | kind;
+                p += width;
+                break;
+            }
+
+            default:
+                if (end - p < 9)
+                {
+                    return 0;
+                }
+
+                out->operand_types[i] = p[0];
+                memcpy(&out->operands[i], p + 1, 8);
+                p += 9;
+                break;
+        }
+    }
+
+    return p - in;
+}
+
+bool image_unpack(
+        const unsigned char* image,
+        uint64_t count,
+        unsigned char* out,
+        uint64_t out_size,
+        uint64_t* out_count)
+{
+    *out_count = 0;
+
+    if (!image_is_v2(image, count))
+    {
+        return false;
+    }
+
+    uint64_t code_bytes = *(uint64_t*)(image + IMG_V2_HDR_CODE_BYTES);
+    uint64_t packed_bytes = *(uint64_t*)(image + IMG_V2_HDR_PACKED_BYTES);
+
+    if (packed_bytes > count - IMG_V2_HDR_LEN)
+    {
+        return false;
+    }
+
+    uint64_t trailing = count - IMG_V2_HDR_LEN - packed_bytes;
+
+    // Checked in parts so a corrupt header can't overflow the sum
+    if (code_bytes > out_size || trailing > out_size ||
+        IMG_HDR_LEN + code_bytes + trailing > out_size)
+    {
+        *out_count = IMG_HDR_LEN + code_bytes + trailing;
+        return false;
+    }
+
+    const unsigned char* in = image + IMG_V2_HDR_LEN;
+    const unsigned char* in_end = in + packed_bytes;
+    uint64_t code_end = IMG_HDR_LEN + code_bytes;
+    uint64_t offset = IMG_HDR_LEN;
+
+    while (in < in_end)
+    {
+        instruction inst;
+        int used = image_unpack_instruction(in, in_end - in, &inst);
+
+        if (!used)
+        {
+            return false;
+        }
+
+        int len = instruction_encoded_len(operands[inst.opcode]);
+
+        if (offset + len > code_end)
+        {
+            return false;
+        }
+
+        memcpy(out + offset, &inst, len);
+
+        offset += len;
+        in += used;
+    }
+
+    if (offset != code_end)
+    {
+        return false;
+    }
+
+    memcpy(out + code_end, in_end, trailing);
+
+    *(uint64_t*)(out + IMG_HDR_CODE_BYTES) = code_bytes;
+    *(uint64_t*)(out + IMG_HDR_ENTRY_POINT) =
+        *(uint64_t*)(image + IMG_V2_HDR_ENTRY_POINT);
+
+    *out_count = code_end + trailing;
+
+    return true;
+}
@@ -0,0 +1,79 @@
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+#include "shared.h"
+
+// Image format v2 packs the same program as a v1 image into a dense,
+// variable-length encoding. Addresses don't change: labels, jump targets and
+// rip all still count v1 bytes, and loading a v2 image unpacks it back into
+// the v1 layout in guest memory, so everything past the loader only ever
+// sees v1.
+//
+// v1 images have no version field; v2 ones start with a magic number.
+#define IMG_V2_MAGIC 0x756d6562
+#define IMG_V2_VERSION 2
+
+#define IMG_V2_HDR_LEN 32
+#define IMG_V2_HDR_MAGIC 0
+#define IMG_V2_HDR_VERSION 4
+#define IMG_V2_HDR_CODE_BYTES 8
+#define IMG_V2_HDR_ENTRY_POINT 16
+#define IMG_V2_HDR_PACKED_BYTES 24
+
+// Each instruction starts with a byte holding the opcode (bits 0-4), a raw
+// flag (bit 5) and the operand size (bits 6-7: byte, word, dword, qword).
+// Opcodes from 31 up don't fit in five bits: their opcode field is 31 and the
+// opcode is the next byte. Raw instructions are followed by their v1 bytes as
+// they are; the rest have one descriptor byte per operand:
+//
+//   bits 0-1  form: immediate, register, complex or raw
+//   bit 2     address (the operand is in [brackets])
+//
+// Immediates keep their width (1, 2, 4 or 8 bytes) in bits 3-4 and follow
+// the descriptor, sign-extended on unpacking. A register operand's register
+// is in bits 4-7 and nothing follows. A complex operand has its base register
+// in bits 4-7, then a byte with the second register (bits 0-3), its sign (bit
+// 4), whether a multiplier byte follows (bit 5) and the offset's width (bits
+// 6-7: none, 1, 2 or 4 bytes), then the multiplier and offset. Raw operands
+// are their v1 type byte and 8 operand bytes.
+#define IMG_V2_RAW 0x20
+#define IMG_V2_EXTENDED 0x1f
+
+enum image_v2_form
+{
+    V2_IMMEDIATE,
+    V2_REGISTER,
+    V2_COMPLEX,
+    V2_RAW
+};
+
+bool image_is_v2(const unsigned char* bytes, uint64_t count);
+
+// The most bytes image_pack can produce for a v1 image of count bytes
+uint64_t image_packed_max(uint64_t count);
+
+// Packs a v1 image into v2. Returns the packed size, or 0 if the v1 image's
+// code doesn't split cleanly into instructions.
+uint64_t image_pack(
+        const unsigned char* image,
+        uint64_t count,
+        unsigned char* out);
+
+// Unpacks one instruction into its v1 form. Returns the bytes consumed, or 0
+// if they don't hold a whole instruction.
+int image_unpack_instruction(
+        const unsigned char* in,
+        uint64_t count,
+        instruction* out);
+
+// Unpacks a v2 image into a v1 one of at most out_size bytes. Returns false
+// if it's malformed or doesn't fit; out_count is then the size it would need,
+// or 0 if it's malformed.
+bool image_unpack(
+        const unsigned char* image,
+        uint64_t count,
+        unsigned char* out,
+        uint64_t out_size,
+        uint64_t* out_count);
+
+#endif
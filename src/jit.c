@@ -0,0 +1,1578 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+
+#if defined(__x86_64__)
+
+#define JIT_CODE_SIZE (64 * 1024 * 1024)
+#define JIT_BLOCK_RESERVE (128 * 1024)
+#define JIT_MAX_BLOCK_LEN 256
+#define JIT_MAX_STUBS (JIT_MAX_BLOCK_LEN * 3 + 2)
+#define JIT_MAX_GUARDS 4
+
+enum jit_status
+{
+    JIT_EXIT,
+    JIT_DISPATCH,
+    JIT_INVALIDATE,
+    JIT_BUDGET,
+    JIT_FAULT
+};
+
+enum x86_registers
+{
+    X86_RAX,
+    X86_RCX,
+    X86_RDX,
+    X86_RBX,
+    X86_RSP,
+    X86_RBP,
+    X86_RSI,
+    X86_RDI,
+    X86_R8,
+    X86_R9,
+    X86_R10,
+    X86_R11,
+    X86_R12,
+    X86_R13,
+    X86_R14,
+    X86_R15
+};
+
+// Native code keeps rbx pointing at the machine state and r12 at guest
+// memory. Guest registers live in these host registers for as long as we
+// stay in native code; -1 means the register stays in machine_state.
+static const int host_registers[REGISTER_COUNT] = {
+    [R0]    = X86_R8,
+    [R1]    = X86_R9,
+    [R2]    = X86_R10,
+    [R3]    = X86_R11,
+    [R4]    = X86_R13,
+    [R5]    = X86_R14,
+    [RIP]   = -1,
+    [RSP]   = X86_R15,
+    [RFLAG] = X86_RBP,
+    [RMEM]  = -1
+};
+
+// Returned in rax:rdx by the native entry trampoline
+typedef struct
+{
+    uint64_t status;
+    unsigned char* link;
+} jit_exit;
+
+typedef jit_exit (*jit_entry)(machine_state* state, unsigned char* code);
+
+typedef struct
+{
+    unsigned char* site;
+    uint64_t rip;
+    unsigned char status;
+    bool link;
+    // Instructions compiled into the block before this exit
+    int retired;
+    // Further jumps that share this exit; never for linked ones
+    unsigned char* shared[JIT_MAX_GUARDS - 1];
+    int shared_count;
+} jit_stub;
+
+typedef struct jit_context
+{
+    unsigned char* code;
+    unsigned char* out;
+    unsigned char* epilogue;
+    unsigned char* blocks_start;
+    unsigned char** blocks;
+    decoded_program* program;
+    unsigned generation;
+    uint64_t memory_size;
+    // The code is never writable and executable at once
+    bool writable;
+
+    jit_stub stubs[JIT_MAX_STUBS];
+    int stub_count;
+    int block_retired;
+    // Safe mode exit of the instruction being compiled
+    jit_stub* fault;
+
+    // While cache_valid, rdx holds the 8 bytes at the address of cached, as
+    // last loaded or stored by this block
+    decoded_operand cached;
+    bool cache_valid;
+} jit_context;
+
+static void emit_byte(jit_context* jit, unsigned char b)
+{
+    *(jit->out++) = b;
+}
+
+static void emit_u32(jit_context* jit, uint32_t v)
+{
+    memcpy(jit->out, &v, sizeof(v));
+    jit->out += sizeof(v);
+}
+
+static void emit_u64(jit_context* jit, uint64_t v)
+{
+    memcpy(jit->out, &v, sizeof(v));
+    jit->out += sizeof(v);
+}
+
+static bool fits_imm32(uint64_t v)
+{
+    return (int64_t)v == (int32_t)v;
+}
+
+static void emit_rex(jit_context* jit, bool w, int reg, int index, int base)
+{
+    unsigned char rex = 0x40 | w << 3 | (reg >> 3) << 2 | (index >> 3) << 1 |
+                        base >> 3;
+
+    if (rex != 0x40)
+    {
+        emit_byte(jit, rex);
+    }
+}
+
+static void emit_opcode(jit_context* jit, unsigned op)
+{
+    if (op > 0xff)
+    {
+        emit_byte(jit, op >> 8);
+    }
+
+    emit_byte(jit, op & 0xff);
+}
+
+// 64-bit op with a register-direct r/m operand
+static void emit_rr(jit_context* jit, unsigned op, int reg, int rm)
+{
+    emit_rex(jit, true, reg, 0, rm);
+    emit_opcode(jit, op);
+    emit_byte(jit, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// Op with a [base + index + disp] r/m operand. index < 0 for none.
+static void emit_rm_w(
+        jit_context* jit,
+        bool w,
+        unsigned op,
+        int reg,
+        int base,
+        int index,
+        int32_t disp)
+{
+    emit_rex(jit, w, reg, index < 0 ? 0 : index, base);
+    emit_opcode(jit, op);
+
+    int mod = disp == 0 && (base & 7) != X86_RBP ? 0 :
+              disp >= -128 && disp <= 127 ? 1 : 2;
+
+    if (index >= 0 || (base & 7) == X86_RSP)
+    {
+        emit_byte(jit, mod << 6 | (reg & 7) << 3 | X86_RSP);
+        emit_byte(jit, ((index >= 0 ? index : X86_RSP) & 7) << 3 | (base & 7));
+    }
+    else
+    {
+        emit_byte(jit, mod << 6 | (reg & 7) << 3 | (base & 7));
+    }
+
+    if (mod == 1)
+    {
+        emit_byte(jit, disp);
+    }
+    else if (mod == 2)
+    {
+        emit_u32(jit, disp);
+    }
+}
+
+static void emit_rm(
+        jit_context* jit,
+        unsigned op,
+        int reg,
+        int base,
+        int index,
+        int32_t disp)
+{
+    emit_rm_w(jit, true, op, reg, base, index, disp);
+}
+
+static void emit_mov_rr(jit_context* jit, int dst, int src)
+{
+    if (dst != src)
+    {
+        emit_rr(jit, 0x89, src, dst);
+    }
+}
+
+static void emit_mov_imm(jit_context* jit, int dst, uint64_t v)
+{
+    if (fits_imm32(v))
+    {
+        emit_rr(jit, 0xc7, 0, dst);
+        emit_u32(jit, v);
+    }
+    else if (v <= 0xffffffff)
+    {
+        emit_rex(jit, false, 0, 0, dst);
+        emit_byte(jit, 0xb8 | (dst & 7));
+        emit_u32(jit, v);
+    }
+    else
+    {
+        emit_rex(jit, true, 0, 0, dst);
+        emit_byte(jit, 0xb8 | (dst & 7));
+        emit_u64(jit, v);
+    }
+}
+
+static void emit_alu_imm(jit_context* jit, int ext, int dst, int32_t v)
+{
+    emit_rr(jit, 0x81, ext, dst);
+    emit_u32(jit, v);
+}
+
+static int32_t guest_register_offset(int reg)
+{
+    return offsetof(machine_state, registers) + reg * sizeof(uint64_t);
+}
+
+static void emit_load_guest(jit_context* jit, int dst, int reg)
+{
+    int host = host_registers[reg];
+
+    if (host >= 0)
+    {
+        emit_mov_rr(jit, dst, host);
+    }
+    else
+    {
+        emit_rm(jit, 0x8b, dst, X86_RBX, -1, guest_register_offset(reg));
+    }
+}
+
+static void emit_store_guest(jit_context* jit, int reg, int src)
+{
+    int host = host_registers[reg];
+
+    if (host >= 0)
+    {
+        emit_mov_rr(jit, host, src);
+    }
+    else
+    {
+        emit_rm(jit, 0x89, src, X86_RBX, -1, guest_register_offset(reg));
+    }
+}
+
+static void emit_spill(jit_context* jit)
+{
+    for (int i = 0; i < REGISTER_COUNT; i++)
+    {
+        if (host_registers[i] >= 0)
+        {
+            emit_rm(jit, 0x89, host_registers[i], X86_RBX, -1,
+                    guest_register_offset(i));
+        }
+    }
+}
+
+static void emit_reload(jit_context* jit)
+{
+    for (int i = 0; i < REGISTER_COUNT; i++)
+    {
+        if (host_registers[i] >= 0)
+        {
+            emit_rm(jit, 0x8b, host_registers[i], X86_RBX, -1,
+                    guest_register_offset(i));
+        }
+    }
+}
+
+// Narrow loads zero-extend into the full register
+static void emit_load_sized(
+        jit_context* jit,
+        int dst,
+        int base,
+        int index,
+        unsigned char size)
+{
+    switch (size)
+    {
+        case B1: emit_rm_w(jit, false, 0x0fb6, dst, base, index, 0); break;
+        case B2: emit_rm_w(jit, false, 0x0fb7, dst, base, index, 0); break;
+        case B4: emit_rm_w(jit, false, 0x8b, dst, base, index, 0);   break;
+        default: emit_rm(jit, 0x8b, dst, base, index, 0);            break;
+    }
+}
+
+// src must be rax or rcx, so the byte form never needs a REX prefix of its own
+static void emit_store_sized(
+        jit_context* jit,
+        int src,
+        int base,
+        int index,
+        unsigned char size)
+{
+    switch (size)
+    {
+        case B1:
+            emit_rm_w(jit, false, 0x88, src, base, index, 0);
+            break;
+
+        case B2:
+            emit_byte(jit, 0x66);
+            emit_rm_w(jit, false, 0x89, src, base, index, 0);
+            break;
+
+        case B4:
+            emit_rm_w(jit, false, 0x89, src, base, index, 0);
+            break;
+
+        default:
+            emit_rm(jit, 0x89, src, base, index, 0);
+            break;
+    }
+}
+
+// Clears everything above the low size bytes of reg (rax or rcx)
+static void emit_zero_extend(jit_context* jit, int reg, unsigned char size)
+{
+    switch (size)
+    {
+        case B1:
+            emit_byte(jit, 0x0f);
+            emit_byte(jit, 0xb6);
+            emit_byte(jit, 0xc0 | reg << 3 | reg);
+            break;
+
+        case B2:
+            emit_byte(jit, 0x0f);
+            emit_byte(jit, 0xb7);
+            emit_byte(jit, 0xc0 | reg << 3 | reg);
+            break;
+
+        case B4:
+            emit_byte(jit, 0x89);
+            emit_byte(jit, 0xc0 | reg << 3 | reg);
+            break;
+    }
+}
+
+static void emit_sign_extend(jit_context* jit, int reg, unsigned char size)
+{
+    switch (size)
+    {
+        case B1: emit_rr(jit, 0x0fbe, reg, reg); break;
+        case B2: emit_rr(jit, 0x0fbf, reg, reg); break;
+        case B4: emit_rr(jit, 0x63, reg, reg);   break;
+    }
+}
+
+static bool same_operand(decoded_operand* a, decoded_operand* b)
+{
+    return a->kind == b->kind && a->base == b->base &&
+           a->multiplier == b->multiplier && a->register2 == b->register2 &&
+           a->offset == b->offset && a->value == b->value;
+}
+
+static bool cache_hit(jit_context* jit, decoded_operand* op)
+{
+    return jit->cache_valid && same_operand(&jit->cached, op);
+}
+
+static void cache_set(jit_context* jit, decoded_operand* op, int src)
+{
+    emit_mov_rr(jit, X86_RDX, src);
+    jit->cached = *op;
+    jit->cache_valid = true;
+}
+
+// A store of size bytes from rax to op. Any other cached address could be
+// the same memory.
+static void cache_store(jit_context* jit, decoded_operand* op, unsigned char size)
+{
+    jit->cache_valid = false;
+
+    if (size == B8)
+    {
+        cache_set(jit, op, X86_RAX);
+    }
+}
+
+// Guest address of a memory operand into dst
+static void emit_address(jit_context* jit, int dst, decoded_operand* op)
+{
+    switch (op->kind)
+    {
+        case DOP_ABSOLUTE:
+            emit_mov_imm(jit, dst, op->value);
+            break;
+
+        case DOP_INDIRECT:
+            emit_load_guest(jit, dst, op->base);
+            break;
+
+        default:
+            emit_load_guest(jit, dst, op->base);
+
+            if (op->multiplier != 1)
+            {
+                emit_rr(jit, 0x69, dst, dst);
+                emit_u32(jit, op->multiplier);
+            }
+
+            if (op->register2 != NO_REGISTER)
+            {
+                int host = host_registers[op->register2];
+
+                if (host >= 0)
+                {
+                    emit_rr(jit, 0x01, host, dst);
+                }
+                else
+                {
+                    emit_rm(jit, 0x03, dst, X86_RBX, -1,
+                            guest_register_offset(op->register2));
+                }
+            }
+
+            if (op->offset)
+            {
+                emit_alu_imm(jit, 0, dst, op->offset);
+            }
+
+            break;
+    }
+}
+
+// Memory operand op into dst, computing its address in addr unless the value
+// is already in the cache
+static void emit_load_memory(
+        jit_context* jit,
+        int dst,
+        decoded_operand* op,
+        int addr,
+        unsigned char size)
+{
+    if (size == B8 && cache_hit(jit, op))
+    {
+        emit_mov_rr(jit, dst, X86_RDX);
+        return;
+    }
+
+    emit_address(jit, addr, op);
+    emit_load_sized(jit, dst, X86_R12, addr, size);
+
+    if (size == B8)
+    {
+        cache_set(jit, op, dst);
+    }
+}
+
+// Value of an operand into dst, using addr as scratch for memory operands
+static void emit_load_operand(
+        jit_context* jit,
+        int dst,
+        decoded_operand* op,
+        int addr)
+{
+    switch (op->kind)
+    {
+        case DOP_IMMEDIATE:
+            emit_mov_imm(jit, dst, op->value);
+            break;
+
+        case DOP_REGISTER:
+            emit_load_guest(jit, dst, op->base);
+            break;
+
+        default:
+            emit_load_memory(jit, dst, op, addr, B8);
+            break;
+    }
+}
+
+// Operand value zero-extended from the instruction's size. dst is rax or rcx.
+static void emit_load_operand_sized(
+        jit_context* jit,
+        int dst,
+        decoded_operand* op,
+        int addr,
+        unsigned char size)
+{
+    if (op->kind == DOP_IMMEDIATE || op->kind == DOP_REGISTER)
+    {
+        emit_load_operand(jit, dst, op, addr);
+        emit_zero_extend(jit, dst, size);
+    }
+    else
+    {
+        emit_load_memory(jit, dst, op, addr, size);
+    }
+}
+
+// Jump with a placeholder rel32, filled in once its stub is placed
+static void emit_stub_jump(
+        jit_context* jit,
+        unsigned op,
+        uint64_t rip,
+        unsigned char status,
+        bool link)
+{
+    emit_opcode(jit, op);
+
+    jit_stub* stub = &jit->stubs[jit->stub_count++];
+    stub->site = jit->out;
+    stub->rip = rip;
+    stub->status = status;
+    stub->link = link;
+    stub->retired = jit->block_retired;
+    stub->shared_count = 0;
+
+    emit_u32(jit, 0);
+}
+
+static void emit_link(jit_context* jit, unsigned op, uint64_t rip)
+{
+    emit_stub_jump(jit, op, rip, JIT_DISPATCH, true);
+}
+
+static void emit_jump_to(jit_context* jit, unsigned char* target)
+{
+    emit_byte(jit, 0xe9);
+    emit_u32(jit, target - (jit->out + 4));
+}
+
+// Leave native code if a store at guest address reg hit the code region
+static void emit_code_check(jit_context* jit, int reg, uint64_t resume_rip)
+{
+    emit_alu_imm(jit, 7, reg, jit->program->code_end);
+    emit_stub_jump(jit, 0x0f82, resume_rip, JIT_INVALIDATE, false);
+}
+
+static void jit_print(machine_state* state, uint64_t value)
+{
+    output_value(&state->output, value);
+}
+
+static void emit_call(jit_context* jit, void* fn)
+{
+    emit_spill(jit);
+    emit_mov_rr(jit, X86_RDI, X86_RBX);
+    emit_mov_imm(jit, X86_RAX, (uint64_t)fn);
+    emit_rr(jit, 0xff, 2, X86_RAX);
+    emit_reload(jit);
+}
+
+// Stores rax into the instruction's first operand, whose address is in addr
+// if it lives in memory
+static void emit_store_result(jit_context* jit, decoded_instruction* d, int addr)
+{
+    decoded_operand* dst = &d->operands[0];
+
+    if (dst->kind == DOP_REGISTER)
+    {
+        emit_zero_extend(jit, X86_RAX, d->size);
+        emit_store_guest(jit, dst->base, X86_RAX);
+    }
+    else
+    {
+        emit_store_sized(jit, X86_RAX, X86_R12, addr, d->size);
+        cache_store(jit, dst, d->size);
+        emit_code_check(jit, addr, d->next_rip);
+    }
+}
+
+static void emit_binary(jit_context* jit, decoded_instruction* d)
+{
+    decoded_operand* dst = &d->operands[0];
+    decoded_operand* src = &d->operands[1];
+
+    int host = dst->kind == DOP_REGISTER ? host_registers[dst->base] : -1;
+    int src_host = src->kind == DOP_REGISTER ? host_registers[src->base] : -1;
+    bool src_imm = src->kind == DOP_IMMEDIATE && fits_imm32(src->value);
+
+    // Both sides already in host registers (or a small immediate)
+    if (d->size == B8 && host >= 0 && (src_host >= 0 || src_imm))
+    {
+        switch (d->opcode)
+        {
+            case OP_MOV:
+                if (src_host >= 0)
+                {
+                    emit_mov_rr(jit, host, src_host);
+                }
+                else
+                {
+                    emit_mov_imm(jit, host, src->value);
+                }
+                return;
+
+            case OP_ADD:
+            case OP_SUB:
+                if (src_host >= 0)
+                {
+                    emit_rr(jit, d->opcode == OP_ADD ? 0x01 : 0x29,
+                            src_host, host);
+                }
+                else
+                {
+                    emit_alu_imm(jit, d->opcode == OP_ADD ? 0 : 5,
+                                 host, src->value);
+                }
+                return;
+
+            case OP_MUL:
+                if (src_host >= 0)
+                {
+                    emit_rr(jit, 0x0faf, host, src_host);
+                }
+                else
+                {
+                    emit_rr(jit, 0x69, host, host);
+                    emit_u32(jit, src->value);
+                }
+                return;
+
+            case OP_CMP:
+                emit_mov_rr(jit, X86_RAX, host);
+
+                if (src_host >= 0)
+                {
+                    emit_rr(jit, 0x29, src_host, X86_RAX);
+                }
+                else
+                {
+                    emit_alu_imm(jit, 5, X86_RAX, src->value);
+                }
+
+                emit_store_guest(jit, RFLAG, X86_RAX);
+                return;
+        }
+    }
+
+    bool memory = dst->kind != DOP_IMMEDIATE && dst->kind != DOP_REGISTER;
+
+    // cmp only needs the address to load from, which the cache may save
+    bool cached_cmp = memory && d->opcode == OP_CMP && d->size == B8 &&
+                      cache_hit(jit, dst) &&
+                      (src->kind == DOP_IMMEDIATE || src->kind == DOP_REGISTER);
+
+    if (memory && !cached_cmp)
+    {
+        emit_address(jit, X86_RSI, dst);
+    }
+
+    emit_load_operand_sized(jit, X86_RCX, src, X86_RDI, d->size);
+
+    if (d->opcode != OP_MOV)
+    {
+        if (memory && d->size == B8 && cache_hit(jit, dst))
+        {
+            emit_mov_rr(jit, X86_RAX, X86_RDX);
+        }
+        else if (memory)
+        {
+            emit_load_sized(jit, X86_RAX, X86_R12, X86_RSI, d->size);
+
+            if (d->size == B8)
+            {
+                cache_set(jit, dst, X86_RAX);
+            }
+        }
+        else
+        {
+            emit_load_operand_sized(jit, X86_RAX, dst, X86_RSI, d->size);
+        }
+    }
+
+    switch (d->opcode)
+    {
+        case OP_MOV:
+            emit_mov_rr(jit, X86_RAX, X86_RCX);
+            break;
+
+        case OP_ADD:
+            emit_rr(jit, 0x01, X86_RCX, X86_RAX);
+            break;
+
+        case OP_SUB:
+            emit_rr(jit, 0x29, X86_RCX, X86_RAX);
+            break;
+
+        case OP_MUL:
+            emit_rr(jit, 0x0faf, X86_RAX, X86_RCX);
+            break;
+
+        case OP_DIV:
+        case OP_MOD:
+            // xor edx, edx; div rcx
+            emit_byte(jit, 0x31);
+            emit_byte(jit, 0xd2);
+            emit_rr(jit, 0xf7, 6, X86_RCX);
+
+            if (d->opcode == OP_MOD)
+            {
+                emit_mov_rr(jit, X86_RAX, X86_RDX);
+            }
+            break;
+
+        case OP_CMP:
+            emit_rr(jit, 0x29, X86_RCX, X86_RAX);
+            emit_sign_extend(jit, X86_RAX, d->size);
+            emit_store_guest(jit, RFLAG, X86_RAX);
+            return;
+    }
+
+    emit_store_result(jit, d, X86_RSI);
+}
+
+static void emit_unary(jit_context* jit, decoded_instruction* d)
+{
+    decoded_operand* op = &d->operands[0];
+    int ext = d->opcode == OP_INC ? 0 : 1;
+
+    if (d->size != B8)
+    {
+        emit_load_operand_sized(jit, X86_RAX, op, X86_RSI, d->size);
+        emit_rr(jit, 0xff, ext, X86_RAX);
+        emit_store_result(jit, d, X86_RSI);
+        return;
+    }
+
+    if (op->kind == DOP_REGISTER)
+    {
+        int host = host_registers[op->base];
+
+        if (host >= 0)
+        {
+            emit_rr(jit, 0xff, ext, host);
+        }
+        else
+        {
+            emit_rm(jit, 0xff, ext, X86_RBX, -1,
+                    guest_register_offset(op->base));
+        }
+
+        return;
+    }
+
+    emit_address(jit, X86_RSI, op);
+    emit_rm(jit, 0xff, ext, X86_R12, X86_RSI, 0);
+    jit->cache_valid = false;
+    emit_code_check(jit, X86_RSI, d->next_rip);
+}
+
+static void emit_push(jit_context* jit, decoded_instruction* d)
+{
+    decoded_operand* op = &d->operands[0];
+    int rsp = host_registers[RSP];
+
+    // push rsp stores the already decremented value
+    if (op->kind == DOP_REGISTER && op->base == RSP)
+    {
+        emit_alu_imm(jit, 5, rsp, B8);
+        emit_rm(jit, 0x89, rsp, X86_R12, rsp, 0);
+    }
+    else
+    {
+        emit_load_operand(jit, X86_RAX, op, X86_RSI);
+        emit_alu_imm(jit, 5, rsp, B8);
+        emit_rm(jit, 0x89, X86_RAX, X86_R12, rsp, 0);
+    }
+
+    jit->cache_valid = false;
+    emit_code_check(jit, rsp, d->next_rip);
+}
+
+static void emit_pop(jit_context* jit, decoded_instruction* d)
+{
+    decoded_operand* op = &d->operands[0];
+    int rsp = host_registers[RSP];
+    bool memory = op->kind != DOP_REGISTER;
+
+    if (memory)
+    {
+        emit_address(jit, X86_RSI, op);
+    }
+
+    emit_rm(jit, 0x8b, X86_RAX, X86_R12, rsp, 0);
+
+    if (memory)
+    {
+        emit_rm(jit, 0x89, X86_RAX, X86_R12, X86_RSI, 0);
+        jit->cache_valid = false;
+    }
+    else
+    {
+        emit_store_guest(jit, op->base, X86_RAX);
+    }
+
+    emit_alu_imm(jit, 0, rsp, B8);
+
+    if (memory)
+    {
+        emit_code_check(jit, X86_RSI, d->next_rip);
+    }
+}
+
+static void emit_ret(jit_context* jit)
+{
+    int rsp = host_registers[RSP];
+
+    emit_rm(jit, 0x8b, X86_RAX, X86_R12, rsp, 0);
+    emit_alu_imm(jit, 0, rsp, B8);
+
+    // Look the return address up in the block table without leaving native
+    // code: rcx = rax - IMG_HDR_LEN is both the code offset and the byte
+    // offset of its slot, since slots are 8 bytes apart.
+    emit_mov_rr(jit, X86_RCX, X86_RAX);
+    emit_alu_imm(jit, 5, X86_RCX, IMG_HDR_LEN);
+    emit_alu_imm(jit, 7, X86_RCX, jit->program->code_end - IMG_HDR_LEN);
+    unsigned char* out_of_range = jit->out + 2;
+    emit_opcode(jit, 0x0f83);
+    emit_u32(jit, 0);
+
+    // test cl, 7; jnz slow
+    emit_byte(jit, 0xf6);
+    emit_byte(jit, 0xc1);
+    emit_byte(jit, 7);
+    unsigned char* misaligned = jit->out + 2;
+    emit_opcode(jit, 0x0f85);
+    emit_u32(jit, 0);
+
+    emit_mov_imm(jit, X86_RDX, (uint64_t)jit->blocks);
+    emit_rm(jit, 0x8b, X86_RCX, X86_RDX, X86_RCX, 0);
+    emit_rr(jit, 0x85, X86_RCX, X86_RCX);
+    unsigned char* missing = jit->out + 2;
+    emit_opcode(jit, 0x0f84);
+    emit_u32(jit, 0);
+
+    // jmp rcx
+    emit_rr(jit, 0xff, 4, X86_RCX);
+
+    unsigned char* slow = jit->out;
+
+    *(int32_t*)out_of_range = slow - (out_of_range + 4);
+    *(int32_t*)misaligned = slow - (misaligned + 4);
+    *(int32_t*)missing = slow - (missing + 4);
+
+    emit_store_guest(jit, RIP, X86_RAX);
+    emit_byte(jit, 0x31);
+    emit_byte(jit, 0xd2);
+    emit_byte(jit, 0xb8);
+    emit_u32(jit, JIT_DISPATCH);
+    emit_jump_to(jit, jit->epilogue);
+}
+
+// Safe mode: leave with a fault at d if the flags say so. All of one
+// instruction's guards share a single exit.
+static void emit_fault_jump(
+        jit_context* jit,
+        unsigned op,
+        decoded_instruction* d)
+{
+    if (!jit->fault)
+    {
+        jit->fault = &jit->stubs[jit->stub_count];
+        emit_stub_jump(jit, op, d->rip, JIT_FAULT, false);
+        return;
+    }
+
+    emit_opcode(jit, op);
+    jit->fault->shared[jit->fault->shared_count++] = jit->out;
+    emit_u32(jit, 0);
+}
+
+// Fault unless reg <= max, unsigned
+static void emit_limit_check(
+        jit_context* jit,
+        int reg,
+        uint64_t max,
+        decoded_instruction* d)
+{
+    if (fits_imm32(max))
+    {
+        emit_alu_imm(jit, 7, reg, max);
+    }
+    else
+    {
+        emit_mov_imm(jit, X86_RCX, max);
+        emit_rr(jit, 0x39, X86_RCX, reg);
+    }
+
+    emit_fault_jump(jit, 0x0f87, d);
+}
+
+// The native form of the decoder's safe mode checks, made before the
+// instruction changes anything
+static void emit_guards(jit_context* jit, decoded_instruction* d)
+{
+    uint64_t limit = jit->memory_size;
+    uint64_t size = d->size;
+    int rsp = host_registers[RSP];
+
+    for (int i = 0; i < operands[d->opcode]; i++)
+    {
+        decoded_operand* op = &d->operands[i];
+
+        if (op->kind == DOP_INDIRECT || op->kind == DOP_COMPLEX)
+        {
+            emit_address(jit, X86_RAX, op);
+            emit_limit_check(jit, X86_RAX, limit - size, d);
+        }
+    }
+
+    switch (d->opcode)
+    {
+        case OP_PUSH:
+        case OP_CALL:
+            if (d->opcode == OP_CALL)
+            {
+                size = B8;
+            }
+
+            emit_mov_rr(jit, X86_RAX, rsp);
+            emit_alu_imm(jit, 5, X86_RAX, size);
+            emit_fault_jump(jit, 0x0f82, d);
+            emit_limit_check(jit, X86_RAX, limit - size, d);
+
+            // The pushed return address can't land on the call itself
+            if (d->opcode == OP_CALL)
+            {
+                emit_alu_imm(jit, 5, X86_RAX, d->rip - 7);
+                emit_alu_imm(jit, 7, X86_RAX, d->next_rip - d->rip + 7);
+                emit_fault_jump(jit, 0x0f82, d);
+            }
+            break;
+
+        case OP_POP:
+        case OP_RET:
+            emit_mov_rr(jit, X86_RAX, rsp);
+            emit_limit_check(jit, X86_RAX,
+                             limit - (d->opcode == OP_RET ? B8 : size), d);
+            break;
+
+        case OP_DIV:
+        case OP_MOD:
+            emit_load_operand_sized(jit, X86_RAX, &d->operands[1], X86_RDI,
+                                    d->size);
+            emit_rr(jit, 0x85, X86_RAX, X86_RAX);
+            emit_fault_jump(jit, 0x0f84, d);
+            break;
+    }
+}
+
+// Checked entries compile with their guards in front. Bulk instructions
+// spend their time in libc, so they stay with the interpreter.
+static bool compilable(decoded_instruction* d)
+{
+    unsigned short op = d->op == H_checked ? d->checked : d->op;
+
+    return op != H_generic && op != H_resume && op != H_bulk;
+}
+
+static unsigned jcc_opcode(unsigned char opcode)
+{
+    switch (opcode)
+    {
+        case OP_JE:  return 0x0f84;
+        case OP_JNE: return 0x0f85;
+        case OP_JL:  return 0x0f8c;
+        case OP_JLE: return 0x0f8e;
+        case OP_JG:  return 0x0f8f;
+        default:     return 0x0f8d;
+    }
+}
+
+// Emits one instruction. Returns false if it ends the block.
+static bool compile_instruction(jit_context* jit, decoded_instruction* d)
+{
+    int rsp = host_registers[RSP];
+
+    switch (d->opcode)
+    {
+        case OP_MOV:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_CMP:
+            emit_binary(jit, d);
+            return true;
+
+        case OP_INC:
+        case OP_DEC:
+            emit_unary(jit, d);
+            return true;
+
+        case OP_PUSH:
+            emit_push(jit, d);
+            return true;
+
+        case OP_POP:
+            emit_pop(jit, d);
+            return true;
+
+        case OP_PRINT:
+            emit_load_operand(jit, X86_RSI, &d->operands[0], X86_RDI);
+            emit_call(jit, jit_print);
+            return true;
+
+        case OP_JMP:
+            emit_link(jit, 0xe9, d->target->rip);
+            return false;
+
+        case OP_JE:
+        case OP_JNE:
+        case OP_JL:
+        case OP_JLE:
+        case OP_JG:
+        case OP_JGE:
+            // Taken branches leave; the block carries on down the fall-through
+            // path
+            emit_rr(jit, 0x85, host_registers[RFLAG], host_registers[RFLAG]);
+            emit_link(jit, jcc_opcode(d->opcode), d->target->rip);
+            return true;
+
+        case OP_CALL:
+            emit_alu_imm(jit, 5, rsp, B8);
+            emit_mov_imm(jit, X86_RAX, d->next_rip);
+            emit_rm(jit, 0x89, X86_RAX, X86_R12, rsp, 0);
+            jit->cache_valid = false;
+            emit_code_check(jit, rsp, d->target->rip);
+            emit_link(jit, 0xe9, d->target->rip);
+            return false;
+
+        case OP_RET:
+            emit_ret(jit);
+            return false;
+
+        default:
+            emit_stub_jump(jit, 0xe9, d->next_rip, JIT_EXIT, false);
+            return false;
+    }
+}
+
+static bool is_memory(decoded_operand* op)
+{
+    return op->kind != DOP_IMMEDIATE && op->kind != DOP_REGISTER;
+}
+
+static bool writes_memory(decoded_instruction* d)
+{
+    switch (d->opcode)
+    {
+        case OP_PUSH:
+        case OP_CALL:
+            return true;
+
+        case OP_MOV:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_INC:
+        case OP_DEC:
+        case OP_POP:
+            return is_memory(&d->operands[0]);
+
+        default:
+            return false;
+    }
+}
+
+// Whether the guest register reg goes into the address of op
+static bool addresses_with(decoded_operand* op, int reg)
+{
+    return (op->kind == DOP_INDIRECT || op->kind == DOP_COMPLEX) &&
+           (op->base == reg || op->register2 == reg);
+}
+
+// Drops the cache once d has changed a register its address depends on or
+// used rdx for something else
+static void cache_after(jit_context* jit, decoded_instruction* d)
+{
+    decoded_operand* dst = &d->operands[0];
+
+    switch (d->opcode)
+    {
+        case OP_DIV:
+        case OP_MOD:
+        case OP_PRINT:
+            jit->cache_valid = false;
+            return;
+
+        case OP_PUSH:
+        case OP_POP:
+            if (addresses_with(&jit->cached, RSP))
+            {
+                jit->cache_valid = false;
+            }
+            break;
+    }
+
+    if (operands[d->opcode] > 0 && d->opcode != OP_CMP &&
+        d->opcode != OP_PUSH && dst->kind == DOP_REGISTER &&
+        addresses_with(&jit->cached, dst->base))
+    {
+        jit->cache_valid = false;
+    }
+}
+
+// A cmp whose result the next cmp replaces before anything can look at it:
+// no branch, no way out of native code and no instruction the block stops
+// at in between
+static bool flags_unused(
+        decoded_instruction* d,
+        decoded_instruction* end,
+        int len)
+{
+    for (d++, len++; d < end && len < JIT_MAX_BLOCK_LEN; d++, len++)
+    {
+        if (!compilable(d) || d->op == H_checked || writes_memory(d) ||
+            is_jump(d->opcode) || d->opcode == OP_CALL ||
+            d->opcode == OP_RET || d->opcode == OP_EXIT)
+        {
+            return false;
+        }
+
+        if (d->opcode == OP_CMP)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static unsigned char** block_slot(jit_context* jit, uint64_t rip)
+{
+    return &jit->blocks[(rip - IMG_HDR_LEN) / 8];
+}
+
+static int32_t retired_offset()
+{
+    return offsetof(machine_state, retired);
+}
+
+static void place_stubs(jit_context* jit)
+{
+    for (int i = 0; i < jit->stub_count; i++)
+    {
+        jit_stub* stub = &jit->stubs[i];
+        unsigned char* site = stub->site;
+
+        for (int j = 0; j < stub->shared_count; j++)
+        {
+            *(int32_t*)stub->shared[j] = jit->out - (stub->shared[j] + 4);
+        }
+
+        // The block counted all of its instructions on entry, so early exits
+        // hand back the ones they skip. Such an exit links through the jmp
+        // after the correction rather than the original branch.
+        int unretired = jit->block_retired - stub->retired;
+
+        if (unretired)
+        {
+            *(int32_t*)site = jit->out - (site + 4);
+
+            emit_rm(jit, 0x81, 5, X86_RBX, -1, retired_offset());
+            emit_u32(jit, unretired);
+
+            emit_byte(jit, 0xe9);
+            site = jit->out;
+            emit_u32(jit, 0);
+        }
+
+        // Link straight to blocks that already exist
+        if (stub->link && stub->rip >= IMG_HDR_LEN &&
+            stub->rip < jit->program->code_end && *block_slot(jit, stub->rip))
+        {
+            unsigned char* code = *block_slot(jit, stub->rip);
+            *(int32_t*)site = code - (site + 4);
+            continue;
+        }
+
+        *(int32_t*)site = jit->out - (site + 4);
+
+        if (fits_imm32(stub->rip))
+        {
+            emit_rm(jit, 0xc7, 0, X86_RBX, -1, guest_register_offset(RIP));
+            emit_u32(jit, stub->rip);
+        }
+        else
+        {
+            emit_mov_imm(jit, X86_RCX, stub->rip);
+            emit_store_guest(jit, RIP, X86_RCX);
+        }
+
+        if (stub->link)
+        {
+            emit_rex(jit, true, 0, 0, X86_RDX);
+            emit_byte(jit, 0xb8 | X86_RDX);
+            emit_u64(jit, (uint64_t)site);
+        }
+        else
+        {
+            emit_byte(jit, 0x31);
+            emit_byte(jit, 0xd2);
+        }
+
+        emit_byte(jit, 0xb8);
+        emit_u32(jit, stub->status);
+        emit_jump_to(jit, jit->epilogue);
+    }
+
+    jit->stub_count = 0;
+}
+
+static unsigned char* compile_block(jit_context* jit, decoded_instruction* d)
+{
+    decoded_program* program = jit->program;
+    decoded_instruction* end = program->instructions + program->count;
+    unsigned char* start = jit->out;
+
+    *block_slot(jit, d->rip) = start;
+
+    // Leave before running anything once the budget is spent. Chained
+    // jumps and ret lookups all land here, so every block checks.
+    emit_rm(jit, 0x8b, X86_RAX, X86_RBX, -1,
+            offsetof(machine_state, retired_limit));
+    emit_rm(jit, 0x39, X86_RAX, X86_RBX, -1, retired_offset());
+
+    jit->block_retired = 0;
+    jit->cache_valid = false;
+    jit_stub* budget = &jit->stubs[jit->stub_count];
+    emit_stub_jump(jit, 0x0f83, d->rip, JIT_BUDGET, false);
+
+    // Count the whole block as retired up front; patched once its length
+    // is known
+    emit_rm(jit, 0x81, 0, X86_RBX, -1, retired_offset());
+    unsigned char* count = jit->out;
+    emit_u32(jit, 0);
+
+    for (int len = 0; ; len++, d++)
+    {
+        if (d == end || !compilable(d) || len == JIT_MAX_BLOCK_LEN)
+        {
+            emit_link(jit, 0xe9, d->rip);
+            break;
+        }
+
+        // Exits from inside this instruction happen after it retires. Fused
+        // entries are compiled one instruction at a time, so each counts once.
+        jit->block_retired++;
+        jit->fault = NULL;
+
+        if (d->opcode == OP_CMP && d->op != H_checked &&
+            flags_unused(d, end, len))
+        {
+            continue;
+        }
+
+        if (d->op == H_checked)
+        {
+            emit_guards(jit, d);
+        }
+
+        if (!compile_instruction(jit, d))
+        {
+            break;
+        }
+
+        cache_after(jit, d);
+    }
+
+    *(int32_t*)count = jit->block_retired;
+
+    // Nothing has been counted yet when the budget check leaves
+    budget->retired = jit->block_retired;
+
+    place_stubs(jit);
+
+    return start;
+}
+
+static void emit_trampolines(jit_context* jit)
+{
+    static const int saved[] = {
+        X86_RBX, X86_RBP, X86_R12, X86_R13, X86_R14, X86_R15
+    };
+    int saved_count = sizeof(saved) / sizeof(saved[0]);
+
+    // Entry: jit_exit enter(machine_state* state, unsigned char* code)
+    for (int i = 0; i < saved_count; i++)
+    {
+        emit_rex(jit, false, 0, 0, saved[i]);
+        emit_byte(jit, 0x50 | (saved[i] & 7));
+    }
+
+    // Keep the stack 16-byte aligned for helper calls
+    emit_alu_imm(jit, 5, X86_RSP, 8);
+
+    emit_mov_rr(jit, X86_RBX, X86_RDI);
+    emit_rm(jit, 0x8b, X86_R12, X86_RBX, -1, offsetof(machine_state, memory));
+    emit_reload(jit);
+    emit_rr(jit, 0xff, 4, X86_RSI);
+
+    jit->epilogue = jit->out;
+
+    emit_spill(jit);
+    emit_alu_imm(jit, 0, X86_RSP, 8);
+
+    for (int i = saved_count - 1; i >= 0; i--)
+    {
+        emit_rex(jit, false, 0, 0, saved[i]);
+        emit_byte(jit, 0x58 | (saved[i] & 7));
+    }
+
+    emit_byte(jit, 0xc3);
+
+    jit->blocks_start = jit->out;
+}
+
+static void jit_flush(jit_context* jit, decoded_program* program)
+{
+    free(jit->blocks);
+
+    jit->program = program;
+    jit->generation = program->generation;
+    jit->blocks = calloc(program->code_end / 8 + 1, sizeof(unsigned char*));
+    jit->out = jit->blocks_start;
+}
+
+static bool jit_protect(jit_context* jit, bool writable)
+{
+    if (jit->writable == writable)
+    {
+        return true;
+    }
+
+    if (mprotect(jit->code, JIT_CODE_SIZE,
+                 writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC))
+    {
+        return false;
+    }
+
+    jit->writable = writable;
+
+    return true;
+}
+
+static bool jit_init(jit_context* jit, machine_state* state)
+{
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (jit->code == MAP_FAILED)
+    {
+        return false;
+    }
+
+    jit->out = jit->code;
+    jit->writable = true;
+    jit->blocks = NULL;
+    jit->stub_count = 0;
+    jit->memory_size = state->memory_size;
+
+    emit_trampolines(jit);
+    jit_flush(jit, state->program);
+
+    return true;
+}
+
+bool jit_available()
+{
+    return true;
+}
+
+// Finishes the run on the interpreter from d
+static enum run_status interpret_rest(
+        machine_state* state,
+        decoded_instruction* d)
+{
+    state->registers[RIP] = d->rip;
+
+    return run_for(state, DEFAULT_DISPATCH,
+                   state->retired < state->retired_limit ?
+                   state->retired_limit - state->retired : 0);
+}
+
+// The context stays with the machine between runs, so a guest run a slice
+// at a time keeps its compiled blocks
+enum run_status jit_run_for(machine_state* state, uint64_t max_instructions)
+{
+    state->status = RUN_EXITED;
+    state->retired_limit = max_instructions > UINT64_MAX - state->retired ?
+        UINT64_MAX : state->retired + max_instructions;
+
+    if (!state->program)
+    {
+        decode_program(state);
+    }
+
+    // Guest addresses are baked into the code as 32-bit immediates
+    if (state->program->code_end > INT32_MAX)
+    {
+        return run_for(state, DEFAULT_DISPATCH, max_instructions);
+    }
+
+    if (!state->jit)
+    {
+        jit_context* jit = malloc(sizeof(jit_context));
+
+        if (!jit_init(jit, state))
+        {
+            free(jit);
+            return run_for(state, DEFAULT_DISPATCH, max_instructions);
+        }
+
+        state->jit = jit;
+    }
+
+    jit_context* jit = state->jit;
+    jit_entry enter = (jit_entry)jit->code;
+    unsigned char* link = NULL;
+
+    decoded_instruction* d = decoded_resume(state, state->registers[RIP]);
+
+    while (d)
+    {
+        if (state->program != jit->program ||
+            state->program->generation != jit->generation)
+        {
+            // Code the guest grew for itself past what native code can reach
+            if (state->program->code_end > INT32_MAX)
+            {
+                return interpret_rest(state, d);
+            }
+
+            jit_flush(jit, state->program);
+            link = NULL;
+        }
+
+        // Whatever native code can't handle runs through the interpreter
+        if (!compilable(d))
+        {
+            state->retired += d->weight;
+            d = d->handler(state, d);
+            link = NULL;
+            continue;
+        }
+
+        unsigned char* code = *block_slot(jit, d->rip);
+
+        // Blocks are only written between runs of native code
+        if ((!code || link) && !jit_protect(jit, true))
+        {
+            return interpret_rest(state, d);
+        }
+
+        if (!code)
+        {
+            if (jit->out + JIT_BLOCK_RESERVE > jit->code + JIT_CODE_SIZE)
+            {
+                jit_flush(jit, state->program);
+                link = NULL;
+            }
+
+            code = compile_block(jit, d);
+        }
+
+        // Chain the block we just left straight to this one
+        if (link)
+        {
+            *(int32_t*)link = code - (link + 4);
+        }
+
+        if (!jit_protect(jit, false))
+        {
+            return interpret_rest(state, d);
+        }
+
+        jit_exit result = enter(state, code);
+        link = result.link;
+
+        switch (result.status)
+        {
+            case JIT_EXIT:
+                d = NULL;
+                break;
+
+            case JIT_BUDGET:
+                state->status = RUN_BUDGET;
+                d = NULL;
+                break;
+
+            case JIT_FAULT:
+                state->status = RUN_FAULT;
+                d = NULL;
+                break;
+
+            case JIT_INVALIDATE:
+                decode_program(state);
+                link = NULL;
+                d = decoded_resume(state, state->registers[RIP]);
+                break;
+
+            default:
+                d = decoded_resume(state, state->registers[RIP]);
+                break;
+        }
+    }
+
+    return state->status;
+}
+
+enum run_status jit_run(machine_state* state)
+{
+    return jit_run_for(state, UINT64_MAX);
+}
+
+void jit_free(machine_state* state)
+{
+    if (!state->jit)
+    {
+        return;
+    }
+
+    free(state->jit->blocks);
+    munmap(state->jit->code, JIT_CODE_SIZE);
+    free(state->jit);
+
+    state->jit = NULL;
+}
+
+#else
+
+bool jit_available()
+{
+    return false;
+}
+
+enum run_status jit_run_for(machine_state* state, uint64_t max_instructions)
+{
+    return run_for(state, DEFAULT_DISPATCH, max_instructions);
+}
+
+enum run_status jit_run(machine_state* state)
+{
+    return run(state, DEFAULT_DISPATCH);
+}
+
+void jit_free(machine_state* state)
+{
+}
+
+#endif
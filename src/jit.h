@@ -0,0 +1,15 @@
+#ifndef _JIT_H
+#define _JIT_H
+
+#include "decoder.h"
+
+bool jit_available();
+
+// Same contract as run_for and run. Compiled code is kept in the machine
+// state until jit_free.
+enum run_status jit_run_for(machine_state* state, uint64_t max_instructions);
+enum run_status jit_run(machine_state* state);
+
+void jit_free(machine_state* state);
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef _KEYWORDS_H
+#define _KEYWORDS_H
+
+#include <stdint.h>
+
+#include "shared.h"
+
+// Every word basm knows. gen_keywords turns each list into a perfect hash
+// table (obj/keyword_tables.h) when basm is built, so adding a name here is
+// all it takes.
+#define MNEMONICS(X)                                                          \
+    X(push,  OP_PUSH)                                                         \
+    X(pop,   OP_POP)                                                          \
+    X(jmp,   OP_JMP)                                                          \
+    X(exit,  OP_EXIT)                                                         \
+    X(mov,   OP_MOV)                                                          \
+    X(call,  OP_CALL)                                                         \
+    X(ret,   OP_RET)                                                          \
+    X(add,   OP_ADD)                                                          \
+    X(sub,   OP_SUB)                                                          \
+    X(mul,   OP_MUL)                                                          \
+    X(div,   OP_DIV)                                                          \
+    X(mod,   OP_MOD)                                                          \
+    X(inc,   OP_INC)                                                          \
+    X(dec,   OP_DEC)                                                          \
+    X(cmp,   OP_CMP)                                                          \
+    X(je,    OP_JE)                                                           \
+    X(jne,   OP_JNE)                                                          \
+    X(jl,    OP_JL)                                                           \
+    X(jle,   OP_JLE)                                                          \
+    X(jg,    OP_JG)                                                           \
+    X(jge,   OP_JGE)                                                          \
+    X(print, OP_PRINT)                                                        \
+    X(bcopy, OP_BCOPY)                                                        \
+    X(bfill, OP_BFILL)                                                        \
+    X(bcmp,  OP_BCMP)                                                         \
+    X(bscan, OP_BSCAN)                                                        \
+    X(vload, OP_VLOAD)                                                        \
+    X(vstore, OP_VSTORE)                                                      \
+    X(vsplat, OP_VSPLAT)                                                      \
+    X(vadd,  OP_VADD)                                                         \
+    X(vsub,  OP_VSUB)                                                         \
+    X(vmul,  OP_VMUL)                                                         \
+    X(vmin,  OP_VMIN)                                                         \
+    X(vmax,  OP_VMAX)                                                         \
+    X(vsum,  OP_VSUM)                                                         \
+    X(fadd,  OP_FADD)                                                         \
+    X(fsub,  OP_FSUB)                                                         \
+    X(fmul,  OP_FMUL)                                                         \
+    X(fdiv,  OP_FDIV)                                                         \
+    X(fcmp,  OP_FCMP)                                                         \
+    X(itof,  OP_ITOF)                                                         \
+    X(ftoi,  OP_FTOI)
+
+#define REGISTER_NAMES(X)                                                     \
+    X(r0,   R0)                                                               \
+    X(r1,   R1)                                                               \
+    X(r2,   R2)                                                               \
+    X(r3,   R3)                                                               \
+    X(r4,   R4)                                                               \
+    X(r5,   R5)                                                               \
+    X(rip,  RIP)                                                              \
+    X(rsp,  RSP)                                                              \
+    X(rmem, RMEM)
+
+#define VECTOR_NAMES(X)                                                       \
+    X(v0, V0)                                                                 \
+    X(v1, V1)                                                                 \
+    X(v2, V2)                                                                 \
+    X(v3, V3)                                                                 \
+    X(v4, V4)                                                                 \
+    X(v5, V5)                                                                 \
+    X(v6, V6)                                                                 \
+    X(v7, V7)
+
+#define SIZE_NAMES(X)                                                         \
+    X(byte,  B1)                                                              \
+    X(word,  B2)                                                              \
+    X(dword, B4)                                                              \
+    X(qword, B8)
+
+typedef struct keyword
+{
+    const char* name;
+    int len;
+    unsigned char value;
+} keyword;
+
+// FNV-1a, started from a seed the generator picked so that no two names in
+// a table land in the same slot
+static inline uint32_t keyword_hash(
+        const unsigned char* text,
+        int len,
+        uint32_t seed)
+{
+    uint32_t hash = 0x811c9dc5 ^ seed;
+
+    for (int i = 0; i < len; i++)
+    {
+        hash = (hash ^ text[i]) * 0x01000193;
+    }
+
+    return hash ^ hash >> 15;
+}
+
+#endif
@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libbemu.h"
+#include "assembler.h"
+#include "jit.h"
+
+struct bemu_vm
+{
+    machine_state state;
+    enum bemu_engine engine;
+    bool loaded;
+    char error[IMAGE_ERROR_LEN];
+};
+
+static void clear(bemu_vm* vm)
+{
+    machine_state* state = &vm->state;
+
+    for (int i = 0; i < REGISTER_COUNT; i++)
+    {
+        state->registers[i] = 0;
+    }
+
+    memset(state->vectors, 0, sizeof(state->vectors));
+    state->program = NULL;
+    state->retired = 0;
+    state->output.len = 0;
+    vm->loaded = false;
+}
+
+bemu_vm* bemu_create(const bemu_options* options)
+{
+    bemu_options defaults = {
+        .memory_size = 0,
+        .engine = BEMU_ENGINE_DEFAULT,
+        .binary_output = false,
+        .safe = false
+    };
+
+    if (!options)
+    {
+        options = &defaults;
+    }
+
+    memory_config memory = {
+        .size = options->memory_size ? options->memory_size : MEMORY_SIZE,
+        .huge_pages = HUGE_PAGES_OFF,
+        .safe = options->safe
+    };
+
+    bemu_vm* vm = malloc(sizeof(bemu_vm));
+
+    if (!vm)
+    {
+        return NULL;
+    }
+
+    if (!memory_try_init(&vm->state, &memory))
+    {
+        free(vm);
+        return NULL;
+    }
+    output_init(&vm->state.output, STDOUT_FILENO,
+                options->binary_output ? OUTPUT_BINARY : OUTPUT_TEXT,
+                FLUSH_SIZE);
+
+    vm->engine = options->engine;
+    vm->error[0] = '\0';
+
+    clear(vm);
+
+    return vm;
+}
+
+void bemu_destroy(bemu_vm* vm)
+{
+    output_free(&vm->state.output);
+    jit_free(&vm->state);
+    decoded_program_free(&vm->state);
+    memory_free(&vm->state);
+
+    free(vm);
+}
+
+void bemu_set_output(bemu_vm* vm, bemu_output_fn fn, void* context)
+{
+    output_flush(&vm->state.output);
+
+    vm->state.output.callback = fn;
+    vm->state.output.context = context;
+}
+
+static int loaded(bemu_vm* vm, int result)
+{
+    vm->loaded = result == 0;
+
+    if (result == 0)
+    {
+        vm->error[0] = '\0';
+    }
+
+    return result;
+}
+
+// Guest memory is gone after a failed reset until it can be mapped again.
+// Returns 0, or bemu's exit code for a mapping failure.
+static int remap(bemu_vm* vm)
+{
+    if (vm->state.memory || memory_reset(&vm->state))
+    {
+        return 0;
+    }
+
+    memory_map_error(&vm->state, vm->error);
+
+    return 18;
+}
+
+int bemu_load(bemu_vm* vm, const void* image, size_t len)
+{
+    decoded_program_free(&vm->state);
+
+    int result = remap(vm);
+
+    if (result != 0)
+    {
+        return loaded(vm, result);
+    }
+
+    return loaded(vm, load_image_bytes(image, len, &vm->state, vm->error));
+}
+
+int bemu_load_file(bemu_vm* vm, const char* fn)
+{
+    decoded_program_free(&vm->state);
+
+    int result = remap(vm);
+
+    if (result != 0)
+    {
+        return loaded(vm, result);
+    }
+
+    return loaded(vm, load_image(fn, &vm->state, vm->error));
+}
+
+int bemu_assemble(bemu_vm* vm, const char* source, size_t len)
+{
+    // Source lines are measured in ints
+    if (len > INT_MAX)
+    {
+        decoded_program_free(&vm->state);
+        snprintf(vm->error, sizeof(vm->error), "Source file too big.");
+        return loaded(vm, 1);
+    }
+
+    bstring raw;
+    raw.data = (unsigned char*)source;
+    raw.len = len;
+
+    unsigned char* bytes = NULL;
+    uint64_t bytes_len = 0;
+    int result = assemble_checked(&raw, false, &bytes, &bytes_len, vm->error,
+                                  sizeof(vm->error));
+
+    if (result != 0)
+    {
+        decoded_program_free(&vm->state);
+        return loaded(vm, result);
+    }
+
+    result = bemu_load(vm, bytes, bytes_len);
+
+    free(bytes);
+
+    return result;
+}
+
+int bemu_run_for(bemu_vm* vm, uint64_t max_instructions)
+{
+    if (!vm->loaded)
+    {
+        return -1;
+    }
+
+    machine_state* state = &vm->state;
+    enum run_status status;
+
+    switch (vm->engine)
+    {
+        case BEMU_ENGINE_JIT:
+            status = jit_run_for(state, max_instructions);
+            break;
+
+        case BEMU_ENGINE_CALL:
+            status = run_for(state, DISPATCH_CALL, max_instructions);
+            break;
+
+        case BEMU_ENGINE_GOTO:
+            status = run_for(state, DISPATCH_GOTO, max_instructions);
+            break;
+
+        case BEMU_ENGINE_TAIL:
+            status = run_for(state, DISPATCH_TAIL, max_instructions);
+            break;
+
+        default:
+            status = run_for(state, DEFAULT_DISPATCH, max_instructions);
+            break;
+    }
+
+    output_flush(&state->output);
+
+    // Only a program that ran out of budget can carry on
+    vm->loaded = status == RUN_BUDGET;
+
+    switch (status)
+    {
+        case RUN_BUDGET: return BEMU_BUDGET;
+        case RUN_FAULT:  return BEMU_FAULT;
+        default:         return BEMU_EXITED;
+    }
+}
+
+int bemu_run(bemu_vm* vm)
+{
+    return bemu_run_for(vm, UINT64_MAX);
+}
+
+int bemu_reset(bemu_vm* vm)
+{
+    decoded_program_free(&vm->state);
+
+    bool mapped = memory_reset(&vm->state);
+
+    clear(vm);
+
+    if (!mapped)
+    {
+        memory_map_error(&vm->state, vm->error);
+        return 18;
+    }
+
+    vm->error[0] = '\0';
+
+    return 0;
+}
+
+uint64_t bemu_get_register(bemu_vm* vm, enum bemu_register reg)
+{
+    return vm->state.registers[reg];
+}
+
+void bemu_set_register(bemu_vm* vm, enum bemu_register reg, uint64_t value)
+{
+    vm->state.registers[reg] = value;
+}
+
+uint64_t bemu_retired(bemu_vm* vm)
+{
+    return vm->state.retired;
+}
+
+const char* bemu_error(bemu_vm* vm)
+{
+    return vm->error;
+}
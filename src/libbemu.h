@@ -0,0 +1,109 @@
+#ifndef _LIBBEMU_H
+#define _LIBBEMU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Embedding API for the emulator and assembler. A VM owns its guest memory
+// for its whole life: bemu_reset() wipes it in place so the next program can
+// be loaded without setting anything up again.
+
+// The library is built with hidden visibility; only these are exported
+#define BEMU_API __attribute__((visibility("default")))
+
+typedef struct bemu_vm bemu_vm;
+
+typedef void (*bemu_output_fn)(
+        void* context,
+        const unsigned char* data,
+        size_t len);
+
+enum bemu_engine
+{
+    BEMU_ENGINE_DEFAULT,
+    BEMU_ENGINE_CALL,
+    BEMU_ENGINE_GOTO,
+    // Unoptimised builds run the goto engine instead
+    BEMU_ENGINE_TAIL,
+    BEMU_ENGINE_JIT
+};
+
+// Same numbering as the registers in basm: r0-r5, rip, rsp, rflag, rmem
+enum bemu_register
+{
+    BEMU_R0,
+    BEMU_R1,
+    BEMU_R2,
+    BEMU_R3,
+    BEMU_R4,
+    BEMU_R5,
+    BEMU_RIP,
+    BEMU_RSP,
+    BEMU_RFLAG,
+    BEMU_RMEM
+};
+
+typedef struct
+{
+    // Bytes of guest memory; 0 for the default 32 MiB
+    uint64_t memory_size;
+    enum bemu_engine engine;
+    // Values are written as 8 little-endian bytes instead of lines of text
+    bool binary_output;
+    // Verify programs as they load and fault on out-of-range memory accesses
+    // instead of trusting them; for untrusted code
+    bool safe;
+} bemu_options;
+
+// NULL options get the defaults. Returns NULL if the VM can't be allocated
+// or its guest memory can't be mapped.
+BEMU_API bemu_vm* bemu_create(const bemu_options* options);
+BEMU_API void bemu_destroy(bemu_vm* vm);
+
+// Where print output goes. Without a callback it's written to stdout.
+BEMU_API void bemu_set_output(bemu_vm* vm, bemu_output_fn fn, void* context);
+
+// The loaders return 0, or the status code bemu would exit with and a
+// message from bemu_error(). They replace anything already loaded, but reuse
+// memory the last program dirtied; call bemu_reset() first for a clean slate.
+BEMU_API int bemu_load(bemu_vm* vm, const void* image, size_t len);
+BEMU_API int bemu_load_file(bemu_vm* vm, const char* fn);
+
+// Assembles basm source straight into the VM. Malformed source returns the
+// exit code basm would use, with its message in bemu_error().
+BEMU_API int bemu_assemble(bemu_vm* vm, const char* source, size_t len);
+
+enum bemu_status
+{
+    BEMU_EXITED,
+    BEMU_BUDGET,
+    BEMU_FAULT
+};
+
+// Runs the loaded program until it exits or faults, flushing its output
+// before returning. Returns a bemu_status, or -1 if nothing is loaded.
+BEMU_API int bemu_run(bemu_vm* vm);
+
+// Same, but stops with BEMU_BUDGET after about max_instructions more (it
+// can go over by up to a basic block). Call again to carry on.
+BEMU_API int bemu_run_for(bemu_vm* vm, uint64_t max_instructions);
+
+// Zeroes guest memory and registers and forgets the loaded program, keeping
+// the memory mapping itself for the next run. Returns 0, or bemu's exit code
+// with a message in bemu_error() if the memory couldn't be mapped again; the
+// next load tries again.
+BEMU_API int bemu_reset(bemu_vm* vm);
+
+BEMU_API uint64_t bemu_get_register(bemu_vm* vm, enum bemu_register reg);
+BEMU_API void bemu_set_register(
+        bemu_vm* vm,
+        enum bemu_register reg,
+        uint64_t value);
+
+// Instructions the last run retired
+BEMU_API uint64_t bemu_retired(bemu_vm* vm);
+
+BEMU_API const char* bemu_error(bemu_vm* vm);
+
+#endif
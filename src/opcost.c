@@ -0,0 +1,300 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "opcost.h"
+#include "disassembler.h"
+
+#define OPCOST_CALIBRATION_SAMPLES 1001
+
+#if defined(__linux__)
+
+static int perf_open(uint64_t config, int group)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = group == -1;
+    // Only the guest's handlers are of interest, not the kernel side of the
+    // reads that sample the counters
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static bool perf_init(opcost_table* table)
+{
+    static const uint64_t configs[COST_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+
+    int fds[COST_COUNTERS];
+
+    for (int i = 0; i < COST_COUNTERS; i++)
+    {
+        fds[i] = perf_open(configs[i], i == 0 ? -1 : fds[0]);
+
+        if (fds[i] < 0)
+        {
+            for (int j = 0; j < i; j++)
+            {
+                close(fds[j]);
+            }
+
+            return false;
+        }
+    }
+
+    table->perf_fd = fds[0];
+
+    ioctl(table->perf_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(table->perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+    return true;
+}
+
+#else
+
+static bool perf_init(opcost_table* table)
+{
+    return false;
+}
+
+#endif
+
+static inline uint64_t ticks()
+{
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+static inline void sample(opcost_table* table, int64_t* out)
+{
+    if (table->perf)
+    {
+        // PERF_FORMAT_GROUP: the event count, then each event's value
+        uint64_t values[COST_COUNTERS + 1];
+
+        if (read(table->perf_fd, values, sizeof(values)) ==
+            sizeof(values))
+        {
+            for (int i = 0; i < COST_COUNTERS; i++)
+            {
+                out[i] = values[i + 1];
+            }
+
+            return;
+        }
+    }
+
+    out[COST_CYCLES] = ticks();
+    out[COST_INSTRUCTIONS] = 0;
+    out[COST_BRANCHES] = 0;
+    out[COST_BRANCH_MISSES] = 0;
+}
+
+static int compare_int64(const void* left, const void* right)
+{
+    int64_t l = *(const int64_t*)left;
+    int64_t r = *(const int64_t*)right;
+
+    return (l > r) - (l < r);
+}
+
+// The median cost of two back-to-back samples
+static void calibrate(opcost_table* table)
+{
+    int64_t* deltas[COST_COUNTERS];
+    int64_t before[COST_COUNTERS];
+    int64_t after[COST_COUNTERS];
+
+    for (int c = 0; c < COST_COUNTERS; c++)
+    {
+        deltas[c] = malloc(sizeof(int64_t) * OPCOST_CALIBRATION_SAMPLES);
+    }
+
+    for (int i = 0; i < OPCOST_CALIBRATION_SAMPLES; i++)
+    {
+        sample(table, before);
+        sample(table, after);
+
+        for (int c = 0; c < COST_COUNTERS; c++)
+        {
+            deltas[c][i] = after[c] - before[c];
+        }
+    }
+
+    for (int c = 0; c < COST_COUNTERS; c++)
+    {
+        qsort(deltas[c], OPCOST_CALIBRATION_SAMPLES, sizeof(int64_t),
+              compare_int64);
+
+        table->overhead[c] = deltas[c][OPCOST_CALIBRATION_SAMPLES / 2];
+
+        free(deltas[c]);
+    }
+}
+
+void opcost_init(opcost_table* table)
+{
+    memset(table, 0, sizeof(opcost_table));
+
+    table->perf_fd = -1;
+    table->perf = perf_init(table);
+
+    calibrate(table);
+}
+
+void opcost_free(opcost_table* table)
+{
+    if (table->perf)
+    {
+        close(table->perf_fd);
+    }
+}
+
+enum run_status opcost_run(machine_state* state, opcost_table* table)
+{
+    int64_t before[COST_COUNTERS];
+    int64_t after[COST_COUNTERS];
+
+    state->status = RUN_EXITED;
+
+    sample(table, before);
+
+    while (true)
+    {
+        uint64_t rip = state->registers[RIP];
+
+        if (rip > state->memory_size - sizeof(instruction) ||
+            state->memory[rip] >= OPCODE_COUNT)
+        {
+            state->status = RUN_FAULT;
+            break;
+        }
+
+        opcost* cost = &table->opcodes[state->memory[rip]];
+        bool running = execute(state);
+
+        sample(table, after);
+
+        cost->count++;
+
+        for (int c = 0; c < COST_COUNTERS; c++)
+        {
+            cost->totals[c] += after[c] - before[c] - table->overhead[c];
+            before[c] = after[c];
+        }
+
+        if (!running)
+        {
+            break;
+        }
+    }
+
+    return state->status;
+}
+
+static int compare_cycles(const void* left, const void* right)
+{
+    const opcost* l = *(const opcost* const*)left;
+    const opcost* r = *(const opcost* const*)right;
+
+    return compare_int64(&r->totals[COST_CYCLES], &l->totals[COST_CYCLES]);
+}
+
+void opcost_report(opcost_table* table, FILE* out)
+{
+    opcost* sorted[OPCODE_COUNT];
+
+    for (int i = 0; i < OPCODE_COUNT; i++)
+    {
+        sorted[i] = &table->opcodes[i];
+    }
+
+    qsort(sorted, OPCODE_COUNT, sizeof(opcost*), compare_cycles);
+
+    if (table->perf)
+    {
+        fprintf(out, "Host costs from perf_event (user mode), less %lld "
+                "cycles of measuring overhead per instruction\n",
+                (long long)table->overhead[COST_CYCLES]);
+    }
+    else
+    {
+#if defined(__x86_64__)
+        fprintf(out, "Host costs from rdtsc (perf_event unavailable), ");
+#else
+        fprintf(out, "Host costs in nanoseconds (perf_event unavailable), ");
+#endif
+        fprintf(out, "less %lld of measuring overhead per instruction\n",
+                (long long)table->overhead[COST_CYCLES]);
+    }
+
+    fprintf(out, "%-8s %12s %14s %10s %10s %10s\n", "opcode", "count",
+            "cycles", "cycles/op", "instrs/op", "br-miss %");
+
+    for (int i = 0; i < OPCODE_COUNT; i++)
+    {
+        opcost* cost = sorted[i];
+
+        if (!cost->count)
+        {
+            continue;
+        }
+
+        int64_t cycles = cost->totals[COST_CYCLES] > 0 ?
+            cost->totals[COST_CYCLES] : 0;
+
+        fprintf(out, "%-8s %12llu %14lld %10.1f ",
+                opcode_to_string(cost - table->opcodes), cost->count,
+                (long long)cycles, (double)cycles / cost->count);
+
+        if (table->perf)
+        {
+            fprintf(out, "%10.1f ",
+                    (double)cost->totals[COST_INSTRUCTIONS] / cost->count);
+
+            // Misses out of the host's own branches, not per guest op
+            if (cost->totals[COST_BRANCHES] > 0)
+            {
+                fprintf(out, "%10.2f\n",
+                        100.0 * cost->totals[COST_BRANCH_MISSES] /
+                        cost->totals[COST_BRANCHES]);
+            }
+            else
+            {
+                fprintf(out, "%10s\n", "-");
+            }
+        }
+        else
+        {
+            fprintf(out, "%10s %10s\n", "-", "-");
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef _OPCOST_H
+#define _OPCOST_H
+
+#include "emulator.h"
+
+enum opcost_counter
+{
+    COST_CYCLES,
+    COST_INSTRUCTIONS,
+    COST_BRANCHES,
+    COST_BRANCH_MISSES,
+    COST_COUNTERS
+};
+
+typedef struct
+{
+    uint64_t count;
+    int64_t totals[COST_COUNTERS];
+} opcost;
+
+// Host cost of each guest opcode on the reference interpreter. Hardware
+// counters come from perf_event_open when the kernel allows it; otherwise
+// only cycles are measured, with rdtsc (or the monotonic clock off x86).
+typedef struct
+{
+    bool perf;
+    int perf_fd;
+    // What reading the counters costs by itself, taken off every sample
+    int64_t overhead[COST_COUNTERS];
+    opcost opcodes[OPCODE_COUNT];
+} opcost_table;
+
+void opcost_init(opcost_table* table);
+void opcost_free(opcost_table* table);
+
+// Runs the guest to the end one execute() at a time, reading the counters
+// around every instruction. This is far slower than a normal run.
+enum run_status opcost_run(machine_state* state, opcost_table* table);
+
+// Writes a row per opcode that ran, most expensive first
+void opcost_report(opcost_table* table, FILE* out);
+
+#endif
@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "output.h"
+
+#define MAX_DECIMAL_DIGITS 20
+
+static const char digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Writes value in decimal ending just before end, two digits at a time.
+// Returns where the digits start.
+static unsigned char* format_decimal(unsigned char* end, uint64_t value)
+{
+    while (value >= 100)
+    {
+        unsigned pair = (value % 100) * 2;
+        value /= 100;
+
+        *(--end) = digit_pairs[pair + 1];
+        *(--end) = digit_pairs[pair];
+    }
+
+    if (value >= 10)
+    {
+        *(--end) = digit_pairs[value * 2 + 1];
+        *(--end) = digit_pairs[value * 2];
+    }
+    else
+    {
+        *(--end) = '0' + value;
+    }
+
+    return end;
+}
+
+void output_init(
+        output_sink* out,
+        int fd,
+        enum output_format format,
+        enum output_flush flush)
+{
+    out->fd = fd;
+    out->callback = NULL;
+    out->context = NULL;
+    out->format = format;
+    out->flush = flush;
+    out->prefix = "";
+    out->suffix = "";
+    out->capacity = OUTPUT_BUFFER_SIZE;
+    out->buffer = malloc(out->capacity);
+    out->len = 0;
+}
+
+void output_flush(output_sink* out)
+{
+    if (out->callback && out->len)
+    {
+        out->callback(out->context, out->buffer, out->len);
+        out->len = 0;
+        return;
+    }
+
+    if (out->fd < 0 || out->len == 0)
+    {
+        return;
+    }
+
+    // Keep our bytes in order with anything already printed through stdio
+    if (out->fd == STDOUT_FILENO)
+    {
+        fflush(stdout);
+    }
+
+    size_t written = 0;
+
+    while (written < out->len)
+    {
+        ssize_t count = write(out->fd, out->buffer + written,
+                              out->len - written);
+
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (count <= 0)
+        {
+            break;
+        }
+
+        written += count;
+    }
+
+    out->len = 0;
+}
+
+// Makes room for size more bytes, either by flushing or, when everything is
+// held until exit, by growing the buffer
+static void output_reserve(output_sink* out, size_t size)
+{
+    if (out->len + size <= out->capacity)
+    {
+        return;
+    }
+
+    if (out->flush != FLUSH_EXIT)
+    {
+        output_flush(out);
+    }
+
+    while (out->len + size > out->capacity)
+    {
+        out->capacity *= 2;
+        out->buffer = realloc(out->buffer, out->capacity);
+    }
+}
+
+static void output_bytes(output_sink* out, const char* data, size_t size)
+{
+    output_reserve(out, size);
+
+    memcpy(out->buffer + out->len, data, size);
+    out->len += size;
+}
+
+void output_value(output_sink* out, uint64_t value)
+{
+    if (out->format == OUTPUT_BINARY)
+    {
+        output_reserve(out, sizeof(value));
+
+        for (int shift = 0; shift <= 56; shift += 8)
+        {
+            out->buffer[out->len++] = (value >> shift) & 0xff;
+        }
+    }
+    else
+    {
+        if (*out->prefix)
+        {
+            output_bytes(out, out->prefix, strlen(out->prefix));
+        }
+
+        output_reserve(out, MAX_DECIMAL_DIGITS);
+
+        unsigned char digits[MAX_DECIMAL_DIGITS];
+        unsigned char* end = digits + MAX_DECIMAL_DIGITS;
+        unsigned char* start = format_decimal(end, value);
+
+        memcpy(out->buffer + out->len, start, end - start);
+        out->len += end - start;
+
+        if (*out->suffix)
+        {
+            output_bytes(out, out->suffix, strlen(out->suffix));
+        }
+
+        output_bytes(out, "\n", 1);
+    }
+
+    if (out->flush == FLUSH_LINE)
+    {
+        output_flush(out);
+    }
+}
+
+unsigned char* output_take(output_sink* out, size_t* out_len)
+{
+    unsigned char* buffer = out->buffer;
+    *out_len = out->len;
+
+    out->capacity = OUTPUT_BUFFER_SIZE;
+    out->buffer = malloc(out->capacity);
+    out->len = 0;
+
+    return buffer;
+}
+
+void output_free(output_sink* out)
+{
+    output_flush(out);
+
+    free(out->buffer);
+    out->buffer = NULL;
+}
+
+bool output_format_from_string(const char* name, enum output_format* out)
+{
+    if      (!strcmp(name, "text"))   { *out = OUTPUT_TEXT;   }
+    else if (!strcmp(name, "binary")) { *out = OUTPUT_BINARY; }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool output_flush_from_string(const char* name, enum output_flush* out)
+{
+    if      (!strcmp(name, "exit")) { *out = FLUSH_EXIT; }
+    else if (!strcmp(name, "size")) { *out = FLUSH_SIZE; }
+    else if (!strcmp(name, "line")) { *out = FLUSH_LINE; }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
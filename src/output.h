@@ -0,0 +1,63 @@
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+enum output_format
+{
+    OUTPUT_TEXT,
+    OUTPUT_BINARY
+};
+
+enum output_flush
+{
+    FLUSH_EXIT,
+    FLUSH_SIZE,
+    FLUSH_LINE
+};
+
+typedef void (*output_callback)(
+        void* context,
+        const unsigned char* data,
+        size_t len);
+
+// Where a VM's print instructions go. Text mode writes prefix, the value in
+// decimal, suffix and a newline; binary mode writes each value as 8
+// little-endian bytes. Flushes go to callback when one is set, otherwise to
+// fd; a negative fd keeps everything in the buffer.
+typedef struct
+{
+    int fd;
+    output_callback callback;
+    void* context;
+    enum output_format format;
+    enum output_flush flush;
+    const char* prefix;
+    const char* suffix;
+    unsigned char* buffer;
+    size_t len;
+    size_t capacity;
+} output_sink;
+
+void output_init(
+        output_sink* out,
+        int fd,
+        enum output_format format,
+        enum output_flush flush);
+
+void output_value(output_sink* out, uint64_t value);
+void output_flush(output_sink* out);
+void output_free(output_sink* out);
+
+// Hands over everything buffered so far (the caller frees it) and starts the
+// sink on a fresh buffer
+unsigned char* output_take(output_sink* out, size_t* out_len);
+
+bool output_format_from_string(const char* name, enum output_format* out);
+bool output_flush_from_string(const char* name, enum output_flush* out);
+
+#endif
@@ -0,0 +1,357 @@
+#include <string.h>
+
+#include "peephole.h"
+
+// Passes repeat until one changes nothing. Folds are done whole in a single
+// pass, so it's rare to need more than two or three.
+#define PEEPHOLE_MAX_PASSES 16
+
+static bool is_constant(instruction* inst, int ordinal)
+{
+    return inst->operand_types[ordinal] == (IMMEDIATE | LITERAL);
+}
+
+static bool is_register(instruction* inst, int ordinal, unsigned char reg)
+{
+    complex_operand* comp = (complex_operand*)&inst->operands[ordinal];
+
+    return inst->operand_types[ordinal] == (REGISTER | LITERAL) &&
+           comp->base == reg;
+}
+
+static unsigned char register_of(instruction* inst, int ordinal)
+{
+    return ((complex_operand*)&inst->operands[ordinal])->base;
+}
+
+static bool reads_rip(instruction* inst)
+{
+    for (int i = 0; i < operands[inst->opcode]; i++)
+    {
+        complex_operand* comp = (complex_operand*)&inst->operands[i];
+
+        // Vector register numbers aren't general registers
+        if (operand_role(inst->opcode, i) == ROLE_VECTOR)
+        {
+            continue;
+        }
+
+        if ((inst->operand_types[i] & REGISTER) &&
+            (comp->base == RIP ||
+             (comp->register2_sign && comp->register2 == RIP)))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Index of the instruction at address, where count is the end of the code,
+// or -1 if no instruction starts there
+static int64_t index_of(uint64_t* offsets, int64_t count, uint64_t address)
+{
+    int64_t low = 0;
+    int64_t high = count;
+
+    while (low < high)
+    {
+        int64_t middle = low + (high - low) / 2;
+
+        if (offsets[middle] < address)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    return offsets[low] == address ? low : -1;
+}
+
+static void find_offsets(vec_instruction* instructions, uint64_t* offsets)
+{
+    offsets[0] = 0;
+
+    for (uint64_t i = 0; i < instructions->len; i++)
+    {
+        offsets[i + 1] = offsets[i] + instruction_encoded_len(
+                operands[instructions->items[i].opcode]);
+    }
+}
+
+// add x 1 and sub x 1 are inc x and dec x at every size
+static bool make_unary(instruction* inst)
+{
+    if ((inst->opcode != OP_ADD && inst->opcode != OP_SUB) ||
+        !is_constant(inst, 1) || inst->operands[1] != 1)
+    {
+        return false;
+    }
+
+    inst->opcode = inst->opcode == OP_ADD ? OP_INC : OP_DEC;
+    inst->operand_types[1] = 0;
+    inst->operands[1] = 0;
+
+    return true;
+}
+
+// Only at B8, since narrower stores to a register clear its upper bytes
+static bool is_noop(instruction* inst)
+{
+    if (inst->size != B8 || !is_register(inst, 0, register_of(inst, 0)))
+    {
+        return false;
+    }
+
+    switch (inst->opcode)
+    {
+        case OP_MOV:
+            return is_register(inst, 1, register_of(inst, 0));
+
+        case OP_ADD:
+        case OP_SUB:
+            return is_constant(inst, 1) && inst->operands[1] == 0;
+
+        case OP_MUL:
+            return is_constant(inst, 1) && inst->operands[1] == 1;
+
+        default:
+            return false;
+    }
+}
+
+// Folds next into a mov of a constant to the same register just before it
+static bool fold(instruction* into, instruction* next)
+{
+    unsigned char reg = register_of(into, 0);
+
+    if (into->opcode != OP_MOV || into->size != B8 ||
+        !is_register(into, 0, reg) || !is_constant(into, 1) ||
+        next->size != B8 || !is_register(next, 0, reg))
+    {
+        return false;
+    }
+
+    uint64_t* value = &into->operands[1];
+
+    switch (next->opcode)
+    {
+        case OP_INC: *value += 1; return true;
+        case OP_DEC: *value -= 1; return true;
+        default: break;
+    }
+
+    if (!is_constant(next, 1))
+    {
+        return false;
+    }
+
+    switch (next->opcode)
+    {
+        case OP_MOV: *value = next->operands[1]; return true;
+        case OP_ADD: *value += next->operands[1]; return true;
+        case OP_SUB: *value -= next->operands[1]; return true;
+        case OP_MUL: *value *= next->operands[1]; return true;
+        default: return false;
+    }
+}
+
+// Instructions control can reach other than from the one before: the entry
+// point, jump and call targets, and the instructions calls return to
+static void find_entered(
+        vec_instruction* instructions,
+        int64_t* targets,
+        int64_t entry,
+        bool* entered)
+{
+    memset(entered, 0, sizeof(bool) * (instructions->len + 1));
+    entered[entry] = true;
+
+    for (uint64_t i = 0; i < instructions->len; i++)
+    {
+        if (targets[i] >= 0)
+        {
+            entered[targets[i]] = true;
+        }
+
+        if (instructions->items[i].opcode == OP_CALL)
+        {
+            entered[i + 1] = true;
+        }
+    }
+}
+
+static bool run_pass(
+        vec_instruction* instructions,
+        int64_t* targets,
+        bool* entered,
+        bool* removed)
+{
+    bool changed = false;
+    int64_t count = instructions->len;
+
+    for (int64_t i = 0; i < count; i++)
+    {
+        removed[i] = false;
+    }
+
+    for (int64_t i = 0; i < count; i++)
+    {
+        instruction* inst = &instructions->items[i];
+
+        if (removed[i])
+        {
+            continue;
+        }
+
+        changed |= make_unary(inst);
+
+        if (is_noop(inst))
+        {
+            removed[i] = changed = true;
+            continue;
+        }
+
+        // Jumps to a jmp go straight to where it goes
+        int64_t target = targets[i];
+
+        if (target >= 0 && target < count &&
+            instructions->items[target].opcode == OP_JMP &&
+            targets[target] != target)
+        {
+            targets[i] = targets[target];
+            changed = true;
+        }
+
+        if (is_jump(inst->opcode) && targets[i] == i + 1)
+        {
+            removed[i] = changed = true;
+            continue;
+        }
+
+        for (int64_t j = i + 1; j < count && !entered[j] &&
+             fold(inst, &instructions->items[j]); j++)
+        {
+            removed[j] = changed = true;
+        }
+    }
+
+    return changed;
+}
+
+// Removed instructions did nothing, so anything that went to one now goes to
+// the instruction after it
+static void compact(
+        vec_instruction* instructions,
+        int64_t* targets,
+        int64_t* entry,
+        bool* removed,
+        int64_t* new_index)
+{
+    int64_t count = instructions->len;
+    int64_t live = 0;
+
+    for (int64_t i = 0; i < count; i++)
+    {
+        new_index[i] = live;
+
+        if (!removed[i])
+        {
+            instructions->items[live] = instructions->items[i];
+            targets[live] = targets[i];
+            live++;
+        }
+    }
+
+    new_index[count] = live;
+
+    for (int64_t i = 0; i < live; i++)
+    {
+        if (targets[i] >= 0)
+        {
+            targets[i] = new_index[targets[i]];
+        }
+    }
+
+    *entry = new_index[*entry];
+    instructions->len = live;
+}
+
+bool peephole_optimize(
+        arena* a,
+        vec_instruction* instructions,
+        uint64_t* entry_point)
+{
+    int64_t count = instructions->len;
+    uint64_t* offsets = arena_alloc(a, sizeof(uint64_t) * (count + 1));
+    int64_t* targets = arena_alloc(a, sizeof(int64_t) * (count + 1));
+    int64_t* new_index = arena_alloc(a, sizeof(int64_t) * (count + 1));
+    bool* entered = arena_alloc(a, sizeof(bool) * (count + 1));
+    bool* removed = arena_alloc(a, sizeof(bool) * (count + 1));
+
+    // While the passes run, code addresses are instruction indices
+    find_offsets(instructions, offsets);
+
+    for (int64_t i = 0; i < count; i++)
+    {
+        instruction* inst = &instructions->items[i];
+
+        if (reads_rip(inst))
+        {
+            return false;
+        }
+
+        targets[i] = -1;
+
+        if (is_jump(inst->opcode) || inst->opcode == OP_CALL)
+        {
+            if (!is_constant(inst, 0))
+            {
+                return false;
+            }
+
+            targets[i] = index_of(offsets, count, inst->operands[0]);
+
+            if (targets[i] < 0)
+            {
+                return false;
+            }
+        }
+    }
+
+    int64_t entry = index_of(offsets, count, *entry_point);
+
+    if (entry < 0)
+    {
+        return false;
+    }
+
+    for (int pass = 0; pass < PEEPHOLE_MAX_PASSES; pass++)
+    {
+        find_entered(instructions, targets, entry, entered);
+
+        if (!run_pass(instructions, targets, entered, removed))
+        {
+            break;
+        }
+
+        compact(instructions, targets, &entry, removed, new_index);
+    }
+
+    find_offsets(instructions, offsets);
+
+    for (uint64_t i = 0; i < instructions->len; i++)
+    {
+        if (targets[i] >= 0)
+        {
+            instructions->items[i].operands[0] = offsets[targets[i]];
+        }
+    }
+
+    *entry_point = offsets[entry];
+
+    return true;
+}
@@ -0,0 +1,17 @@
+#ifndef _PEEPHOLE_H
+#define _PEEPHOLE_H
+
+#include "arena.h"
+#include "shared.h"
+
+// basm -O. Rewrites an assembled program in place into one that does the
+// same with fewer instructions, and moves jump, call and entry point
+// addresses to match. Programs that read rip or call through a register are
+// left alone, since they can see code addresses the pass would change.
+// Returns whether it ran.
+bool peephole_optimize(
+        arena* a,
+        vec_instruction* instructions,
+        uint64_t* entry_point);
+
+#endif
@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+#include "disassembler.h"
+
+void profile_init(profile* prof, machine_state* state)
+{
+    uint64_t code_bytes = *(uint64_t*)(state->memory + IMG_HDR_CODE_BYTES);
+
+    prof->slot_count = code_bytes / 8;
+    prof->counts = calloc(prof->slot_count + 1, sizeof(uint64_t));
+    prof->taken = calloc(prof->slot_count + 1, sizeof(uint64_t));
+}
+
+void profile_free(profile* prof)
+{
+    free(prof->counts);
+    free(prof->taken);
+}
+
+static bool taken(unsigned char opcode, int64_t rflag)
+{
+    switch (opcode)
+    {
+        case OP_JE:  return rflag == 0;
+        case OP_JNE: return rflag != 0;
+        case OP_JL:  return rflag <  0;
+        case OP_JLE: return rflag <= 0;
+        case OP_JG:  return rflag >  0;
+        case OP_JGE: return rflag >= 0;
+        default:     return false;
+    }
+}
+
+enum run_status profile_run(machine_state* state, profile* prof)
+{
+    state->status = RUN_EXITED;
+    state->retired_limit = UINT64_MAX;
+
+    if (!state->program)
+    {
+        decode_program(state);
+    }
+
+    decoded_instruction* d = decoded_resume(state, state->registers[RIP]);
+
+    while (d)
+    {
+        // A fused entry runs the instructions after it too, and only the
+        // last of those can be a jump. Everything needed from the entries is
+        // read up front: a write into the code frees them.
+        int weight = d->weight;
+        uint64_t slot = (d->rip - IMG_HDR_LEN) / 8;
+        unsigned char last_opcode = 0;
+
+        for (int i = 0; i < weight; i++)
+        {
+            slot = (d[i].rip - IMG_HDR_LEN) / 8;
+            last_opcode = d[i].opcode;
+
+            if (slot < (uint64_t)prof->slot_count)
+            {
+                prof->counts[slot]++;
+            }
+        }
+
+        state->retired += weight;
+        d = d->handler(state, d);
+
+        // Jumps leave rflag alone, so it still says which way this one went
+        if (weight && slot < (uint64_t)prof->slot_count &&
+            taken(last_opcode, state->registers[RFLAG]))
+        {
+            prof->taken[slot]++;
+        }
+    }
+
+    return state->status;
+}
+
+static void instruction_to_string(instruction* inst, char* out)
+{
+    if (inst->opcode >= OPCODE_COUNT)
+    {
+        strcpy(out, "(overwritten)");
+        return;
+    }
+
+    out += sprintf(out, "%s", opcode_to_string(inst->opcode));
+
+    if (inst->size != B8)
+    {
+        out += sprintf(out, " %s", size_to_string(inst->size));
+    }
+
+    char buffer[DEBUG_STR_LEN];
+
+    for (int i = 0; i < operands[inst->opcode]; i++)
+    {
+        operand_to_string(inst, i, buffer);
+        out += sprintf(out, " %s", buffer);
+    }
+}
+
+typedef struct
+{
+    uint64_t count;
+    int index;
+} profile_row;
+
+static int compare_rows(const void* left, const void* right)
+{
+    const profile_row* l = left;
+    const profile_row* r = right;
+
+    if (l->count != r->count)
+    {
+        return l->count < r->count ? 1 : -1;
+    }
+
+    return l->index - r->index;
+}
+
+void profile_report(profile* prof, machine_state* state, FILE* out)
+{
+    profile_row* rows = malloc(sizeof(profile_row) * (prof->slot_count + 1));
+    int row_count = 0;
+
+    profile_row opcodes[OPCODE_COUNT];
+    uint64_t total = 0;
+
+    for (int i = 0; i < OPCODE_COUNT; i++)
+    {
+        opcodes[i].count = 0;
+        opcodes[i].index = i;
+    }
+
+    for (int i = 0; i < prof->slot_count; i++)
+    {
+        if (!prof->counts[i])
+        {
+            continue;
+        }
+
+        rows[row_count].count = prof->counts[i];
+        rows[row_count].index = i;
+        row_count++;
+
+        total += prof->counts[i];
+
+        unsigned char opcode = state->memory[IMG_HDR_LEN + i * 8];
+
+        if (opcode < OPCODE_COUNT)
+        {
+            opcodes[opcode].count += prof->counts[i];
+        }
+    }
+
+    qsort(rows, row_count, sizeof(profile_row), compare_rows);
+    qsort(opcodes, OPCODE_COUNT, sizeof(profile_row), compare_rows);
+
+    fprintf(out, "%12s %6s %12s %12s %8s  %s\n", "count", "%", "taken",
+            "not taken", "rip", "instruction");
+
+    char text[DEBUG_STR_LEN * (MAX_OPERANDS + 1)];
+
+    for (int i = 0; i < row_count; i++)
+    {
+        uint64_t rip = IMG_HDR_LEN + rows[i].index * 8;
+        instruction* inst = (instruction*)(state->memory + rip);
+
+        instruction_to_string(inst, text);
+
+        fprintf(out, "%12llu %6.2f ", rows[i].count,
+                100.0 * rows[i].count / total);
+
+        if (is_conditional_jump(inst->opcode))
+        {
+            uint64_t taken_count = prof->taken[rows[i].index];
+
+            fprintf(out, "%12llu %12llu ", taken_count,
+                    rows[i].count - taken_count);
+        }
+        else
+        {
+            fprintf(out, "%12s %12s ", "", "");
+        }
+
+        fprintf(out, "%8llu  %s\n", rip, text);
+    }
+
+    fprintf(out, "\n%12s %6s  %s\n", "count", "%", "opcode");
+
+    for (int i = 0; i < OPCODE_COUNT && opcodes[i].count; i++)
+    {
+        fprintf(out, "%12llu %6.2f  %s\n", opcodes[i].count,
+                100.0 * opcodes[i].count / total,
+                opcode_to_string(opcodes[i].index));
+    }
+
+    fprintf(out, "%12llu %6s  total\n", total, "");
+
+    // Raw steps the decoder took outside its decoded code
+    if (state->retired > total)
+    {
+        fprintf(out, "%12llu %6s  not attributed\n", state->retired - total,
+                "");
+    }
+
+    free(rows);
+}
@@ -0,0 +1,30 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include "decoder.h"
+
+// Exact execution counts for a guest program. Instructions start on 8-byte
+// boundaries, so each counter is indexed by the instruction's slot in the
+// code section: (rip - IMG_HDR_LEN) / 8.
+typedef struct
+{
+    int slot_count;
+    uint64_t* counts;
+    // Taken conditional jumps; not taken is counts minus taken
+    uint64_t* taken;
+} profile;
+
+void profile_init(profile* prof, machine_state* state);
+void profile_free(profile* prof);
+
+// Runs the guest to the end like run(), counting every instruction it
+// executes from decoded code. The rare raw steps the decoder falls back on
+// (jumps into the middle of an instruction, code past what could be decoded)
+// are only counted in the total.
+enum run_status profile_run(machine_state* state, profile* prof);
+
+// Writes every instruction that ran, most executed first, then the totals
+// per opcode
+void profile_report(profile* prof, machine_state* state, FILE* out);
+
+#endif
@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "scheduler.h"
+#include "jit.h"
+
+typedef struct guest
+{
+    machine_state* state;
+    guest_finished finished;
+    void* context;
+    struct guest* next;
+} guest;
+
+struct scheduler
+{
+    uint64_t slice;
+    enum dispatch_mode dispatch;
+    bool jit;
+
+    pthread_t* threads;
+    int thread_count;
+
+    pthread_mutex_t lock;
+    // Signalled when a guest is queued or the workers should stop
+    pthread_cond_t runnable;
+    // Signalled when the last live guest finishes
+    pthread_cond_t idle;
+
+    guest* head;
+    guest* tail;
+    int live;
+    bool stopping;
+};
+
+// Callers hold the lock
+static void enqueue(scheduler* sched, guest* g)
+{
+    g->next = NULL;
+
+    if (sched->tail)
+    {
+        sched->tail->next = g;
+    }
+    else
+    {
+        sched->head = g;
+    }
+
+    sched->tail = g;
+
+    pthread_cond_signal(&sched->runnable);
+}
+
+static guest* dequeue(scheduler* sched)
+{
+    pthread_mutex_lock(&sched->lock);
+
+    while (!sched->head && !sched->stopping)
+    {
+        pthread_cond_wait(&sched->runnable, &sched->lock);
+    }
+
+    guest* g = sched->head;
+
+    if (g)
+    {
+        sched->head = g->next;
+
+        if (!sched->head)
+        {
+            sched->tail = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&sched->lock);
+
+    return g;
+}
+
+static void* worker_main(void* arg)
+{
+    scheduler* sched = arg;
+    guest* g;
+
+    while ((g = dequeue(sched)))
+    {
+        enum run_status status = sched->jit ?
+            jit_run_for(g->state, sched->slice) :
+            run_for(g->state, sched->dispatch, sched->slice);
+
+        if (status == RUN_BUDGET)
+        {
+            pthread_mutex_lock(&sched->lock);
+            enqueue(sched, g);
+            pthread_mutex_unlock(&sched->lock);
+            continue;
+        }
+
+        g->finished(g->state, status, g->context);
+        free(g);
+
+        pthread_mutex_lock(&sched->lock);
+
+        if (--sched->live == 0)
+        {
+            pthread_cond_broadcast(&sched->idle);
+        }
+
+        pthread_mutex_unlock(&sched->lock);
+    }
+
+    return NULL;
+}
+
+scheduler* scheduler_create(
+        int threads,
+        uint64_t slice,
+        enum dispatch_mode dispatch,
+        bool jit)
+{
+    scheduler* sched = malloc(sizeof(scheduler));
+
+    sched->slice = slice;
+    sched->dispatch = dispatch;
+    sched->jit = jit;
+    sched->head = NULL;
+    sched->tail = NULL;
+    sched->live = 0;
+    sched->stopping = false;
+
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->runnable, NULL);
+    pthread_cond_init(&sched->idle, NULL);
+
+    sched->thread_count = threads;
+    sched->threads = malloc(sizeof(pthread_t) * threads);
+
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_create(&sched->threads[i], NULL, worker_main, sched);
+    }
+
+    return sched;
+}
+
+void scheduler_add(
+        scheduler* sched,
+        machine_state* state,
+        guest_finished finished,
+        void* context)
+{
+    guest* g = malloc(sizeof(guest));
+    g->state = state;
+    g->finished = finished;
+    g->context = context;
+
+    pthread_mutex_lock(&sched->lock);
+    sched->live++;
+    enqueue(sched, g);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void scheduler_wait(scheduler* sched)
+{
+    pthread_mutex_lock(&sched->lock);
+
+    while (sched->live > 0)
+    {
+        pthread_cond_wait(&sched->idle, &sched->lock);
+    }
+
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void scheduler_free(scheduler* sched)
+{
+    scheduler_wait(sched);
+
+    pthread_mutex_lock(&sched->lock);
+    sched->stopping = true;
+    pthread_cond_broadcast(&sched->runnable);
+    pthread_mutex_unlock(&sched->lock);
+
+    for (int i = 0; i < sched->thread_count; i++)
+    {
+        pthread_join(sched->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&sched->idle);
+    pthread_cond_destroy(&sched->runnable);
+    pthread_mutex_destroy(&sched->lock);
+
+    free(sched->threads);
+    free(sched);
+}
@@ -0,0 +1,38 @@
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include "decoder.h"
+
+// Called on a worker thread once a guest exits or faults. The guest is no
+// longer the scheduler's to touch, so this may free it.
+typedef void (*guest_finished)(
+        machine_state* state,
+        enum run_status status,
+        void* context);
+
+typedef struct scheduler scheduler;
+
+// Time slices many guests across a fixed pool of threads. Runnable guests
+// wait in one FIFO queue; a worker takes the guest at the front, runs it for
+// slice instructions and puts it at the back if it isn't done, so every
+// guest gets the same share and none can starve the rest.
+scheduler* scheduler_create(
+        int threads,
+        uint64_t slice,
+        enum dispatch_mode dispatch,
+        bool jit);
+
+// The guest must be loaded and ready to run
+void scheduler_add(
+        scheduler* sched,
+        machine_state* state,
+        guest_finished finished,
+        void* context);
+
+// Blocks until every guest added so far has finished
+void scheduler_wait(scheduler* sched);
+
+// Waits for the guests, then stops the workers
+void scheduler_free(scheduler* sched);
+
+#endif
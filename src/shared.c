@@ -1,40 +1,61 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "shared.h"
 
 VECTOR_C(instruction);
 
-int operands[OPCODE_COUNT];
+const int operands[OPCODE_COUNT] = {
+    [OP_MOV]    = 2,
+    [OP_ADD]    = 2,
+    [OP_SUB]    = 2,
+    [OP_MUL]    = 2,
+    [OP_DIV]    = 2,
+    [OP_MOD]    = 2,
+    [OP_CMP]    = 2,
+    [OP_BCOPY]  = 2,
+    [OP_BFILL]  = 2,
+    [OP_BCMP]   = 2,
+    [OP_BSCAN]  = 2,
+    [OP_VLOAD]  = 2,
+    [OP_VSTORE] = 2,
+    [OP_VSPLAT] = 2,
+    [OP_VADD]   = 2,
+    [OP_VSUB]   = 2,
+    [OP_VMUL]   = 2,
+    [OP_VMIN]   = 2,
+    [OP_VMAX]   = 2,
+    [OP_VSUM]   = 2,
+    [OP_FADD]   = 2,
+    [OP_FSUB]   = 2,
+    [OP_FMUL]   = 2,
+    [OP_FDIV]   = 2,
+    [OP_FCMP]   = 2,
+    [OP_ITOF]   = 2,
+    [OP_FTOI]   = 2,
 
-void operands_init()
-{
-    operands[OP_MOV]   = 2;
-    operands[OP_ADD]   = 2;
-    operands[OP_SUB]   = 2;
-    operands[OP_MUL]   = 2;
-    operands[OP_DIV]   = 2;
-    operands[OP_MOD]   = 2;
-    operands[OP_CMP]   = 2;
-
-    operands[OP_PUSH]  = 1;
-    operands[OP_POP]   = 1;
-    operands[OP_JMP]   = 1;
-    operands[OP_CALL]  = 1;
-    operands[OP_INC]   = 1;
-    operands[OP_DEC]   = 1;
-    operands[OP_JE]    = 1;
-    operands[OP_JNE]   = 1;
-    operands[OP_JL]    = 1;
-    operands[OP_JG]    = 1;
-    operands[OP_JLE]   = 1;
-    operands[OP_JGE]   = 1;
-    operands[OP_PRINT] = 1;
-
-    operands[OP_EXIT]  = 0;
-    operands[OP_RET]   = 0;
-}
+    [OP_PUSH]   = 1,
+    [OP_POP]    = 1,
+    [OP_JMP]    = 1,
+    [OP_CALL]   = 1,
+    [OP_INC]    = 1,
+    [OP_DEC]    = 1,
+    [OP_JE]     = 1,
+    [OP_JNE]    = 1,
+    [OP_JL]     = 1,
+    [OP_JG]     = 1,
+    [OP_JLE]    = 1,
+    [OP_JGE]    = 1,
+    [OP_PRINT]  = 1,
+
+    [OP_EXIT]   = 0,
+    [OP_RET]    = 0
+};
 
 unsigned char* read_file(
         const char* fn,
@@ -75,6 +96,80 @@ unsigned char* read_file(
     return out_bytes;
 }
 
+unsigned char* map_file(const char* fn, uint64_t* out_len)
+{
+    int fd = open(fn, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    struct stat file_stat;
+    unsigned char* bytes = NULL;
+
+    if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+        file_stat.st_size > 0)
+    {
+        bytes = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (bytes == MAP_FAILED)
+        {
+            bytes = NULL;
+        }
+        else
+        {
+            madvise(bytes, file_stat.st_size, MADV_SEQUENTIAL);
+            *out_len = file_stat.st_size;
+        }
+    }
+
+    close(fd);
+
+    return bytes;
+}
+
+void unmap_file(unsigned char* bytes, uint64_t len)
+{
+    munmap(bytes, len);
+}
+
+// Byte counts with an optional K, M or G suffix (powers of 1024). Anything
+// that doesn't fit in 64 bits, before or after the suffix, is rejected.
+bool size_from_string(const char* text, uint64_t* out)
+{
+    char* end;
+    errno = 0;
+    uint64_t value = strtoull(text, &end, 0);
+
+    if (end == text || errno == ERANGE || *text == '-')
+    {
+        return false;
+    }
+
+    int shift = 0;
+
+    switch (*end)
+    {
+        case 'G': case 'g': shift += 10; /* fall through */
+        case 'M': case 'm': shift += 10; /* fall through */
+        case 'K': case 'k': shift += 10; end++; break;
+        case 0:             break;
+        default:            return false;
+    }
+
+    if (*end != 0 || value == 0 || value > UINT64_MAX >> shift)
+    {
+        return false;
+    }
+
+    value <<= shift;
+
+    *out = value;
+
+    return true;
+}
+
 int instruction_encoded_len(int operands)
 {
     return 8 + operands * 8;
@@ -91,3 +186,89 @@ bool is_conditional_jump(unsigned char opcode)
            opcode == OP_JL || opcode == OP_JLE ||
            opcode == OP_JG || opcode == OP_JGE;
 }
+
+int bulk_blocks(unsigned char opcode)
+{
+    switch (opcode)
+    {
+        case OP_BCOPY:
+        case OP_BCMP:
+            return 2;
+
+        case OP_BFILL:
+        case OP_BSCAN:
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+enum operand_role operand_role(unsigned char opcode, int ordinal)
+{
+    if (ordinal < bulk_blocks(opcode))
+    {
+        return ROLE_ADDRESS;
+    }
+
+    switch (opcode)
+    {
+        case OP_VLOAD:
+            return ordinal == 0 ? ROLE_VECTOR : ROLE_ADDRESS;
+
+        case OP_VSTORE:
+            return ordinal == 0 ? ROLE_ADDRESS : ROLE_VECTOR;
+
+        case OP_VSPLAT:
+            return ordinal == 0 ? ROLE_VECTOR : ROLE_ANY;
+
+        case OP_VSUM:
+            return ordinal == 0 ? ROLE_ANY : ROLE_VECTOR;
+
+        case OP_VADD:
+        case OP_VSUB:
+        case OP_VMUL:
+        case OP_VMIN:
+        case OP_VMAX:
+            return ROLE_VECTOR;
+
+        default:
+            return ROLE_ANY;
+    }
+}
+
+int operand_bytes(unsigned char opcode, unsigned char size, int ordinal)
+{
+    if ((opcode == OP_VLOAD && ordinal == 1) ||
+        (opcode == OP_VSTORE && ordinal == 0))
+    {
+        return VECTOR_BYTES;
+    }
+
+    return size;
+}
+
+bool size_allowed(unsigned char opcode, unsigned char size)
+{
+    if (is_vector(opcode))
+    {
+        return size == B4 || size == B8;
+    }
+
+    if (is_float(opcode))
+    {
+        return size == B8;
+    }
+
+    return size == B1 || size == B2 || size == B4 || size == B8;
+}
+
+bool is_vector(unsigned char opcode)
+{
+    return opcode >= OP_VLOAD && opcode <= OP_VSUM;
+}
+
+bool is_float(unsigned char opcode)
+{
+    return opcode >= OP_FADD && opcode <= OP_FTOI;
+}
@@ -11,8 +11,10 @@
 #define IMG_HDR_ENTRY_POINT 8
 
 #define REGISTER_COUNT 10
+#define VECTOR_COUNT 8
+#define VECTOR_BYTES 32
 #define MAX_OPERANDS 2
-#define OPCODE_COUNT 22
+#define OPCODE_COUNT 42
 
 enum opcodes
 {
@@ -37,7 +39,27 @@ enum opcodes
     OP_JG,
     OP_JLE,
     OP_JGE,
-    OP_PRINT
+    OP_PRINT,
+    OP_BCOPY,
+    OP_BFILL,
+    OP_BCMP,
+    OP_BSCAN,
+    OP_VLOAD,
+    OP_VSTORE,
+    OP_VSPLAT,
+    OP_VADD,
+    OP_VSUB,
+    OP_VMUL,
+    OP_VMIN,
+    OP_VMAX,
+    OP_VSUM,
+    OP_FADD,
+    OP_FSUB,
+    OP_FMUL,
+    OP_FDIV,
+    OP_FCMP,
+    OP_ITOF,
+    OP_FTOI
 };
 
 enum sizes
@@ -62,6 +84,20 @@ enum registers
     RMEM
 };
 
+// Vector registers have their own numbering. Which operands are vector
+// registers is fixed by the opcode; they're encoded like a register operand.
+enum vector_registers
+{
+    V0,
+    V1,
+    V2,
+    V3,
+    V4,
+    V5,
+    V6,
+    V7
+};
+
 enum operand_type
 {
     IMMEDIATE = 1,
@@ -90,17 +126,47 @@ typedef struct
 
 VECTOR_H(instruction);
 
-void operands_init();
-extern int operands[];
+extern const int operands[];
 
 unsigned char* read_file(
         const char* fn,
         unsigned char* out_bytes,
         int* out_bytes_read);
 
+// Maps a whole regular file read-only. Returns NULL if it can't, as for
+// pipes and empty files.
+unsigned char* map_file(const char* fn, uint64_t* out_len);
+
+void unmap_file(unsigned char* bytes, uint64_t len);
+
 int instruction_encoded_len(int operands);
 
+bool size_from_string(const char* text, uint64_t* out);
+
 bool is_jump(unsigned char opcode);
 bool is_conditional_jump(unsigned char opcode);
 
+// How many leading operands of a bulk memory instruction name blocks by
+// their address, or 0 for any other instruction
+int bulk_blocks(unsigned char opcode);
+
+// What an instruction needs an operand to be, beyond being a valid operand
+enum operand_role
+{
+    ROLE_ANY,
+    ROLE_ADDRESS,
+    ROLE_VECTOR
+};
+
+enum operand_role operand_role(unsigned char opcode, int ordinal);
+
+// Bytes the instruction accesses through an operand that's in memory
+int operand_bytes(unsigned char opcode, unsigned char size, int ordinal);
+
+// Vector lanes are dwords or qwords, and doubles are always qwords
+bool size_allowed(unsigned char opcode, unsigned char size);
+
+bool is_vector(unsigned char opcode);
+bool is_float(unsigned char opcode);
+
 #endif
@@ -0,0 +1,201 @@
+#include <string.h>
+
+#include "simd.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Plain loops, for what the host can't do in vector registers
+#define generic_lanes(bytes, type, stype)                                     \
+    static void lanes_b##bytes(                                               \
+            unsigned char opcode,                                             \
+            unsigned char* dst,                                               \
+            const unsigned char* src)                                         \
+    {                                                                         \
+        type a[VECTOR_BYTES / bytes];                                         \
+        type b[VECTOR_BYTES / bytes];                                         \
+        memcpy(a, dst, VECTOR_BYTES);                                         \
+        memcpy(b, src, VECTOR_BYTES);                                         \
+        for (int i = 0; i < VECTOR_BYTES / bytes; i++)                        \
+        {                                                                     \
+            switch (opcode)                                                   \
+            {                                                                 \
+                case OP_VADD: a[i] += b[i]; break;                            \
+                case OP_VSUB: a[i] -= b[i]; break;                            \
+                case OP_VMUL: a[i] *= b[i]; break;                            \
+                case OP_VMIN: if ((stype)b[i] < (stype)a[i]) a[i] = b[i];     \
+                              break;                                          \
+                case OP_VMAX: if ((stype)b[i] > (stype)a[i]) a[i] = b[i];     \
+                              break;                                          \
+            }                                                                 \
+        }                                                                     \
+        memcpy(dst, a, VECTOR_BYTES);                                         \
+    }
+
+generic_lanes(4, uint32_t, int32_t)
+generic_lanes(8, uint64_t, int64_t)
+
+#if defined(__x86_64__)
+
+// AVX2 has no 64-bit multiply, so it's put together from 32-bit halves:
+// the high halves' product falls off the top
+__attribute__((target("avx2")))
+static __m256i mullo_epi64(__m256i a, __m256i b)
+{
+    __m256i low = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(
+            _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+            _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+
+    return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+}
+
+// 64-bit min and max are a compare and a blend
+__attribute__((target("avx2")))
+static void lanes_avx2(
+        unsigned char opcode,
+        unsigned char size,
+        unsigned char* dst,
+        const unsigned char* src)
+{
+    __m256i a = _mm256_loadu_si256((__m256i*)dst);
+    __m256i b = _mm256_loadu_si256((const __m256i*)src);
+    bool wide = size != B4;
+
+    switch (opcode)
+    {
+        case OP_VADD:
+            a = wide ? _mm256_add_epi64(a, b) : _mm256_add_epi32(a, b);
+            break;
+
+        case OP_VSUB:
+            a = wide ? _mm256_sub_epi64(a, b) : _mm256_sub_epi32(a, b);
+            break;
+
+        case OP_VMUL:
+            a = wide ? mullo_epi64(a, b) : _mm256_mullo_epi32(a, b);
+            break;
+
+        case OP_VMIN:
+            a = wide ? _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b)) :
+                       _mm256_min_epi32(a, b);
+            break;
+
+        case OP_VMAX:
+            a = wide ? _mm256_blendv_epi8(b, a, _mm256_cmpgt_epi64(a, b)) :
+                       _mm256_max_epi32(a, b);
+            break;
+    }
+
+    _mm256_storeu_si256((__m256i*)dst, a);
+}
+
+// SSE2 is all x86-64 guarantees, and it only has the adds and subtracts
+static void lanes_sse2(
+        unsigned char opcode,
+        unsigned char size,
+        unsigned char* dst,
+        const unsigned char* src)
+{
+    for (int half = 0; half < VECTOR_BYTES; half += 16)
+    {
+        __m128i a = _mm_loadu_si128((__m128i*)(dst + half));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + half));
+
+        if (opcode == OP_VADD)
+        {
+            a = size != B4 ? _mm_add_epi64(a, b) : _mm_add_epi32(a, b);
+        }
+        else
+        {
+            a = size != B4 ? _mm_sub_epi64(a, b) : _mm_sub_epi32(a, b);
+        }
+
+        _mm_storeu_si128((__m128i*)(dst + half), a);
+    }
+}
+
+#endif
+
+void simd_lanes(
+        unsigned char opcode,
+        unsigned char size,
+        unsigned char* dst,
+        const unsigned char* src)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        lanes_avx2(opcode, size, dst, src);
+        return;
+    }
+
+    if (opcode == OP_VADD || opcode == OP_VSUB)
+    {
+        lanes_sse2(opcode, size, dst, src);
+        return;
+    }
+#endif
+
+    if (size == B4)
+    {
+        lanes_b4(opcode, dst, src);
+    }
+    else
+    {
+        lanes_b8(opcode, dst, src);
+    }
+}
+
+uint64_t simd_sum(unsigned char size, const unsigned char* v)
+{
+#if defined(__x86_64__)
+    __m128i low = _mm_loadu_si128((const __m128i*)v);
+    __m128i high = _mm_loadu_si128((const __m128i*)(v + 16));
+
+    if (size != B4)
+    {
+        __m128i sum = _mm_add_epi64(low, high);
+        sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+
+        return _mm_cvtsi128_si64(sum);
+    }
+
+    __m128i sum = _mm_add_epi32(low, high);
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return (uint32_t)_mm_cvtsi128_si32(sum);
+#else
+    uint64_t sum = 0;
+
+    for (int i = 0; i < VECTOR_BYTES; i += size == B4 ? B4 : B8)
+    {
+        if (size == B4)
+        {
+            uint32_t lane;
+            memcpy(&lane, v + i, B4);
+            sum += lane;
+        }
+        else
+        {
+            uint64_t lane;
+            memcpy(&lane, v + i, B8);
+            sum += lane;
+        }
+    }
+
+    return size == B4 ? (uint32_t)sum : sum;
+#endif
+}
+
+void simd_splat(unsigned char size, unsigned char* dst, uint64_t value)
+{
+    int lane = size == B4 ? B4 : B8;
+
+    for (int i = 0; i < VECTOR_BYTES; i += lane)
+    {
+        memcpy(dst + i, &value, lane);
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef _SIMD_H
+#define _SIMD_H
+
+#include "shared.h"
+
+// Lane-wise vector arithmetic for the vector instructions. A vector is
+// VECTOR_BYTES bytes of dword or qword lanes (size). x86-64 hosts run these
+// on AVX2 when the CPU has it and SSE2 otherwise; anything else gets plain
+// loops.
+
+// dst = dst op src for vadd, vsub, vmul, vmin and vmax. min and max compare
+// lanes as signed, like cmp.
+void simd_lanes(
+        unsigned char opcode,
+        unsigned char size,
+        unsigned char* dst,
+        const unsigned char* src);
+
+// The lanes added together, wrapping at the lane size
+uint64_t simd_sum(unsigned char size, const unsigned char* v);
+
+void simd_splat(unsigned char size, unsigned char* dst, uint64_t value);
+
+#endif
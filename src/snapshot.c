@@ -0,0 +1,282 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+
+static bool page_is_zero(const unsigned char* page, long page_size)
+{
+    const uint64_t* words = (const uint64_t*)page;
+
+    for (long i = 0; i < page_size / 8; i++)
+    {
+        if (words[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Pages that could hold data: the resident ones, and everything mapped from
+// a file, which can hold data without being resident. Anonymous pages the
+// guest never touched aren't resident, so with a big heap this skips almost
+// all of guest memory without reading it. If mincore fails, every page is a
+// candidate.
+static unsigned char* candidate_pages(
+        machine_state* state,
+        long page_size,
+        uint64_t pages)
+{
+    unsigned char* candidates = malloc(pages);
+
+    if (mincore(state->memory, pages * page_size, candidates) != 0)
+    {
+        memset(candidates, 1, pages);
+        return candidates;
+    }
+
+    for (int i = 0; i < state->file_range_count; i++)
+    {
+        memory_range* range = &state->file_ranges[i];
+        uint64_t first = range->start / page_size;
+        uint64_t end = (range->start + range->len + page_size - 1) /
+                       page_size;
+
+        for (uint64_t page = first; page < end && page < pages; page++)
+        {
+            candidates[page] = 1;
+        }
+    }
+
+    return candidates;
+}
+
+// Candidate pages are still checked for content: a page the guest only read
+// is resident but all zero.
+void write_snapshot(const char* fn, machine_state* state)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint64_t pages = (state->memory_size + page_size - 1) / page_size;
+    unsigned char* candidates = candidate_pages(state, page_size, pages);
+    uint64_t* index = malloc(sizeof(uint64_t) * pages);
+    uint64_t count = 0;
+
+    for (uint64_t page = 0; page < pages; page++)
+    {
+        if ((candidates[page] & 1) &&
+            !page_is_zero(state->memory + page * page_size, page_size))
+        {
+            index[count++] = page;
+        }
+    }
+
+    free(candidates);
+
+    snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.page_size = page_size;
+    header.memory_size = state->memory_size;
+    header.retired = state->retired;
+    memcpy(header.registers, state->registers, sizeof(header.registers));
+    memcpy(header.vectors, state->vectors, sizeof(header.vectors));
+    header.page_count = count;
+
+    uint64_t index_end = sizeof(header) + sizeof(uint64_t) * count;
+    header.data_offset = (index_end + page_size - 1) / page_size * page_size;
+
+    // Written beside the target and renamed over it, since the guest may
+    // have been restored from the very file being replaced and still have
+    // its pages mapped
+    char* temp_fn = malloc(strlen(fn) + 5);
+    sprintf(temp_fn, "%s.tmp", fn);
+
+    FILE* file = fopen(temp_fn, "w");
+
+    if (!file)
+    {
+        printf("Unable to open file [%s] for writing.\n", temp_fn);
+        exit(26);
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(index, sizeof(uint64_t), count, file);
+
+    for (uint64_t i = index_end; i < header.data_offset; i++)
+    {
+        fputc(0, file);
+    }
+
+    for (uint64_t i = 0; i < count; i++)
+    {
+        fwrite(state->memory + index[i] * page_size, page_size, 1, file);
+    }
+
+    if (ferror(file) || fclose(file) != 0 || rename(temp_fn, fn) != 0)
+    {
+        printf("Failed to write snapshot [%s].\n", fn);
+        exit(27);
+    }
+
+    free(temp_fn);
+    free(index);
+}
+
+static void invalid_snapshot(const char* fn, const char* reason)
+{
+    printf("Invalid snapshot [%s]: %s.\n", fn, reason);
+    exit(28);
+}
+
+static void read_exactly(
+        const char* fn,
+        int fd,
+        void* out,
+        size_t len,
+        uint64_t offset)
+{
+    size_t total = 0;
+
+    while (total < len)
+    {
+        ssize_t got = pread(fd, (char*)out + total, len - total,
+                            offset + total);
+
+        if (got <= 0)
+        {
+            invalid_snapshot(fn, "truncated");
+        }
+
+        total += got;
+    }
+}
+
+// Maps each run of consecutive pages with one mmap. hugetlb memory can't
+// have files mapped into it and a snapshot from a host with another page
+// size can't be mapped at all, so those are read instead.
+static void restore_pages(
+        const char* fn,
+        int fd,
+        machine_state* state,
+        snapshot_header* header,
+        uint64_t* index)
+{
+    uint64_t page_size = header->page_size;
+    bool can_map = page_size == sysconf(_SC_PAGESIZE) &&
+                   state->huge_pages != HUGE_PAGES_HUGETLB;
+
+    for (uint64_t i = 0; i < header->page_count; )
+    {
+        uint64_t run = 1;
+
+        while (i + run < header->page_count &&
+               index[i + run] == index[i] + run)
+        {
+            run++;
+        }
+
+        uint64_t start = index[i] * page_size;
+        uint64_t len = run * page_size;
+        uint64_t offset = header->data_offset + i * page_size;
+
+        if (can_map &&
+            mmap(state->memory + start, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, fd, offset) != MAP_FAILED)
+        {
+            memory_add_file_range(state, start, len);
+        }
+        else
+        {
+            // The last page can run past the end of guest memory
+            if (start + len > state->memory_size)
+            {
+                len = state->memory_size - start;
+            }
+
+            read_exactly(fn, fd, state->memory + start, len, offset);
+        }
+
+        i += run;
+    }
+}
+
+void load_snapshot(const char* fn, machine_state* state, memory_config* config)
+{
+    int fd = open(fn, O_RDONLY);
+    struct stat file_stat;
+
+    if (fd < 0 || fstat(fd, &file_stat) < 0)
+    {
+        printf("Failed to open file.\n");
+        exit(20);
+    }
+
+    snapshot_header header;
+    read_exactly(fn, fd, &header, sizeof(header), 0);
+
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)))
+    {
+        invalid_snapshot(fn, "not a snapshot");
+    }
+
+    if (header.version != SNAPSHOT_VERSION)
+    {
+        invalid_snapshot(fn, "unsupported version");
+    }
+
+    uint64_t page_size = header.page_size;
+
+    if (page_size < 8 || (page_size & (page_size - 1)) ||
+        header.memory_size == 0)
+    {
+        invalid_snapshot(fn, "bad header");
+    }
+
+    uint64_t pages = (header.memory_size + page_size - 1) / page_size;
+
+    if (header.page_count > pages ||
+        header.data_offset % page_size ||
+        header.data_offset < sizeof(header) +
+                             sizeof(uint64_t) * header.page_count ||
+        file_stat.st_size < header.data_offset +
+                            header.page_count * page_size)
+    {
+        invalid_snapshot(fn, "truncated");
+    }
+
+    uint64_t* index = malloc(sizeof(uint64_t) * (header.page_count + 1));
+    read_exactly(fn, fd, index, sizeof(uint64_t) * header.page_count,
+                 sizeof(header));
+
+    for (uint64_t i = 0; i < header.page_count; i++)
+    {
+        if (index[i] >= pages || (i > 0 && index[i] <= index[i - 1]))
+        {
+            invalid_snapshot(fn, "bad page index");
+        }
+    }
+
+    memory_config memory = {
+        header.memory_size, config->huge_pages, config->safe
+    };
+    memory_init(state, &memory);
+
+    restore_pages(fn, fd, state, &header, index);
+
+    free(index);
+    close(fd);
+
+    memcpy(state->registers, header.registers, sizeof(state->registers));
+    memcpy(state->vectors, header.vectors, sizeof(state->vectors));
+    state->retired = header.retired;
+
+    output_init(&state->output, STDOUT_FILENO, OUTPUT_TEXT,
+                isatty(STDOUT_FILENO) ? FLUSH_LINE : FLUSH_SIZE);
+}
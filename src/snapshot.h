@@ -0,0 +1,35 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include "emulator.h"
+
+#define SNAPSHOT_MAGIC "BEMUSNAP"
+#define SNAPSHOT_VERSION 2
+
+// A snapshot file is this header, then page_count uint64_t guest page
+// numbers in ascending order, then the pages themselves starting at
+// data_offset. data_offset is page aligned so the pages can be mapped
+// straight from the file. Pages that were never touched, or hold only
+// zeroes, are left out.
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t memory_size;
+    uint64_t retired;
+    uint64_t registers[REGISTER_COUNT];
+    unsigned char vectors[VECTOR_COUNT][VECTOR_BYTES];
+    uint64_t page_count;
+    uint64_t data_offset;
+} snapshot_header;
+
+void write_snapshot(const char* fn, machine_state* state);
+
+// Sets up memory and output like load_binary, but from a snapshot. Memory
+// is the snapshot's size and its pages are mapped copy-on-write, so they're
+// only read in as the guest touches them. Only config's huge page mode is
+// used.
+void load_snapshot(const char* fn, machine_state* state, memory_config* config);
+
+#endif
@@ -2,26 +2,42 @@
 #define _VECTOR_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <malloc.h>
+#include <string.h>
 
+#include "arena.h"
+
+// Vectors own their items through malloc, or borrow them from an arena when
+// made with one; those are never freed on their own. capacity is a hint for
+// how many items to make room for up front.
 #define VECTOR_H(t)                                                           \
     typedef struct                                                            \
     {                                                                         \
-        int allocated;                                                        \
-        int len;                                                              \
+        uint64_t allocated;                                                   \
+        uint64_t len;                                                         \
         t* items;                                                             \
+        arena* arena;                                                         \
     } vec_##t;                                                                \
                                                                               \
     vec_##t vec_##t##_new();                                                  \
+    vec_##t vec_##t##_new_in(arena* a, uint64_t capacity);                    \
     t* vec_##t##_add(vec_##t* vec);                                           \
 
 #define VECTOR_C(t)                                                           \
     vec_##t vec_##t##_new()                                                   \
+    {                                                                         \
+        return vec_##t##_new_in(NULL, 1);                                     \
+    }                                                                         \
+                                                                              \
+    vec_##t vec_##t##_new_in(arena* a, uint64_t capacity)                     \
     {                                                                         \
         vec_##t ret;                                                          \
-        ret.allocated = 1;                                                    \
+        ret.allocated = capacity > 0 ? capacity : 1;                          \
         ret.len = 0;                                                          \
-        ret.items = malloc(sizeof(t) * ret.allocated);                        \
+        ret.arena = a;                                                        \
+        ret.items = a ? arena_alloc(a, sizeof(t) * ret.allocated) :           \
+                        malloc(sizeof(t) * ret.allocated);                    \
         return ret;                                                           \
     }                                                                         \
                                                                               \
@@ -30,7 +46,19 @@
         if (vec->len == vec->allocated)                                       \
         {                                                                     \
             vec->allocated *= 2;                                              \
-            vec->items = realloc(vec->items, sizeof(t) * vec->allocated);     \
+                                                                              \
+            if (vec->arena)                                                   \
+            {                                                                 \
+                t* items = arena_alloc(vec->arena,                            \
+                                       sizeof(t) * vec->allocated);           \
+                memcpy(items, vec->items, sizeof(t) * vec->len);              \
+                vec->items = items;                                           \
+            }                                                                 \
+            else                                                              \
+            {                                                                 \
+                vec->items = realloc(vec->items,                              \
+                                     sizeof(t) * vec->allocated);             \
+            }                                                                 \
         }                                                                     \
         return &vec->items[vec->len++];                                       \
     }
@@ -0,0 +1,167 @@
+#include <stdlib.h>
+
+#include "verifier.h"
+
+static const char* verify_operand(
+        machine_state* state,
+        instruction* inst,
+        int ordinal)
+{
+    unsigned char type = inst->operand_types[ordinal];
+    complex_operand* comp = (complex_operand*)&inst->operands[ordinal];
+    bool address = type & ADDRESS;
+
+    // Exactly one of ADDRESS and LITERAL, then an immediate, a register or a
+    // register with extras
+    if (address == !!(type & LITERAL) ||
+        (type & ~(ADDRESS | LITERAL)) == 0 ||
+        (type & ~(IMMEDIATE | REGISTER | LITERAL | ADDRESS | COMPLEX)) ||
+        ((type & IMMEDIATE) && (type & (REGISTER | COMPLEX))) ||
+        ((type & COMPLEX) && !(type & REGISTER)))
+    {
+        return "bad operand type";
+    }
+
+    if (type & IMMEDIATE)
+    {
+        uint64_t addr = inst->operands[ordinal];
+        uint64_t bytes = operand_bytes(inst->opcode, inst->size, ordinal);
+
+        if (address && (state->memory_size < bytes ||
+                        addr > state->memory_size - bytes))
+        {
+            return "address outside guest memory";
+        }
+
+        return NULL;
+    }
+
+    if (comp->base >= REGISTER_COUNT ||
+        (comp->register2_sign && comp->register2 >= REGISTER_COUNT))
+    {
+        return "bad register";
+    }
+
+    return NULL;
+}
+
+const char* verify_instruction(
+        machine_state* state,
+        uint64_t rip,
+        uint64_t code_end,
+        int* out_len)
+{
+    instruction* inst = (instruction*)(state->memory + rip);
+
+    if (inst->opcode >= OPCODE_COUNT)
+    {
+        return "bad opcode";
+    }
+
+    *out_len = instruction_encoded_len(operands[inst->opcode]);
+
+    if (rip + *out_len > code_end)
+    {
+        return "runs past the end of the code";
+    }
+
+    if (!size_allowed(inst->opcode, inst->size))
+    {
+        return "bad operand size";
+    }
+
+    for (int i = 0; i < operands[inst->opcode]; i++)
+    {
+        enum operand_role role = operand_role(inst->opcode, i);
+        complex_operand* comp = (complex_operand*)&inst->operands[i];
+
+        if (role == ROLE_VECTOR)
+        {
+            if (inst->operand_types[i] != (REGISTER | LITERAL) ||
+                comp->base >= VECTOR_COUNT)
+            {
+                return "bad vector register";
+            }
+
+            continue;
+        }
+
+        const char* problem = verify_operand(state, inst, i);
+
+        if (problem)
+        {
+            return problem;
+        }
+
+        if (role == ROLE_ADDRESS && !(inst->operand_types[i] & ADDRESS))
+        {
+            return "operand has to be an address";
+        }
+    }
+
+    return NULL;
+}
+
+// Whether target starts an instruction; starts is indexed by code slot
+static bool starts_instruction(bool* starts, uint64_t code_end, uint64_t rip)
+{
+    return rip >= IMG_HDR_LEN && rip < code_end &&
+           (rip - IMG_HDR_LEN) % 8 == 0 && starts[(rip - IMG_HDR_LEN) / 8];
+}
+
+int verify_image(machine_state* state, char* error)
+{
+    uint64_t code_bytes = *(uint64_t*)(state->memory + IMG_HDR_CODE_BYTES);
+    uint64_t code_end = IMG_HDR_LEN + code_bytes;
+    bool* starts = calloc(code_bytes / 8 + 1, sizeof(bool));
+    int result = 0;
+
+    for (uint64_t rip = IMG_HDR_LEN; rip < code_end && !result; )
+    {
+        int len = 8;
+        const char* problem = verify_instruction(state, rip, code_end, &len);
+
+        if (problem)
+        {
+            snprintf(error, IMAGE_ERROR_LEN, "Instruction at rip %llu: %s.",
+                     rip, problem);
+            result = 33;
+        }
+
+        starts[(rip - IMG_HDR_LEN) / 8] = true;
+        rip += len;
+    }
+
+    for (uint64_t rip = IMG_HDR_LEN; rip < code_end && !result; )
+    {
+        instruction* inst = (instruction*)(state->memory + rip);
+
+        if ((is_jump(inst->opcode) || inst->opcode == OP_CALL) &&
+            inst->operand_types[0] == (IMMEDIATE | LITERAL) &&
+            !starts_instruction(starts, code_end,
+                                IMG_HDR_LEN + inst->operands[0]))
+        {
+            snprintf(error, IMAGE_ERROR_LEN,
+                     "Instruction at rip %llu: jumps to %llu, which doesn't "
+                     "start an instruction.", rip, inst->operands[0]);
+            result = 33;
+        }
+
+        rip += instruction_encoded_len(operands[inst->opcode]);
+    }
+
+    uint64_t entry = IMG_HDR_LEN +
+                     *(uint64_t*)(state->memory + IMG_HDR_ENTRY_POINT);
+
+    if (!result && !starts_instruction(starts, code_end, entry))
+    {
+        snprintf(error, IMAGE_ERROR_LEN,
+                 "Image entry point %llu doesn't start an instruction.",
+                 entry - IMG_HDR_LEN);
+        result = 33;
+    }
+
+    free(starts);
+
+    return result;
+}
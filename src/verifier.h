@@ -0,0 +1,21 @@
+#ifndef _VERIFIER_H
+#define _VERIFIER_H
+
+#include "emulator.h"
+
+// Checks the instruction at rip on its own: opcode, operand size, operand
+// types, register numbers, and that absolute addresses are inside guest
+// memory. Returns NULL if it's fine or a description of the problem. The
+// instruction's length goes in out_len either way when the opcode is known.
+const char* verify_instruction(
+        machine_state* state,
+        uint64_t rip,
+        uint64_t code_end,
+        int* out_len);
+
+// Checks a loaded image before it runs: every instruction, and that the
+// entry point and every static jump or call target start an instruction.
+// Returns 0, or the exit code bemu uses with a message in error.
+int verify_image(machine_state* state, char* error);
+
+#endif
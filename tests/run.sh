@@ -0,0 +1,59 @@
+#!/bin/bash
+# Assembles each tests/*.basm with and without basm -O and runs both on every
+# engine, with and without --safe, comparing the output with the .expected
+# file next to it.
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+failed=0
+
+for source in "$root"/tests/*.basm; do
+    name=$(basename "$source" .basm)
+
+    for optimize in "" -O; do
+        (cd "$work" && "$root/bin/basm" $optimize "$source" > /dev/null) || {
+            echo "FAIL $name: doesn't assemble $optimize"
+            failed=1
+            continue
+        }
+
+        for engine in --dispatch=call --dispatch=goto --dispatch=tail --jit; do
+            for safe in "" --safe; do
+                "$root/bin/bemu" $engine $safe "$work/b.out" \
+                    > "$work/out" 2> /dev/null
+
+                if ! cmp -s "$work/out" "$root/tests/$name.expected"; then
+                    echo "FAIL $name: $optimize $engine $safe"
+                    failed=1
+                fi
+            done
+        done
+    done
+done
+
+# The examples have no expected output, but basm -O mustn't change it
+for source in "$root"/examples/*.basm; do
+    name=$(basename "$source" .basm)
+
+    (cd "$work" && "$root/bin/basm" "$source" > /dev/null &&
+        "$root/bin/bemu" b.out > plain 2> /dev/null &&
+        "$root/bin/basm" -O "$source" > /dev/null &&
+        "$root/bin/bemu" b.out > optimized 2> /dev/null &&
+        cmp -s plain optimized) || {
+        echo "FAIL $name: differs with -O"
+        failed=1
+    }
+done
+
+# A smaller run of the assembler stress test, still past the old limit of
+# 65535 instructions
+if ! BENCH_ASM_LINES=120000 "$root/bench/asm.sh" > /dev/null; then
+    echo "FAIL assembler stress test"
+    failed=1
+fi
+
+[ $failed = 0 ] && echo "All tests passed."
+
+exit $failed